@@ -1,714 +1,216 @@
-#include <string>
-#include <vector>
-#include <fstream>
-#include <sstream>
-#include <iostream>
-#include <cmath>
+#include "subedit_lib.hpp"
 
-void print() {
-    std::cout << std::endl;
-}
-
-template<typename T, typename ... Args>
-void print(const T& t, const Args& ... args) {
-    std::cout << t;
-    print(args...);
-}
-
-template<typename ... Args>
-void error(const Args& ... args) {
-    std::cout << "error: ";
-    print(args...);
-}
-
-template<typename ... Args>
-void warning(const Args& ... args) {
-    std::cout << "warning: ";
-    print(args...);
-}
-
-template<typename ... Args>
-void note(const Args& ... args) {
-    std::cout << "note: ";
-    print(args...);
-}
-
-void put() {
-    std::cout << std::flush;
-}
-
-template<typename T, typename ... Args>
-void put(const T& t, const Args& ... args) {
-    std::cout << t;
-    put(args...);
-}
-
-namespace string {
-    template<typename T>
-    bool from_string(const std::string& s, T& t) {
-        std::istringstream ss(s);
-        return (ss >> t);
-    }
+int main(int argc, char* argv[]) {
+    std::vector<std::string> file_names;
+    std::string output_name;
+    // Commands given on the command line, one per line; they are run instead of
+    // the interactive prompt
+    std::string script;
+    bool batch = false;
+    std::size_t threads = parallel::thread_count();
+    bool streaming = false;
+    std::string socket_name;
+    // Declared first, to be printed after everything else is done
+    stats::report report;
+
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        if (arg == "--script" || arg == "--exec" || arg == "--retime" || arg == "--fps" ||
+            arg == "--align" || arg == "-o" || arg == "-j" || arg == "--serve") {
+            if (i + 1 == argc) {
+                error("missing argument to ", arg);
+                return 1;
+            }
 
-    std::string trim(std::string s, const std::string& chars = " \t") {
-        std::size_t spos = s.find_first_of(chars);
-        if (spos == 0) {
-            std::size_t epos = s.find_first_not_of(chars);
-            if (epos == s.npos) return "";
-            s = s.substr(epos);
-        }
+            std::string value = argv[++i];
+            if (arg == "-o") {
+                output_name = value;
+                continue;
+            } else if (arg == "--serve") {
+                socket_name = value;
+                continue;
+            } else if (arg == "-j") {
+                if (!string::from_string(value, threads) || threads == 0) {
+                    error("invalid number of threads: ", value);
+                    return 1;
+                }
 
-        spos = s.find_last_of(chars);
-        if (spos == s.size()-1) {
-            std::size_t epos = s.find_last_not_of(chars);
-            s = s.erase(epos+1, s.size() - epos+1);
-        }
+                continue;
+            }
 
-        return s;
-    }
+            if (arg == "--script") {
+                std::ifstream f(value.c_str());
+                if (!f.is_open()) {
+                    error("cannot open file: "+value+".");
+                    return 1;
+                }
 
-    std::string to_lower(std::string s) {
-        for (auto& c : s) {
-            c = ::tolower(c);
-        }
-        return s;
-    }
+                std::ostringstream ss;
+                ss << f.rdbuf();
+                value = ss.str();
+                if (!value.empty() && value.back() != '\n') value += '\n';
+            } else if (arg == "--exec") {
+                std::replace(value.begin(), value.end(), ';', '\n');
+                value += '\n';
+            } else if (arg == "--retime") {
+                value = "retime "+value+"\n";
+            } else if (arg == "--align") {
+                value = "align "+value+"\n";
+            } else {
+                value = "fps "+value+"\n";
+            }
 
-    std::string erase_start(std::string s, std::size_t n) {
-        if (n >= s.size()) {
-            return "";
+            script += value;
+            batch = true;
+        } else if (arg == "--check" || arg == "--fix") {
+            script += arg == "--check" ? "check\n" : "check fix\n";
+            batch = true;
+        } else if (arg == "--stream") {
+            streaming = true;
+        } else if (arg == "--cache") {
+            cache::enabled = true;
+        } else if (arg == "--stats") {
+            report.enabled = true;
+        } else if (arg == "-h" || arg == "--help") {
+            print_help();
+            return 0;
+        } else {
+            file_names.push_back(arg);
         }
-
-        s.erase(0, n);
-        return s;
     }
 
-    std::vector<std::string> cut(const std::string& ts, const std::string& pattern) {
-        std::vector<std::string> ret;
-        std::size_t p = 0, op = 0;
-        while ((p = ts.find(pattern, op)) != ts.npos) {
-            ret.push_back(ts.substr(op, p - op));
-            op = p + pattern.size();
+    if (!socket_name.empty()) {
+        if (batch || streaming || !file_names.empty()) {
+            error("--serve cannot be used with files, scripts or --stream");
+            return 1;
         }
 
-        ret.push_back(ts.substr(op));
-
-        return ret;
+        return server::run(socket_name) ? 0 : 1;
     }
 
-    template<typename T>
-    std::string convert(const T& t) {
-        std::ostringstream ss;
-        ss << t;
-        return ss.str();
-    }
+    if (streaming) {
+        // The output is the subtitle itself: messages go to the error output
+        output = &std::cerr;
 
-    template<typename T>
-    std::string convert(const T& t, std::size_t n, char fill = '0') {
-        if (n <= 1) {
-            return convert(t);
-        }
-        if (t == 0) {
-            return std::string(n-1, fill)+'0';
-        } else {
-            std::ostringstream ss;
-            ss << t;
-            std::size_t nz = n-1 - floor(log10(t));
-            if (nz > 0 && nz < 6) {
-                return std::string(nz, fill) + ss.str();
-            } else {
-                return ss.str();
-            }
+        std::vector<stream::rule> rules;
+        std::string err;
+        if (!stream::parse_script(script, rules, err)) {
+            error(err);
+            return 1;
+        } else if (file_names.size() > 1) {
+            error("only one file can be streamed at a time");
+            return 1;
         }
-    }
-}
 
-struct time_key {
-    time_key() : seconds(-1), milliseconds(-1) {}
-
-    explicit time_key(float sec) : seconds(floor(sec)), milliseconds((sec - floor(sec))*1000) {}
-
-    time_key(const std::string& str, std::string& err) : seconds(0), milliseconds(0) {
-        std::vector<std::string> words = string::cut(string::trim(str), ":");
-        std::vector<std::string>::iterator iter = words.begin();
-        int tmp = 0;
-
-        if (words.size() == 3) {
-            if (!string::from_string(*iter, tmp)) {
-                err = "invalid number of hours";
-                seconds = milliseconds = -1;
-                return;
-            } else {
-                seconds += tmp*3600;
+        int in_fd = 0, out_fd = 1;
+        if (!file_names.empty() && file_names[0] != "-") {
+            in_fd = ::open(file_names[0].c_str(), O_RDONLY);
+            if (in_fd < 0) {
+                error("cannot open file: "+file_names[0]+".");
+                return 1;
             }
-
-            ++iter;
         }
 
-        if (words.size() >= 2) {
-            if (!string::from_string(*iter, tmp)) {
-                err = "invalid number of minutes";
-                seconds = milliseconds = -1;
-                return;
-            } else {
-                seconds += tmp*60;
+        if (!output_name.empty()) {
+            out_fd = ::open(output_name.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+            if (out_fd < 0) {
+                error(file::system_error("cannot create file", output_name));
+                return 1;
             }
-
-            ++iter;
-        }
-
-        words = string::cut(*iter, ",");
-        if (!string::from_string(words.front(), tmp)) {
-            err = "invalid number of seconds";
-            seconds = milliseconds = -1;
-            return;
-        } else {
-            seconds += tmp;
         }
 
-        if (words.size() == 2) {
-            if (!string::from_string(words.back(), milliseconds)) {
-                err = "invalid number of milliseconds";
-                seconds = milliseconds = -1;
-                return;
-            }
+        bool ok = stream::run(in_fd, out_fd, rules);
+        if (out_fd != 1 && ::close(out_fd) != 0) {
+            error(file::system_error("cannot write file", output_name));
+            ok = false;
         }
 
-        normalize_();
-    }
-
-    time_key(int sec, int msec) : seconds(sec), milliseconds(msec) {
-        normalize_();
-    }
-
-    bool valid() const {
-        return seconds != -1 && milliseconds != -1;
-    }
-
-    time_key& operator += (float sec) {
-        seconds += floor(sec);
-        milliseconds += (sec - floor(sec))*1000;
-        normalize_();
-        return *this;
-    }
-
-    time_key& operator -= (float sec) {
-        seconds -= floor(sec);
-        milliseconds -= (sec - floor(sec))*1000;
-        normalize_();
-        return *this;
-    }
-
-    time_key operator + (float sec) const {
-        time_key tmp(*this);
-        tmp += sec;
-        return tmp;
-    }
-
-    time_key operator - (float sec) const {
-        time_key tmp(*this);
-        tmp -= sec;
-        return tmp;
+        return ok ? 0 : 1;
     }
 
-    float operator - (const time_key& t) const {
-        int sec = seconds - t.seconds;
-        int msec = milliseconds - t.milliseconds;
-        normalize_(sec, msec);
-        return sec + msec/1000.0f;
+    if (file_names.empty()) {
+        print_help();
+        return 0;
     }
 
-    bool operator < (const time_key& t) const {
-        if (seconds == t.seconds) {
-            return (milliseconds < t.milliseconds);
+    // Directories stand for all the subtitle files they contain
+    std::vector<std::string> files;
+    bool several = file_names.size() > 1;
+    for (auto& name : file_names) {
+        struct stat st;
+        if (::stat(name.c_str(), &st) == 0 && S_ISDIR(st.st_mode)) {
+            several = true;
+            if (!list_files(name, files)) return 1;
         } else {
-            return (seconds < t.seconds);
+            files.push_back(name);
         }
     }
 
-    bool operator <= (const time_key& t) const {
-        if (seconds == t.seconds) {
-            return (milliseconds <= t.milliseconds);
-        } else {
-            return (seconds <= t.seconds);
+    if (several) {
+        if (!batch) {
+            error("several files can only be edited with --script, --exec, --retime, --fps,",
+                " --align, --check or --fix");
+            return 1;
+        } else if (!output_name.empty()) {
+            error("-o cannot be used with several files");
+            return 1;
         }
-    }
 
-    bool operator > (const time_key& t) const {
-        if (seconds == t.seconds) {
-            return (milliseconds > t.milliseconds);
-        } else {
-            return (seconds > t.seconds);
-        }
+        return run_script_on_files(files, script, threads);
     }
 
-    bool operator >= (const time_key& t) const {
-        if (seconds == t.seconds) {
-            return (milliseconds >= t.milliseconds);
-        } else {
-            return (seconds >= t.seconds);
-        }
+    if (batch) {
+        std::uint64_t bytes = 0;
+        return run_script(files[0], output_name, script, true, bytes) ? 0 : 1;
     }
 
-private :
-    int seconds;
-    int milliseconds;
-
-    static void normalize_(int& sec, int& msec) {
-        while (msec >= 1000) {
-            ++sec;
-            msec -= 1000;
-        }
-        while (msec < 0) {
-            --sec;
-            msec += 1000;
+    // Edits that were not all saved last time are replayed on the original text,
+    // unless the file was modified since, i.e., it is not in a state the session
+    // saved it in. If it was being saved, the replay replaces the interrupted save.
+    std::string target = output_name.empty() ? files[0] : output_name;
+    edit_journal journal(target, files[0]);
+    std::vector<std::string> replay;
+    std::vector<file_state> saved;
+    bool recover = journal.read(replay, saved);
+    if (recover) {
+        std::string pending = file::pending_name(target);
+        bool saving = ::access(pending.c_str(), F_OK) == 0;
+        file_state disk;
+        disk.read(target);
+        bool ours = saving || std::find(saved.begin(), saved.end(), disk) != saved.end();
+        if (!ours || ::access(journal.base_name().c_str(), R_OK) != 0) {
+            warning("ignoring the edits of an interrupted session: ", target,
+                " was modified since");
+            recover = false;
+        } else if (saving) {
+            ::unlink(pending.c_str());
         }
     }
 
-    void normalize_() {
-        if (!valid()) return;
-        normalize_(seconds, milliseconds);
+    subtitle_track track;
+    if (!load_track(recover ? journal.base_name() : files[0], track)) {
+        return 1;
     }
 
-    friend std::ostream& operator << (std::ostream& o, const time_key& t) {
-        int hour = t.seconds/3600;
-        int min = (t.seconds - hour*3600)/60;
-        int sec = (t.seconds - hour*3600 - min*60);
-
-        return o << string::convert(hour, 2) << ":" << string::convert(min, 2)
-            << ":" << string::convert(sec, 2) << "," << string::convert(t.milliseconds, 3);
+    std::string err;
+    if (recover && !journal.resume(err)) {
+        error(err);
+        return 1;
     }
-};
-
-struct entry {
-    std::size_t id;
-    time_key start;
-    time_key end;
-    std::string content;
-};
-
-std::ostream& operator << (std::ostream& o, const entry& e) {
-    return o << e.id << "\n" << e.start << " --> " << e.end << "\n" << e.content << "\n";
-}
-
-bool find_next(std::vector<entry>& array, std::vector<entry>::iterator& iter,
-    const std::string& str) {
 
-    while (iter != array.end()) {
-        if (iter->content.find(str) != std::string::npos) {
-            return true;
-        }
-
-        ++iter;
-    }
-
-    return false;
-}
-
-bool find_previous(std::vector<entry>& array, std::vector<entry>::iterator& iter,
-    const std::string& str) {
-
-    while (iter != array.begin()) {
-        --iter;
+    note("if you need help, type 'help' or 'h'. Type 'q' to exit.\n");
 
-        if (iter->content.find(str) != std::string::npos) {
-            return true;
-        }
+    session ses(track, target, true, &journal);
+    if (recover && !ses.replay(replay)) {
+        return 1;
     }
 
-    return false;
-}
-
-void print_help() {
-    print("\nsubedit v1.0\n");
-
-    print("  This program can do some basic editing on subtitles.");
-    print("  Its only function for now it to be able to add a delay to a");
-    print("  particular sentence, shifting all the following ones.");
-    print("  To do so, you must first pick the sentence you want to shift");
-    print("  (using any of the various possibilities described below),");
-    print("  then press 'Enter' to input the amount of seconds you want");
-    print("  to add/remove. The program will update the subtitle accordingly");
-    print("  and save it right away, so you can immediately check the result");
-    print("  in your favorite movie player.");
-    print("  Note that some players require a restart for the changes to be");
-    print("  effectives (VLC for example).\n");
-
-    print("Available search commands:");
-    print("  hh:mm:ss,mili : select the sentence just after the provided time stamp");
-    print("  any text      : search for the first occurrence of 'any text' and enters search mode");
-    print("  ?             : exit search mode");
-    print("  #n            : select the 'n'th sentence ('n'th occurrence in search mode)");
-    print("  +x            : advance 'x' times (next occurrences in search mode)");
-    print("  +             : advance once (next occurrence in search mode)");
-    print("  -x            : step back 'x' times (previous occurrences in search mode)");
-    print("  -             : step back once (previous occurrence in search mode)\n");
-    print("  .             : recall the current sentence\n");
-
-    print("Other commands:");
-    print("  'empty'       : start editing the current sentence's time stamp");
-    print("  help or h     : display this text");
-    print("  quit or q     : exit the program\n");
-}
-
-int main(int argc, char* argv[]) {
-    std::vector<entry> entries;
-    std::string file_name;
-
-    if (argc > 1) {
-        file_name = argv[argc-1];
-        std::ifstream file(file_name);
-
-        if (!file.is_open()) {
-            error("cannot open file: "+file_name+".");
-            return 1;
-        }
-
-        entry e;
-        std::size_t count = 0;
-        std::size_t l = 0;
-        while (!file.eof()) {
-            ++l;
-            std::string line;
-            getline(file, line);
-
-            if (!line.empty()) {
-                line = string::trim(line);
-                if (count == 0) {
-                    if (!string::from_string(line, e.id)) {
-                        error("bad entry ID ('", line, "')");
-                        note("parsing l.", l);
-                        return 1;
-                    }
-                } else if (count == 1) {
-                    std::vector<std::string> words = string::cut(line, " --> ");
-                    if (words.size() == 2) {
-                        std::string err;
-                        e.start = time_key(words.front(), err);
-                        if (!e.start.valid()) {
-                            error(err);
-                            note("parsing l.", l, " start time (", words.front(), ")");
-                            return 1;
-                        }
-
-                        err.clear();
-                        e.end = time_key(words.back(), err);
-                        if (!e.end.valid()) {
-                            error(err);
-                            note("parsing l.", l, " end time (", words.back(), ")");
-                            return 1;
-                        }
-                    } else {
-                        error("bad time tag format ('", line, "')");
-                        note("expected <time1> --> <time2>");
-                        note("parsing l.", l);
-                        return 1;
-                    }
-                } else {
-                    e.content += line + "\n";
-                }
-                ++count;
-            } else if (count != 0) {
-                entries.push_back(e);
-                e.content = "";
-                count = 0;
-            }
-        }
-
-        file.close();
-
-        note("subtitle successfully loaded!");
-    } else {
-        print_help();
-        return 0;
+    std::string s;
+    while (!ses.done()) {
+        ses.prompt();
+        if (!getline(std::cin, s)) break;
+        ses.run(s, std::cin);
     }
 
-    note("if you need help, type 'help' or 'h'. Type 'q' to exit.\n");
-
-    bool no_display = true;
-    bool search_mode = false;
-    std::string search_string = "";
-    std::vector<entry>::iterator iter = entries.begin();
-
-    while (true) {
-        if (!no_display && iter != entries.end()) {
-            print("\n[", iter - entries.begin(), "] ", iter->start, " :\n\n", iter->content);
-        }
-
-        no_display = false;
-
-        put("> ");
-
-        std::string s;
-        getline(std::cin, s);
-        s = string::trim(s);
-        std::string low = string::to_lower(s);
-
-        if (s.empty()) {
-            no_display = true;
-            put("\ncorrected time (empty to abord): ");
-
-            float sec = 0.0f;
-            bool stop = false;
-            while (true) {
-                getline(std::cin, s);
-
-                if (s.empty()) {
-                    stop = true;
-                    break;
-                }
-
-                s = string::trim(s);
-                if (s[0] == '+' || s[0] == '-') {
-                    if (!string::from_string(s, sec)) {
-                        error("invalid time duration, please enter a time stamp, a number, or nothing "
-                            "to abort): ");
-                    } else {
-                        break;
-                    }
-                } else {
-                    std::string err;
-                    time_key tmp(s, err);
-                    if (!tmp.valid()) {
-                        error(err, ", please enter a time stamp, a number, or nothing "
-                            "to abort): ");
-                    } else {
-                        sec = tmp - iter->start;
-                        note("shifting by ", (sec > 0 ? "+" : ""), sec, " seconds");
-                        break;
-                    }
-                }
-            }
-
-            if (stop) {
-                print("");
-                continue;
-            }
-
-            put("note: editing subtitle, please wait... ");
-
-            for (auto iter_tmp = iter; iter_tmp != entries.end(); ++iter_tmp) {
-                iter_tmp->start += sec;
-                iter_tmp->end += sec;
-            }
-
-            put("done (", entries.end() - iter, " entries modified).\nnote: saving... ");
-
-            std::ofstream file(file_name);
-
-            for (auto& e : entries) {
-                file << e;
-            }
-
-            file.close();
-
-            print(" done.\n");
-            no_display = false;
-
-            continue;
-        } else if (low == "q" || low == "quit") {
-            return 0;
-        } else if (low == "h" || low == "help") {
-            print_help();
-            no_display = true;
-            continue;
-        } else {
-            char c = s[0];
-            if (c == '#') {
-                s = string::erase_start(s, 1);
-
-                std::size_t num = 0;
-                if (!string::from_string(s, num)) {
-                    error("invalid number of entry\n");
-                    no_display = true;
-                    continue;
-                }
-
-                if (!search_mode) {
-                    if (num >= entries.size()) {
-                        error("not enough entries (max : ", entries.size()-1, ")\n");
-                        no_display = true;
-                        continue;
-                    }
-
-                    iter = entries.begin() + num;
-                } else {
-                    std::vector<entry>::iterator old = iter;
-                    iter = entries.begin();
-                    bool res = find_next(entries, iter, search_string);
-
-                    std::size_t i = num;
-                    while (res && i != 0) {
-                        old = iter;
-                        ++iter;
-                        res = find_next(entries, iter, search_string);
-                        --i;
-                    }
-
-                    if (!res) {
-                        error("no further matches, displaying last one\n");
-                        iter = old;
-                    }
-                }
-            } else if (c == '?') {
-                if (search_mode) {
-                    search_mode = false;
-                    no_display = true;
-                    note("leaving search mode");
-                } else {
-                    no_display = true;
-                    note("you are not in search mode");
-                }
-                continue;
-            } else if (c == '.') {
-                // Just recall current entry, nothing to do
-            } else if (c == '+') {
-                std::size_t num;
-
-                if (s.size() == 1) {
-                    num = 1;
-                } else {
-                    s = string::erase_start(s, 1);
-                    if (!string::from_string(s, num)) {
-                        error("invalid number of entries\n");
-                        no_display = true;
-                        continue;
-                    }
-                }
-
-                if (!search_mode) {
-                    if (num >= std::size_t(entries.end() - iter)) {
-                        if (num == 1) {
-                            error("no further entry\n");
-                            no_display = true;
-                        } else {
-                            error("only ", entries.end() - iter, " further entries, displaying "
-                                "last one\n");
-                        }
-
-                        continue;
-                    }
-
-                    iter += num;
-                } else {
-                    std::vector<entry>::iterator old = iter;
-                    bool res = true;
-                    std::size_t i = num;
-                    while (res && i != 0) {
-                        old = iter;
-                        ++iter;
-                        res = find_next(entries, iter, search_string);
-                        --i;
-                    }
-
-                    if (!res) {
-                        iter = old;
-
-                        if (num == 1) {
-                            error("no further matches\n");
-                            no_display = true;
-                            continue;
-                        } else {
-                            error("only ", num-i, " further matches, displaying last one\n");
-                        }
-                    }
-                }
-            } else if (c == '-') {
-                std::size_t num;
-
-                if (s.size() == 1) {
-                    num = 1;
-                } else {
-                    s = string::erase_start(s, 1);
-                    if (!string::from_string(s, num)) {
-                        error("invalid number of entries\n");
-                        no_display = true;
-                        continue;
-                    }
-                }
-
-                if (!search_mode) {
-                    if (num > std::size_t(iter - entries.begin())) {
-                        if (num == 1) {
-                            error("no entry before this point\n");
-                            no_display = true;
-                            continue;
-                        } else {
-                            error("only ", iter - entries.begin(), " entries before this point, "
-                                "displaying first one\n");
-                        }
-                    }
-
-                    iter -= num;
-                } else {
-                    std::vector<entry>::iterator old = iter;
-                    bool res = true;
-                    std::size_t i = num;
-                    while (res && i != 0) {
-                        old = iter;
-                        res = find_previous(entries, iter, search_string);
-                        --i;
-                    }
-
-                    if (!res) {
-                        if (num == 1) {
-                            error("no match before this point\n");
-                            no_display = true;
-                            iter = old;
-                        } else {
-                            error("only ", num-i, " matches before this point, displaying first "
-                                "one\n");
-                        }
-
-                        continue;
-                    }
-                }
-            } else {
-                std::string err;
-                time_key tmp = time_key(s, err);
-                if (tmp.valid()) {
-                    std::vector<entry>::iterator old = iter;
-
-                    iter = entries.begin();
-                    while (iter != entries.end()) {
-                        if (iter->start >= tmp) {
-                            break;
-                        }
-                        ++iter;
-                    }
-
-                    if (iter == entries.end()) {
-                        error("no entry after ", tmp, "\n");
-                        no_display = true;
-                        iter = old;
-                        continue;
-                    }
-                } else {
-                    std::string tmp = string::trim(string::trim(s), "\"\'");
-                    if (!tmp.empty()) {
-                        std::vector<entry>::iterator old = iter;
-                        bool res = find_next(entries, iter, tmp);
-                        if (!res) {
-                            if (old != entries.begin()) {
-                                note("no further match from this point, starting over from begining");
-                                iter = entries.begin();
-                                res = find_next(entries, iter, tmp);
-                            }
-
-                            if (!res) {
-                                error("no match for '"+tmp+"'\n");
-                                no_display = true;
-                                iter = old;
-                                continue;
-                            }
-                        }
-
-                        search_string = tmp;
-                        note("entering search mode for '", search_string, "' (type '?' to stop)");
-                        search_mode = true;
-                    }
-                }
-            }
-        }
-    }
+    return ses.finish() ? 0 : 1;
 }
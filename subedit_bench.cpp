@@ -0,0 +1,897 @@
+#include "subedit_lib.hpp"
+#include <malloc.h>
+
+// Benchmarks of the subtitle library, on synthetic subtitles. Results are written
+// as JSON, to keep track of them over time.
+
+// Deterministic subtitle generator
+namespace synth {
+    struct options {
+        std::size_t cues = 100000;
+        // Average number of characters of text per cue
+        std::size_t text_length = 40;
+        // Fraction of words that are not ASCII
+        double unicode = 0.1;
+        // Fraction of cues that start before the previous one
+        double unsorted = 0.0;
+        // Fraction of cues that end after the next one starts
+        double overlap = 0.0;
+        std::uint64_t seed = 1;
+    };
+
+    // splitmix64: same sequence on every platform, unlike std::uniform_*_distribution
+    class random {
+    public :
+        explicit random(std::uint64_t seed) : state_(seed) {}
+
+        std::uint64_t next() {
+            std::uint64_t z = (state_ += 0x9e3779b97f4a7c15ull);
+            z = (z ^ (z >> 30))*0xbf58476d1ce4e5b9ull;
+            z = (z ^ (z >> 27))*0x94d049bb133111ebull;
+            return z ^ (z >> 31);
+        }
+
+        // In [0,n)
+        std::size_t below(std::size_t n) {
+            return next() % n;
+        }
+
+        // In [0,1)
+        double uniform() {
+            return (next() >> 11)*(1.0/9007199254740992.0);
+        }
+
+    private :
+        std::uint64_t state_;
+    };
+
+    const char* ascii_words[] = {
+        "the", "you", "I", "know", "where", "going", "later", "tonight", "hello", "world",
+        "brown", "fox", "over", "lazy", "dog", "don't", "what", "never", "always", "come"
+    };
+
+    const char* unicode_words[] = {
+        "café", "naïve", "déjà", "Straße", "señor", "über", "Ça", "привет", "日本語",
+        "γεια", "😀", "♪"
+    };
+
+    std::string text(random& r, const options& o) {
+        std::size_t length = o.text_length/2 + r.below(o.text_length + 1);
+        std::string s;
+        bool wrapped = false;
+        while (s.size() < length) {
+            if (!s.empty()) {
+                // Two lines at most, like most subtitles
+                s += !wrapped && s.size() > length/2 ? '\n' : ' ';
+                wrapped = wrapped || s.back() == '\n';
+            }
+
+            if (r.uniform() < o.unicode) {
+                s += unicode_words[r.below(sizeof(unicode_words)/sizeof(*unicode_words))];
+            } else {
+                s += ascii_words[r.below(sizeof(ascii_words)/sizeof(*ascii_words))];
+            }
+        }
+
+        return s;
+    }
+
+    // A whole subtitle file
+    std::string generate(const options& o) {
+        random r(o.seed);
+        std::vector<std::int64_t> starts(o.cues), ends(o.cues);
+        std::int64_t t = 1000;
+        for (std::size_t i = 0; i < o.cues; ++i) {
+            t += 200 + r.below(3000);
+            starts[i] = t;
+            ends[i] = t + 800 + r.below(3200);
+            t = ends[i];
+        }
+
+        for (std::size_t i = 0; i + 1 < o.cues; ++i) {
+            if (r.uniform() < o.overlap) {
+                ends[i] = starts[i + 1] + 1 + r.below(1000);
+            }
+        }
+
+        for (std::size_t i = 1; i < o.cues; ++i) {
+            if (r.uniform() < o.unsorted) {
+                std::swap(starts[i], starts[i - 1]);
+                std::swap(ends[i], ends[i - 1]);
+            }
+        }
+
+        std::string out;
+        out.reserve(o.cues*(format::max_entry_header_size + o.text_length*3/2));
+        char buffer[format::max_entry_header_size];
+        for (std::size_t i = 0; i < o.cues; ++i) {
+            char* p = format::integer(buffer, i + 1);
+            *p++ = '\n';
+            p = format::time(p, starts[i]);
+            memcpy(p, " --> ", 5);
+            p = format::time(p + 5, ends[i]);
+            *p++ = '\n';
+            out.append(buffer, p);
+            out += text(r, o);
+            out += "\n\n";
+        }
+
+        return out;
+    }
+
+    // Mono 16 bit sound of 'seconds' s: voiced tones with syllables during the
+    // activity 'a', and quiet noise elsewhere
+    std::vector<std::int16_t> speech(const align::activity& a, std::size_t rate, double seconds,
+        std::uint64_t seed) {
+
+        random r(seed);
+        std::vector<std::int16_t> s(std::size_t(seconds*rate));
+        const double pi = 3.14159265358979323846;
+        std::size_t cue = 0;
+        double pitch = 150.0;
+        for (std::size_t i = 0; i < s.size(); ++i) {
+            double t = double(i)/rate;
+            std::int64_t msec = std::int64_t(t*1000.0);
+            while (cue < a.ends.size() && a.ends[cue] <= msec) {
+                ++cue;
+                pitch = 100.0 + 150.0*r.uniform();
+            }
+
+            double x = (r.uniform() - 0.5)*400.0;
+            if (cue < a.starts.size() && a.starts[cue] <= msec) {
+                double syllables = 0.6 + 0.4*std::sin(2.0*pi*4.0*t);
+                x += 6000.0*syllables*(std::sin(2.0*pi*pitch*t) +
+                    0.5*std::sin(4.0*pi*pitch*t) + 0.25*std::sin(6.0*pi*pitch*t));
+            }
+
+            s[i] = std::int16_t(std::max(-32768.0, std::min(32767.0, x)));
+        }
+
+        return s;
+    }
+
+    // A WAV file holding mono 16 bit sound
+    std::string wav(const std::vector<std::int16_t>& s, std::size_t rate) {
+        auto u32 = [](std::string& o, std::uint32_t v) {
+            for (std::size_t k = 0; k < 4; ++k) o += char((v >> 8*k) & 0xff);
+        };
+
+        auto u16 = [](std::string& o, std::uint16_t v) {
+            o += char(v & 0xff);
+            o += char(v >> 8);
+        };
+
+        std::string o = "RIFF";
+        u32(o, std::uint32_t(36 + 2*s.size()));
+        o += "WAVEfmt ";
+        u32(o, 16);
+        u16(o, 1);
+        u16(o, 1);
+        u32(o, std::uint32_t(rate));
+        u32(o, std::uint32_t(2*rate));
+        u16(o, 2);
+        u16(o, 16);
+        o += "data";
+        u32(o, std::uint32_t(2*s.size()));
+        for (auto x : s) u16(o, std::uint16_t(x));
+        return o;
+    }
+}
+
+namespace bench {
+    struct result {
+        std::string name;
+        std::size_t iterations = 0;
+        double seconds = 0.0;
+        // Items and bytes processed by one iteration, if meaningful
+        double items = 0.0;
+        double bytes = 0.0;
+    };
+
+    std::vector<result> results;
+    // Measured once rather than timed, e.g. memory in use, in bytes
+    std::vector<std::pair<std::string, double>> sizes;
+    std::string filter;
+    double min_time = 0.2;
+
+    // Run 'func()' until it took at least 'min_time' seconds overall, doubling the
+    // number of iterations each time
+    template<typename F>
+    void run(const std::string& name, double items, double bytes, F&& func) {
+        if (name.find(filter) == std::string::npos) return;
+
+        result r;
+        r.name = name;
+        r.items = items;
+        r.bytes = bytes;
+        for (std::size_t n = 1; ; n *= 2) {
+            double t0 = timing::now();
+            for (std::size_t k = 0; k < n; ++k) {
+                func();
+            }
+
+            double t1 = timing::now();
+            if (t1 - t0 >= min_time || n >= (std::size_t(1) << 30)) {
+                r.iterations = n;
+                r.seconds = t1 - t0;
+                break;
+            }
+        }
+
+        results.push_back(r);
+        std::cerr << name << ": " << r.seconds/r.iterations*1e9 << " ns" << std::endl;
+    }
+
+    void size(const std::string& name, double bytes) {
+        if (name.find(filter) == std::string::npos) return;
+
+        sizes.push_back(std::make_pair(name, bytes));
+        std::cerr << name << ": " << bytes << " bytes" << std::endl;
+    }
+
+    // Bytes allocated on the heap and not freed yet, or 0 if the C library does not
+    // tell (large blocks are mapped on their own: they count too)
+    std::size_t heap_in_use() {
+#if defined(__GLIBC__) && (__GLIBC__ > 2 || __GLIBC_MINOR__ >= 33)
+        struct mallinfo2 m = mallinfo2();
+        return m.uordblks + m.hblkhd;
+#else
+        return 0;
+#endif
+    }
+
+    // Keep the compiler from optimizing a result away
+    template<typename T>
+    void keep(const T& t) {
+        asm volatile("" : : "g"(&t) : "memory");
+    }
+
+    std::string json_string(const std::string& s) {
+        std::string r = "\"";
+        for (char c : s) {
+            if (c == '"' || c == '\\') r += '\\';
+            r += c;
+        }
+
+        return r + "\"";
+    }
+
+    void write_json(std::ostream& o, const synth::options& opts, std::size_t bytes) {
+        o.precision(6);
+        o << "{\n";
+        o << "  \"generator\": {\"cues\": " << opts.cues << ", \"text_length\": "
+            << opts.text_length << ", \"unicode\": " << opts.unicode << ", \"unsorted\": "
+            << opts.unsorted << ", \"overlap\": " << opts.overlap << ", \"seed\": "
+            << opts.seed << ", \"bytes\": " << bytes << "},\n";
+        o << "  \"threads\": " << parallel::thread_count() << ",\n";
+        o << "  \"benchmarks\": [";
+        for (std::size_t i = 0; i < results.size(); ++i) {
+            const result& r = results[i];
+            double per_op = r.seconds/r.iterations;
+            o << (i == 0 ? "\n" : ",\n");
+            o << "    {\"name\": " << json_string(r.name) << ", \"iterations\": " << r.iterations
+                << ", \"ns_per_op\": " << per_op*1e9;
+            if (r.items != 0.0) o << ", \"items_per_second\": " << r.items/per_op;
+            if (r.bytes != 0.0) o << ", \"bytes_per_second\": " << r.bytes/per_op;
+            o << "}";
+        }
+
+        o << "\n  ],\n";
+        o << "  \"sizes\": [";
+        for (std::size_t i = 0; i < sizes.size(); ++i) {
+            o << (i == 0 ? "\n" : ",\n");
+            o << "    {\"name\": " << json_string(sizes[i].first) << ", \"bytes\": "
+                << sizes[i].second << "}";
+        }
+
+        o << "\n  ]\n}\n";
+    }
+}
+
+void print_usage() {
+    print("usage: subedit_bench [options]");
+    print("  --cues n         : number of cues of the synthetic subtitle (100000)");
+    print("  --text-length n  : average number of characters per cue (40)");
+    print("  --unicode r      : fraction of non-ASCII words (0.1)");
+    print("  --unsorted r     : fraction of cues starting before the previous one (0)");
+    print("  --overlap r      : fraction of cues ending after the next one starts (0)");
+    print("  --seed n         : seed of the generator (1)");
+    print("  --generate file  : only write the synthetic subtitle to 'file'");
+    print("  --filter text    : only run the benchmarks whose name contains 'text'");
+    print("  --min-time s     : run each benchmark for at least 's' seconds (0.2)");
+    print("  --json file      : write the results to 'file' instead of the standard output");
+}
+
+int main(int argc, char* argv[]) {
+    synth::options opts;
+    std::string generate_name, json_name;
+
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        if (arg == "-h" || arg == "--help") {
+            print_usage();
+            return 0;
+        }
+
+        if (i + 1 == argc) {
+            error("unknown option or missing value: '", arg, "'");
+            return 1;
+        }
+
+        std::string value = argv[++i];
+        bool ok = true;
+        if (arg == "--cues") {
+            ok = string::from_string(value, opts.cues);
+        } else if (arg == "--text-length") {
+            ok = string::from_string(value, opts.text_length);
+        } else if (arg == "--unicode") {
+            ok = string::from_string(value, opts.unicode);
+        } else if (arg == "--unsorted") {
+            ok = string::from_string(value, opts.unsorted);
+        } else if (arg == "--overlap") {
+            ok = string::from_string(value, opts.overlap);
+        } else if (arg == "--seed") {
+            ok = string::from_string(value, opts.seed);
+        } else if (arg == "--generate") {
+            generate_name = value;
+        } else if (arg == "--filter") {
+            bench::filter = value;
+        } else if (arg == "--min-time") {
+            ok = string::from_string(value, bench::min_time);
+        } else if (arg == "--json") {
+            json_name = value;
+        } else {
+            error("unknown option '", arg, "'");
+            return 1;
+        }
+
+        if (!ok) {
+            error("invalid value for ", arg, ": '", value, "'");
+            return 1;
+        }
+    }
+
+    if (opts.cues == 0) {
+        error("--cues must be at least 1");
+        return 1;
+    }
+
+    std::string data = synth::generate(opts);
+    if (!generate_name.empty()) {
+        std::string err;
+        if (!file::replace(generate_name, data, err)) {
+            error(err);
+            return 1;
+        }
+
+        return 0;
+    }
+
+    // The library reports what it does, which is only noise here
+    std::ostringstream log;
+    output = &log;
+
+    synth::random r(opts.seed);
+    const std::size_t samples = 4096;
+
+    // Time stamps
+    {
+        std::vector<std::string> stamps(samples);
+        std::vector<std::int64_t> times(samples);
+        for (std::size_t i = 0; i < samples; ++i) {
+            times[i] = std::int64_t(r.below(360000000));
+            char buffer[format::max_time_size];
+            stamps[i].assign(buffer, format::time(buffer, times[i]));
+        }
+
+        bench::run("time_key/parse", samples, 0.0, [&]() {
+            std::string err;
+            std::int64_t sum = 0;
+            for (auto& s : stamps) {
+                time_key t(s.data(), s.data() + s.size(), err);
+                sum += t - time_key(0);
+            }
+
+            bench::keep(sum);
+        });
+
+        bench::run("time_key/format", samples, 0.0, [&]() {
+            char buffer[format::max_time_size];
+            std::size_t sum = 0;
+            for (auto t : times) {
+                sum += format::time(buffer, t) - buffer;
+            }
+
+            bench::keep(sum);
+        });
+    }
+
+    // String helpers
+    {
+        std::vector<std::string> padded(samples), lines(samples);
+        for (std::size_t i = 0; i < samples; ++i) {
+            padded[i] = std::string(r.below(4), ' ') + synth::text(r, opts) +
+                std::string(r.below(4), '\t');
+            lines[i] = "00:00:01,000 --> 00:00:02,500";
+        }
+
+        bench::run("string/trim", samples, 0.0, [&]() {
+            std::size_t sum = 0;
+            for (auto& s : padded) {
+                sum += string::trim(s).size();
+            }
+
+            bench::keep(sum);
+        });
+
+        bench::run("string/cut", samples, 0.0, [&]() {
+            std::size_t sum = 0;
+            for (auto& s : lines) {
+                sum += string::cut(s, " --> ").size();
+            }
+
+            bench::keep(sum);
+        });
+    }
+
+    // Parsing, with different numbers of threads
+    for (std::size_t threads = 1; threads <= 32; threads *= 2) {
+        bench::run("parse/threads:" + std::to_string(threads), opts.cues, data.size(), [&]() {
+            text_buffer buffer;
+            buffer.assign(data);
+            entry_columns entries;
+            if (!read_entries(buffer, entries, 0, threads)) {
+                std::cerr << log.str();
+                std::exit(1);
+            }
+
+            bench::keep(entries);
+        });
+    }
+
+    // Loading files that are not UTF-8 with '\n' line ends: validation (all files
+    // go through it), dropping '\r' (on a copy, as when loading) and conversions
+    {
+        encoding::text_format crlf, utf16, cp1252;
+        crlf.crlf = true;
+        utf16.set = encoding::charset::utf16le;
+        cp1252.set = encoding::charset::cp1252;
+        std::string crlf_data, utf16_data, cp1252_data, out(3*data.size(), '\0');
+        encoding::encode(crlf, data, crlf_data);
+        encoding::encode(utf16, data, utf16_data);
+        encoding::encode(cp1252, data, cp1252_data);
+
+        search::isa best = search::kernel;
+        std::vector<std::pair<search::isa, std::string>> kernels = {
+            {search::isa::scalar, "scalar"}, {search::isa::sse2, "sse2"},
+            {search::isa::avx2, "avx2"}
+        };
+
+        for (auto& k : kernels) {
+            if (k.first > best) break;
+
+            search::kernel = k.first;
+            bench::run("encoding/valid_utf8:" + k.second, 0.0, data.size(), [&]() {
+                bench::keep(encoding::valid_utf8(data.data(), data.size()));
+            });
+
+            bench::run("encoding/remove_cr:" + k.second, 0.0, crlf_data.size(), [&]() {
+                std::memcpy(&out[0], crlf_data.data(), crlf_data.size());
+                bench::keep(encoding::remove_cr(&out[0], crlf_data.size()));
+            });
+
+            bench::run("encoding/from_utf16:" + k.second, 0.0, utf16_data.size(), [&]() {
+                bench::keep(encoding::from_utf16(utf16_data.data(), utf16_data.size(), false,
+                    &out[0]));
+            });
+
+            bench::run("encoding/from_cp1252:" + k.second, 0.0, cp1252_data.size(), [&]() {
+                bench::keep(encoding::from_cp1252(cp1252_data.data(), cp1252_data.size(),
+                    &out[0]));
+            });
+        }
+
+        search::kernel = best;
+    }
+
+    // The heap used by the parsed entries (the text was already copied), per cue
+    subtitle_track track;
+    {
+        track.text().assign(data);
+        std::size_t heap = bench::heap_in_use();
+        entry_columns entries;
+        read_entries(track.text(), entries, 0, parallel::thread_count());
+        track.assign(std::move(entries));
+        if (heap != 0) {
+            bench::size("track/heap_per_cue", double(bench::heap_in_use() - heap)/track.size());
+        }
+    }
+
+    // Reading all the start times, as the time index does: they are contiguous
+    bench::run("track/scan_starts", track.size(), 0.0, [&]() {
+        const column<std::int64_t>& starts = track.columns().starts;
+        std::int64_t sum = 0;
+        for (std::size_t i = 0; i < starts.size(); ++i) {
+            sum += starts[i];
+        }
+
+        bench::keep(sum);
+    });
+
+    // Searches that go through the whole subtitle
+    bench::run("search/find_next", track.size(), data.size(), [&]() {
+        std::size_t i = 0;
+        bench::keep(find_next(track, i, "not in the text"));
+    });
+
+    // All the hits in the whole text, with each kernel, and std::string::find as a
+    // baseline. Ignoring case only has SIMD filters for the first and last bytes.
+    {
+        const std::string query = "lazy dog";
+        bench::run("search/std_find", 0.0, data.size(), [&]() {
+            std::size_t count = 0;
+            for (std::size_t p = data.find(query); p != std::string::npos;
+                p = data.find(query, p + 1)) {
+                ++count;
+            }
+
+            bench::keep(count);
+        });
+
+        search::isa best = search::kernel;
+        std::vector<std::pair<search::isa, std::string>> kernels = {
+            {search::isa::scalar, "scalar"}, {search::isa::sse2, "sse2"},
+            {search::isa::avx2, "avx2"}
+        };
+
+        std::vector<std::size_t> hits;
+        for (auto& k : kernels) {
+            if (k.first > best) break;
+
+            search::kernel = k.first;
+            for (bool fold : {false, true}) {
+                search::pattern pat(query, fold);
+                bench::run("search/find_all" + std::string(fold ? "_fold:" : ":") + k.second,
+                    0.0, data.size(), [&]() {
+                        search::find_all(data.data(), data.size(), pat, hits);
+                        bench::keep(hits);
+                    });
+            }
+        }
+
+        search::kernel = best;
+    }
+
+    // Exact searches through the trigram index, and the index itself. The corpus
+    // has few distinct words: lists are long, as for common words in real text.
+    {
+        auto content = [&](std::size_t i) {
+            return track.content(i);
+        };
+
+        text_index index;
+        bench::run("search/index_build", track.size(), data.size(), [&]() {
+            text_index i;
+            i.build(track.size(), content);
+            bench::keep(i);
+        });
+
+        index.build(track.size(), content);
+        for (const char* query : {"lazy dog", "brown fox", "hello", "xyz"}) {
+            std::vector<std::size_t> found;
+            bench::run(std::string("search/index_query:") + query, 1.0, 0.0, [&]() {
+                index.find(track.size(), content, query, found);
+                bench::keep(found);
+            });
+        }
+    }
+
+    // Approximate searches: the first three are long enough to only check the
+    // entries with an exact match of a piece of the pattern, the last one checks
+    // all of them
+    {
+        struct query {
+            const char* text;
+            std::size_t max;
+            bool fold;
+        };
+
+        std::vector<query> queries = {
+            {"lazy dgo", 1, false}, {"brwn fox ovr", 2, false}, {"Helo Wrld", 2, true},
+            {"helo", 1, false}
+        };
+
+        std::vector<std::size_t> found, distances;
+        for (auto& q : queries) {
+            std::string name = std::string("search/fuzzy:") + q.text + (q.fold ? "/i" : "/") +
+                "~" + std::to_string(q.max);
+            bench::run(name, 1.0, 0.0, [&]() {
+                track.find_fuzzy(q.text, q.max, q.fold, found, distances);
+                bench::keep(found);
+            });
+        }
+    }
+
+    // Writing all the entries, i.e., the bulk of a full save
+    bench::run("track/write", track.size(), data.size(), [&]() {
+        track_snapshot s = track.snapshot();
+        std::string out;
+        write_entries(s, out);
+        bench::keep(out);
+    });
+
+    // Validation of the whole timeline, and the order that would fix it
+    bench::run("check/run", track.size(), 0.0, [&]() {
+        check::report rep;
+        check::run(track, check::options(), rep);
+        bench::keep(rep);
+    });
+
+    bench::run("check/sorted_order", track.size(), 0.0, [&]() {
+        bench::keep(check::sorted_order(track));
+    });
+
+    // Not timed: searches that scan the text must still find all the entries once
+    // they are sorted, although their text is then out of order in the buffer
+    {
+        synth::options o = opts;
+        o.cues = 2000;
+        o.unsorted = 0.3;
+        std::string unsorted = synth::generate(o);
+        subtitle_track t;
+        t.text().assign(unsorted);
+        entry_columns entries;
+        read_entries(t.text(), entries, 0, 1);
+        t.assign(std::move(entries));
+        t.reorder(check::sorted_order(t), column<std::size_t>());
+
+        for (const char* word : {"the", "fox", "é", "I"}) {
+            search::pattern pat(word, true);
+            std::vector<std::size_t> found, expected;
+            t.find_text(word, true, found);
+            for (std::size_t i = 0; i < t.size(); ++i) {
+                if (t.content(i).find(pat) != std::string::npos) expected.push_back(i);
+            }
+
+            if (found != expected) {
+                error("search for '", word, "' after sorting found ", found.size(),
+                    " entries instead of ", expected.size());
+                std::cerr << log.str();
+                return 1;
+            }
+        }
+    }
+
+    // Not timed: edits of an empty subtitle must fail or do nothing, not crash
+    {
+        subtitle_track empty;
+        empty.assign(entry_columns());
+        session ses(empty, "empty.srt", false);
+        std::istringstream in;
+        bool shifted = ses.run("shift +1", in) || ses.run("shift 00:00:01,000", in) ||
+            ses.run("", in);
+        if (shifted || !ses.run("retime 1.001", in) || !ses.run("sync", in)) {
+            error("edits of an empty subtitle gave unexpected results");
+            std::cerr << log.str();
+            return 1;
+        }
+    }
+
+    // Edits. Shifts go to a few places only, like a user would do: they split the
+    // time index there once and for all.
+    std::vector<std::size_t> places(64);
+    for (auto& p : places) {
+        p = r.below(track.size());
+    }
+
+    std::size_t place = 0;
+    bench::run("track/shift", 1.0, 0.0, [&]() {
+        track.shift(places[place++ % places.size()], 100);
+    });
+
+    {
+        std::vector<std::int64_t> times(track.size());
+        for (std::size_t i = 0; i < times.size(); ++i) {
+            times[i] = track.start(i) - time_key(0);
+        }
+
+        // Back and forth, so that the times stay in the same range
+        linear::transform tr = linear::frame_rates(25.0, 23.976);
+        linear::transform back = linear::frame_rates(23.976, 25.0);
+        search::isa best = search::kernel;
+        std::vector<std::pair<search::isa, std::string>> kernels = {
+            {search::isa::scalar, "scalar"}, {search::isa::sse2, "sse2"},
+            {search::isa::avx2, "avx2"}
+        };
+
+        for (auto& k : kernels) {
+            if (k.first > best) break;
+
+            search::kernel = k.first;
+            bench::run("linear/apply:" + k.second, 2.0*times.size(), 16.0*times.size(), [&]() {
+                linear::apply(tr, times.data(), times.size());
+                linear::apply(back, times.data(), times.size());
+            });
+        }
+
+        search::kernel = best;
+    }
+
+    // Alignment on a reference: a feature film, and a season of episodes aligned at
+    // once. The tracks to align are the references at another frame rate, with
+    // another offset after a cut in the middle.
+    {
+        auto make = [&](std::size_t cues, std::uint64_t seed, align::activity& ref,
+            align::activity& track) {
+
+            synth::options o = opts;
+            o.cues = cues;
+            o.seed = seed;
+            subtitle_track t;
+            t.text().assign(synth::generate(o));
+            entry_columns entries;
+            read_entries(t.text(), entries, 0, 1);
+            t.assign(std::move(entries));
+
+            for (std::size_t i = 0; i < t.size(); ++i) {
+                ref.starts.push_back(t.start(i) - time_key(0));
+                ref.ends.push_back(t.end(i) - time_key(0));
+            }
+
+            track = ref;
+            linear::transform tr = linear::frame_rates(25.0, 23.976);
+            tr.offset = 3200.0;
+            linear::apply(tr, track.starts.data(), cues);
+            linear::apply(tr, track.ends.data(), cues);
+            for (std::size_t i = cues/2; i < cues; ++i) {
+                track.starts[i] += 4500;
+                track.ends[i] += 4500;
+            }
+        };
+
+        align::activity ref, track;
+        make(1500, opts.seed, ref, track);
+        bench::run("align/feature", 1500.0, 0.0, [&]() {
+            align::correction c;
+            std::string err;
+            bench::keep(align::compute(track, ref, align::options(), c, err));
+        });
+
+        const std::size_t episodes = 20;
+        std::vector<align::activity> refs(episodes), tracks(episodes);
+        for (std::size_t k = 0; k < episodes; ++k) {
+            make(700, opts.seed + k, refs[k], tracks[k]);
+        }
+
+        bench::run("align/season", 700.0*episodes, 0.0, [&]() {
+            parallel::for_each_task(episodes, parallel::thread_count(),
+                [&](std::size_t k, std::size_t) {
+                    align::correction c;
+                    std::string err;
+                    bench::keep(align::compute(tracks[k], refs[k], align::options(), c, err));
+                });
+        });
+
+        // Voice activity of the first ten minutes of the feature, in the memory and
+        // in a WAV file; the file is read from the page cache
+        const std::size_t rate = 16000;
+        const double seconds = 600.0;
+        std::vector<std::int16_t> sound = synth::speech(ref, rate, seconds, opts.seed);
+        const std::size_t frame = rate/50;
+        search::isa best = search::kernel;
+        std::vector<std::pair<search::isa, std::string>> kernels = {
+            {search::isa::scalar, "scalar"}, {search::isa::sse2, "sse2"},
+            {search::isa::avx2, "avx2"}
+        };
+
+        for (auto& k : kernels) {
+            if (k.first > best) break;
+
+            search::kernel = k.first;
+            bench::run("audio/analyze:" + k.second, sound.size(), 2.0*sound.size(), [&]() {
+                std::uint64_t energy = 0;
+                for (std::size_t i = 0; i + frame <= sound.size(); i += frame) {
+                    energy += audio::analyze(&sound[i], frame, i == 0 ? 0 : sound[i - 1]).energy;
+                }
+
+                bench::keep(energy);
+            });
+        }
+
+        search::kernel = best;
+
+        std::string name = "subedit_bench.XXXXXX";
+        if (const char* dir = getenv("TMPDIR")) {
+            name = std::string(dir) + "/" + name;
+        } else {
+            name = "/tmp/" + name;
+        }
+
+        int fd = ::mkstemp(&name[0]);
+        if (fd < 0) {
+            error(file::system_error("cannot create temporary file", name));
+            return 1;
+        }
+
+        ::close(fd);
+        std::string err;
+        if (!file::replace(name, synth::wav(sound, rate), err)) {
+            error(err);
+            return 1;
+        }
+
+        // Items are seconds of audio
+        bench::run("audio/voice_activity", seconds, 2.0*sound.size(), [&]() {
+            align::activity a;
+            double s = 0.0;
+            if (!audio::voice_activity(name, audio::options(), a, s, err)) {
+                std::cerr << err << std::endl;
+                std::exit(1);
+            }
+
+            bench::keep(a);
+        });
+
+        ::unlink(name.c_str());
+        ::unlink(file::pending_name(name).c_str());
+    }
+
+    // The whole cycle, as done by a script
+    {
+        std::string name = "subedit_bench.XXXXXX";
+        if (const char* dir = getenv("TMPDIR")) {
+            name = std::string(dir) + "/" + name;
+        } else {
+            name = "/tmp/" + name;
+        }
+
+        int fd = ::mkstemp(&name[0]);
+        if (fd < 0) {
+            error(file::system_error("cannot create temporary file", name));
+            return 1;
+        }
+
+        ::close(fd);
+        std::string err;
+        if (!file::replace(name, data, err)) {
+            error(err);
+            return 1;
+        }
+
+        bench::run("cycle/load_edit_save", opts.cues, data.size(), [&]() {
+            subtitle_track t;
+            if (!load_track(name, t)) {
+                std::cerr << log.str();
+                std::exit(1);
+            }
+
+            t.shift(t.size()/2, 1500);
+            t.detach();
+            track_writer writer(name, t);
+            if (!writer.save(t.snapshot(), err)) {
+                std::cerr << err << std::endl;
+                std::exit(1);
+            }
+
+            log.str("");
+        });
+
+        ::unlink(name.c_str());
+        ::unlink(file::pending_name(name).c_str());
+    }
+
+    output = &std::cout;
+
+    if (json_name.empty()) {
+        bench::write_json(std::cout, opts, data.size());
+    } else {
+        std::ofstream o(json_name);
+        bench::write_json(o, opts, data.size());
+        if (!o) {
+            error("cannot write ", json_name);
+            return 1;
+        }
+    }
+
+    return 0;
+}
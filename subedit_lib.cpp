@@ -0,0 +1,5170 @@
+#include "subedit_lib.hpp"
+
+thread_local std::ostream* output = &std::cout;
+
+void print() {
+    *output << std::endl;
+}
+
+void put() {
+    *output << std::flush;
+}
+
+namespace stats {
+#if defined(SUBEDIT_STATS)
+    std::atomic<std::uint64_t> counters[std::size_t(counter::count)];
+    std::atomic<std::uint64_t> phase_calls[std::size_t(phase::count)];
+    std::atomic<std::uint64_t> phase_nsec[std::size_t(phase::count)];
+    std::atomic<std::uint64_t> allocations;
+    std::atomic<std::uint64_t> allocated_bytes;
+#endif
+
+    std::uint64_t peak_rss() {
+        struct rusage usage;
+        if (::getrusage(RUSAGE_SELF, &usage) != 0) return 0;
+        // In kilobytes on Linux
+        return std::uint64_t(usage.ru_maxrss)*1024;
+    }
+
+    void print() {
+        auto mb = [](std::uint64_t bytes) {
+            return std::round(bytes/1e5)/10.0;
+        };
+
+#if defined(SUBEDIT_STATS)
+        static const char* phase_names[] = {"read", "parse", "search", "edit", "save"};
+        static const char* counter_names[] = {
+            "bytes read", "entries parsed", "search comparisons", "entries shifted",
+            "bytes written"
+        };
+
+        auto get = [](const std::atomic<std::uint64_t>& a) {
+            return a.load(std::memory_order_relaxed);
+        };
+
+        auto pad = [](const char* name) {
+            return std::string(name) + std::string(20 - std::strlen(name), ' ');
+        };
+
+        ::print("statistics:");
+        for (std::size_t p = 0; p < std::size_t(phase::count); ++p) {
+            ::print("  ", pad(phase_names[p]), ": ", std::round(get(phase_nsec[p])/1e4)/100.0,
+                " ms in ", get(phase_calls[p]), " calls");
+        }
+
+        for (std::size_t c = 0; c < std::size_t(counter::count); ++c) {
+            ::print("  ", pad(counter_names[c]), ": ", get(counters[c]));
+        }
+
+        ::print("  ", pad("allocations"), ": ", get(allocations), " (",
+            mb(get(allocated_bytes)), " MB)");
+#else
+        ::print("statistics: counters and timers were not compiled in (see SUBEDIT_STATS)");
+#endif
+        ::print("  peak RSS            : ", mb(peak_rss()), " MB");
+    }
+}
+
+#if defined(SUBEDIT_STATS)
+// Not inlined, so that the compiler does not see malloc and free paired with new
+// and delete where they are used
+__attribute__((noinline)) void* operator new(std::size_t n) {
+    stats::allocations.fetch_add(1, std::memory_order_relaxed);
+    stats::allocated_bytes.fetch_add(n, std::memory_order_relaxed);
+    if (void* p = std::malloc(n == 0 ? 1 : n)) return p;
+    throw std::bad_alloc();
+}
+
+__attribute__((noinline)) void operator delete(void* p) noexcept {
+    std::free(p);
+}
+#endif
+
+namespace string {
+    std::string trim(std::string s, const std::string& chars) {
+        std::size_t spos = s.find_first_of(chars);
+        if (spos == 0) {
+            std::size_t epos = s.find_first_not_of(chars);
+            if (epos == s.npos) return "";
+            s = s.substr(epos);
+        }
+
+        spos = s.find_last_of(chars);
+        if (spos == s.size()-1) {
+            std::size_t epos = s.find_last_not_of(chars);
+            s = s.erase(epos+1, s.size() - epos+1);
+        }
+
+        return s;
+    }
+
+    std::string to_lower(std::string s) {
+        for (auto& c : s) {
+            c = ::tolower(c);
+        }
+        return s;
+    }
+
+    std::string erase_start(std::string s, std::size_t n) {
+        if (n >= s.size()) {
+            return "";
+        }
+
+        s.erase(0, n);
+        return s;
+    }
+
+    std::vector<std::string> words(const std::string& s) {
+        std::vector<std::string> ret;
+        std::istringstream ss(s);
+        std::string w;
+        while (ss >> w) {
+            ret.push_back(w);
+        }
+
+        return ret;
+    }
+
+    bool to_positive(const std::string& s, double& v) {
+        char* end = nullptr;
+        v = strtod(s.c_str(), &end);
+        return end != s.c_str() && *end == '\0' && std::isfinite(v) && v > 0.0;
+    }
+
+    std::vector<std::string> cut(const std::string& ts, const std::string& pattern) {
+        std::vector<std::string> ret;
+        std::size_t p = 0, op = 0;
+        while ((p = ts.find(pattern, op)) != ts.npos) {
+            ret.push_back(ts.substr(op, p - op));
+            op = p + pattern.size();
+        }
+
+        ret.push_back(ts.substr(op));
+
+        return ret;
+    }
+
+    bool to_milliseconds(const std::string& s, std::int64_t& msec) {
+        const char* p = s.data();
+        const char* e = p + s.size();
+        while (p != e && isspace(static_cast<unsigned char>(*p))) ++p;
+
+        bool neg = false;
+        if (p != e && (*p == '+' || *p == '-')) {
+            neg = *p == '-';
+            ++p;
+        }
+
+        std::int64_t sec = 0;
+        bool digits = false;
+        for (; p != e && *p >= '0' && *p <= '9'; ++p) {
+            sec = sec*10 + (*p - '0');
+            if (sec > std::numeric_limits<std::int64_t>::max()/10000) return false;
+            digits = true;
+        }
+
+        std::int64_t frac = 0;
+        if (p != e && *p == '.') {
+            ++p;
+            std::size_t n = 0;
+            bool round_up = false;
+            for (; p != e && *p >= '0' && *p <= '9'; ++p, ++n) {
+                if (n < 3) {
+                    frac = frac*10 + (*p - '0');
+                } else if (n == 3) {
+                    round_up = *p >= '5';
+                }
+                digits = true;
+            }
+
+            for (; n < 3; ++n) frac *= 10;
+            if (round_up) ++frac;
+        }
+
+        if (!digits) return false;
+
+        msec = sec*1000 + frac;
+        if (neg) msec = -msec;
+        return true;
+    }
+
+    std::string seconds(std::int64_t msec) {
+        std::string r;
+        if (msec < 0) {
+            r += '-';
+            msec = -msec;
+        }
+
+        r += std::to_string(msec/1000);
+        std::int64_t frac = msec % 1000;
+        if (frac != 0) {
+            char d[4] = {char('0' + frac/100), char('0' + frac/10 % 10), char('0' + frac % 10), 0};
+            std::size_t n = 3;
+            while (d[n-1] == '0') --n;
+            r += '.';
+            r.append(d, n);
+        }
+
+        return r;
+    }
+
+}
+
+namespace format {
+    char* integer(char* out, std::uint64_t v) {
+        char tmp[max_integer_size];
+        char* p = tmp + max_integer_size;
+        while (v >= 100) {
+            p -= 2;
+            memcpy(p, digit_pairs + 2*(v % 100), 2);
+            v /= 100;
+        }
+
+        if (v >= 10) {
+            p -= 2;
+            memcpy(p, digit_pairs + 2*v, 2);
+        } else {
+            *--p = char('0' + v);
+        }
+
+        std::size_t n = tmp + max_integer_size - p;
+        memcpy(out, p, n);
+        return out + n;
+    }
+
+    char* two_digits(char* out, std::int64_t v) {
+        if (v < 0) {
+            *out++ = '-';
+            return integer(out, -v);
+        } else if (v < 100) {
+            memcpy(out, digit_pairs + 2*v, 2);
+            return out + 2;
+        } else {
+            return integer(out, v);
+        }
+    }
+
+    char* time(char* out, std::int64_t milliseconds) {
+        std::int64_t seconds = milliseconds/1000;
+        std::int64_t msec = milliseconds - seconds*1000;
+        if (msec < 0) {
+            --seconds;
+            msec += 1000;
+        }
+
+        std::int64_t hour = seconds/3600;
+        std::int64_t min = (seconds - hour*3600)/60;
+        std::int64_t sec = (seconds - hour*3600 - min*60);
+
+        out = two_digits(out, hour);
+        *out++ = ':';
+        out = two_digits(out, min);
+        *out++ = ':';
+        out = two_digits(out, sec);
+        *out++ = ',';
+        *out++ = char('0' + msec/100);
+        memcpy(out, digit_pairs + 2*(msec % 100), 2);
+        return out + 2;
+    }
+
+}
+
+namespace search {
+    isa detect_isa() {
+#if defined(__x86_64__)
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("avx2")) return isa::avx2;
+        return isa::sse2;
+#else
+        return isa::scalar;
+#endif
+    }
+
+    isa kernel = detect_isa();
+
+    std::size_t find_first(const char* data, std::size_t n, const pattern& pat) {
+        std::size_t found = std::string::npos;
+        scan(data, n, pat, [&](std::size_t k) {
+            found = k;
+            return false;
+        });
+
+        return found;
+    }
+
+    void find_all(const char* data, std::size_t n, const pattern& pat,
+        std::vector<std::size_t>& hits) {
+        hits.clear();
+        scan(data, n, pat, [&](std::size_t k) {
+            hits.push_back(k);
+            return true;
+        });
+    }
+
+}
+
+namespace fuzzy {
+    std::size_t distance(const pattern& pat, const char* text, std::size_t n, std::size_t max) {
+        if (pat.size == 0) return 0;
+
+        const std::uint64_t high = std::uint64_t(1) << (pat.size - 1);
+        std::uint64_t pv = ~std::uint64_t(0);
+        std::uint64_t mv = 0;
+        std::size_t score = pat.size;
+        std::size_t best = score;
+
+        const unsigned char* p = reinterpret_cast<const unsigned char*>(text);
+        unsigned char prev = 0;
+        for (std::size_t i = 0; i < n; ++i) {
+            unsigned char c = p[i];
+            std::uint64_t eq = pat.peq[pat.fold ? search::fold(prev, c) : c];
+            prev = c;
+
+            std::uint64_t xv = eq | mv;
+            std::uint64_t xh = (((eq & pv) + pv) ^ pv) | eq;
+            std::uint64_t ph = mv | ~(xh | pv);
+            std::uint64_t mh = pv & xh;
+
+            if (ph & high) {
+                ++score;
+            } else if (mh & high) {
+                --score;
+            }
+
+            // No '| 1' after the shift: a match can start anywhere in the text
+            ph <<= 1;
+            mh <<= 1;
+            pv = mh | ~(xv | ph);
+            mv = ph & xv;
+
+            if (score < best) {
+                best = score;
+                if (best == 0) break;
+            }
+        }
+
+        return best <= max ? best : max + 1;
+    }
+
+}
+
+namespace parallel {
+    std::size_t thread_count() {
+        std::size_t n = std::thread::hardware_concurrency();
+        return n == 0 ? 1 : n;
+    }
+
+}
+
+namespace linear {
+    void apply_scalar(const transform& tr, std::int64_t* t, std::size_t n) {
+        for (std::size_t i = 0; i < n; ++i) {
+            t[i] = apply(tr, t[i]);
+        }
+    }
+
+#if defined(__x86_64__)
+    void apply_sse2(const transform& tr, std::int64_t* t, std::size_t n) {
+        const __m128i bits = _mm_set1_epi64x(magic_bits);
+        const __m128d dmagic = _mm_set1_pd(magic);
+        const __m128d factor = _mm_set1_pd(tr.factor);
+        const __m128d offset = _mm_set1_pd(tr.offset);
+        const __m128i bias = _mm_set1_epi64x(limit);
+        const __m128i high = _mm_set1_epi64x(~(2*limit - 1));
+        const __m128d dlimit = _mm_set1_pd(double(limit));
+        const __m128d abs = _mm_castsi128_pd(_mm_set1_epi64x(0x7fffffffffffffff));
+
+        std::size_t i = 0;
+        for (; i + 2 <= n; i += 2) {
+            __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(t + i));
+            __m128d x = _mm_sub_pd(_mm_castsi128_pd(_mm_add_epi64(v, bits)), dmagic);
+            x = _mm_add_pd(_mm_mul_pd(x, factor), offset);
+
+            // Values too large for the conversion trick are left to the scalar code
+            __m128i big = _mm_and_si128(_mm_add_epi64(v, bias), high);
+            bool in_range = _mm_movemask_epi8(_mm_cmpeq_epi32(big, _mm_setzero_si128())) == 0xffff &&
+                _mm_movemask_pd(_mm_cmplt_pd(_mm_and_pd(x, abs), dlimit)) == 0x3;
+            if (!in_range) {
+                apply_scalar(tr, t + i, 2);
+                continue;
+            }
+
+            v = _mm_sub_epi64(_mm_castpd_si128(_mm_add_pd(x, dmagic)), bits);
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(t + i), v);
+        }
+
+        apply_scalar(tr, t + i, n - i);
+    }
+
+    __attribute__((target("avx2")))
+    void apply_avx2(const transform& tr, std::int64_t* t, std::size_t n) {
+        const __m256i bits = _mm256_set1_epi64x(magic_bits);
+        const __m256d dmagic = _mm256_set1_pd(magic);
+        const __m256d factor = _mm256_set1_pd(tr.factor);
+        const __m256d offset = _mm256_set1_pd(tr.offset);
+        const __m256i bias = _mm256_set1_epi64x(limit);
+        const __m256i high = _mm256_set1_epi64x(~(2*limit - 1));
+        const __m256d dlimit = _mm256_set1_pd(double(limit));
+        const __m256d abs = _mm256_castsi256_pd(_mm256_set1_epi64x(0x7fffffffffffffff));
+
+        std::size_t i = 0;
+        for (; i + 4 <= n; i += 4) {
+            __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(t + i));
+            __m256d x = _mm256_sub_pd(_mm256_castsi256_pd(_mm256_add_epi64(v, bits)), dmagic);
+            x = _mm256_add_pd(_mm256_mul_pd(x, factor), offset);
+
+            __m256i big = _mm256_and_si256(_mm256_add_epi64(v, bias), high);
+            bool in_range = _mm256_testz_si256(big, big) &&
+                _mm256_movemask_pd(_mm256_cmp_pd(_mm256_and_pd(x, abs), dlimit, _CMP_LT_OQ)) == 0xf;
+            if (!in_range) {
+                apply_scalar(tr, t + i, 4);
+                continue;
+            }
+
+            v = _mm256_sub_epi64(_mm256_castpd_si256(_mm256_add_pd(x, dmagic)), bits);
+            _mm256_storeu_si256(reinterpret_cast<__m256i*>(t + i), v);
+        }
+
+        apply_scalar(tr, t + i, n - i);
+    }
+
+#endif
+
+    void apply(const transform& tr, std::int64_t* t, std::size_t n) {
+        parallel::for_chunks(n, 1 << 16, [&](std::size_t b, std::size_t e, std::size_t) {
+#if defined(__x86_64__)
+            switch (search::kernel) {
+                case search::isa::avx2 : apply_avx2(tr, t + b, e - b); return;
+                case search::isa::sse2 : apply_sse2(tr, t + b, e - b); return;
+                default : break;
+            }
+#endif
+            apply_scalar(tr, t + b, e - b);
+        });
+    }
+
+    double frame_rate(double fps) {
+        const double ntsc[] = {24.0, 30.0, 48.0, 60.0};
+        for (double r : ntsc) {
+            double exact = r*1000.0/1001.0;
+            if (std::abs(fps - exact) < 0.0051) return exact;
+        }
+
+        return fps;
+    }
+
+    transform frame_rates(double from, double to) {
+        transform tr;
+        tr.factor = frame_rate(from)/frame_rate(to);
+        return tr;
+    }
+
+}
+
+namespace align {
+    namespace {
+        // Sorted and disjoint intervals, to measure how much of a time range they cover
+        class coverage {
+        public :
+            explicit coverage(const activity& a) {
+                std::vector<std::pair<std::int64_t, std::int64_t>> all;
+                for (std::size_t i = 0; i < a.starts.size(); ++i) {
+                    if (a.ends[i] > a.starts[i]) {
+                        all.push_back(std::make_pair(a.starts[i], a.ends[i]));
+                    }
+                }
+
+                std::sort(all.begin(), all.end());
+                for (auto& p : all) {
+                    if (!starts_.empty() && p.first <= ends_.back()) {
+                        ends_.back() = std::max(ends_.back(), p.second);
+                    } else {
+                        starts_.push_back(p.first);
+                        ends_.push_back(p.second);
+                    }
+                }
+
+                prefix_.resize(starts_.size());
+                std::int64_t sum = 0;
+                for (std::size_t k = 0; k < starts_.size(); ++k) {
+                    prefix_[k] = sum;
+                    sum += ends_[k] - starts_[k];
+                }
+            }
+
+            bool empty() const {
+                return starts_.empty();
+            }
+
+            // Length of [b,e) that is covered
+            std::int64_t overlap(std::int64_t b, std::int64_t e) const {
+                return e <= b ? 0 : covered_(e) - covered_(b);
+            }
+
+        private :
+            std::vector<std::int64_t> starts_, ends_;
+            // Length covered before each interval
+            std::vector<std::int64_t> prefix_;
+
+            std::int64_t covered_(std::int64_t t) const {
+                std::size_t k = std::upper_bound(starts_.begin(), starts_.end(), t) -
+                    starts_.begin();
+                if (k == 0) return 0;
+
+                --k;
+                return prefix_[k] + std::min(t, ends_[k]) - starts_[k];
+            }
+        };
+
+        // Activity in bins of 'bin' milliseconds, one bit each: bit 'k' is the bin
+        // that starts at k*bin. Only the words from 'first' on are stored.
+        struct bitmap {
+            std::int64_t bin = 1;
+            std::int64_t first = 0;
+            std::vector<std::uint64_t> words;
+
+            // All bins overlapping [b,e) for each interval, shifted by 'offset'
+            bitmap(std::int64_t bin_size, const std::int64_t* starts, const std::int64_t* ends,
+                std::size_t n, std::int64_t offset) : bin(bin_size) {
+
+                std::int64_t lo = std::numeric_limits<std::int64_t>::max();
+                std::int64_t hi = std::numeric_limits<std::int64_t>::min();
+                for (std::size_t i = 0; i < n; ++i) {
+                    if (ends[i] <= starts[i]) continue;
+                    lo = std::min(lo, bin_of_(starts[i] + offset));
+                    hi = std::max(hi, bin_of_(ends[i] + offset - 1));
+                }
+
+                if (lo > hi) return;
+
+                first = lo >> 6;
+                words.assign((hi >> 6) - first + 1, 0);
+                for (std::size_t i = 0; i < n; ++i) {
+                    if (ends[i] <= starts[i]) continue;
+                    set_(bin_of_(starts[i] + offset), bin_of_(ends[i] + offset - 1) + 1);
+                }
+            }
+
+            // The 64 bits from bit 'p' on, with zeros outside of the map
+            std::uint64_t word_at(std::int64_t p) const {
+                std::int64_t w = (p >> 6) - first;
+                unsigned r = unsigned(p & 63);
+                std::uint64_t lo = get_(w) >> r;
+                return r == 0 ? lo : lo | get_(w + 1) << (64 - r);
+            }
+
+        private :
+            std::int64_t bin_of_(std::int64_t t) const {
+                // Rounded down, also for negative times
+                return t >= 0 ? t/bin : -((-t + bin - 1)/bin);
+            }
+
+            std::uint64_t get_(std::int64_t w) const {
+                return w < 0 || w >= std::int64_t(words.size()) ? 0 : words[w];
+            }
+
+            void set_(std::int64_t b, std::int64_t e) {
+                for (std::int64_t k = b; k < e; ) {
+                    std::int64_t w = (k >> 6) - first;
+                    unsigned r = unsigned(k & 63);
+                    std::int64_t n = std::min<std::int64_t>(64 - r, e - k);
+                    std::uint64_t mask = n == 64 ? ~std::uint64_t(0) :
+                        ((std::uint64_t(1) << n) - 1) << r;
+                    words[w] |= mask;
+                    k += n;
+                }
+            }
+        };
+
+        // Number of bins active in both 'piece' and 'ref', when 'piece' is shifted
+        // by 'shift' bins
+        std::int64_t common(const bitmap& ref, const bitmap& piece, std::int64_t shift) {
+            std::int64_t n = 0;
+            for (std::size_t j = 0; j < piece.words.size(); ++j) {
+                if (piece.words[j] == 0) continue;
+                std::int64_t p = (piece.first + std::int64_t(j))*64 + shift;
+                n += __builtin_popcountll(piece.words[j] & ref.word_at(p));
+            }
+
+            return n;
+        }
+
+        // Shift in [lo,hi] with the most bins in common, and how many
+        std::int64_t best_shift(const bitmap& ref, const bitmap& piece, std::int64_t lo,
+            std::int64_t hi, std::int64_t& score) {
+
+            std::size_t n = std::size_t(hi - lo + 1);
+            std::vector<std::pair<std::int64_t, std::int64_t>> best(parallel::thread_count(),
+                std::make_pair(std::int64_t(-1), lo));
+
+            // Ties go to the smallest shift, whatever the number of threads
+            parallel::for_chunks(n, 256, [&](std::size_t b, std::size_t e, std::size_t c) {
+                for (std::size_t k = b; k < e; ++k) {
+                    std::int64_t s = common(ref, piece, lo + std::int64_t(k));
+                    if (s > best[c].first) best[c] = std::make_pair(s, lo + std::int64_t(k));
+                }
+            });
+
+            std::pair<std::int64_t, std::int64_t> r = best[0];
+            for (auto& b : best) {
+                if (b.first > r.first || (b.first == r.first && b.second < r.second)) r = b;
+            }
+
+            score = r.first;
+            return r.second;
+        }
+
+        // Time of entries [b,e) that matches the reference, with 'offset' added
+        std::int64_t matched(const coverage& ref, const std::vector<std::int64_t>& starts,
+            const std::vector<std::int64_t>& ends, std::size_t b, std::size_t e,
+            std::int64_t offset) {
+
+            std::int64_t sum = 0;
+            for (std::size_t i = b; i < e; ++i) {
+                sum += ref.overlap(starts[i] + offset, ends[i] + offset);
+            }
+
+            return sum;
+        }
+
+        // Offset near 'guess' (within 'range') that matches best for entries [b,e),
+        // first in steps of 10 ms, then of 1 ms
+        std::int64_t refine(const coverage& ref, const std::vector<std::int64_t>& starts,
+            const std::vector<std::int64_t>& ends, std::size_t b, std::size_t e,
+            std::int64_t guess, std::int64_t range) {
+
+            for (std::int64_t step : {std::int64_t(10), std::int64_t(1)}) {
+                std::size_t n = std::size_t(2*(range/step) + 1);
+                std::vector<std::int64_t> scores(n);
+                parallel::for_chunks(n, 1, [&](std::size_t cb, std::size_t ce, std::size_t) {
+                    for (std::size_t k = cb; k < ce; ++k) {
+                        std::int64_t o = guess + (std::int64_t(k) - std::int64_t(n/2))*step;
+                        scores[k] = matched(ref, starts, ends, b, e, o);
+                    }
+                });
+
+                // The closest to the guess, among the best
+                std::size_t best = n/2;
+                for (std::size_t k = 0; k < n; ++k) {
+                    std::size_t dk = k > n/2 ? k - n/2 : n/2 - k;
+                    std::size_t db = best > n/2 ? best - n/2 : n/2 - best;
+                    if (scores[k] > scores[best] || (scores[k] == scores[best] && dk < db)) {
+                        best = k;
+                    }
+                }
+
+                guess += (std::int64_t(best) - std::int64_t(n/2))*step;
+                range = step;
+            }
+
+            return guess;
+        }
+    }
+
+    bool compute(const activity& track, const activity& reference, const options& o,
+        correction& c, std::string& err) {
+
+        coverage ref(reference);
+        std::int64_t total = 0;
+        for (std::size_t i = 0; i < track.starts.size(); ++i) {
+            total += std::max<std::int64_t>(0, track.ends[i] - track.starts[i]);
+        }
+
+        if (ref.empty() || total == 0) {
+            err = "nothing to align";
+            return false;
+        }
+
+        const std::size_t n = track.starts.size();
+        const std::int64_t bin = o.bin;
+        bitmap ref_bits(bin, reference.starts.data(), reference.ends.data(),
+            reference.starts.size(), 0);
+
+        // The global offset is first searched with coarser bins, then refined
+        const std::int64_t coarse = 4;
+        bitmap ref_coarse(coarse*bin, reference.starts.data(), reference.ends.data(),
+            reference.starts.size(), 0);
+
+        // Frame rate changes between the usual rates, and the global offset for each
+        std::vector<double> factors = {1.0};
+        const double rates[] = {23.976, 24.0, 25.0, 29.97, 30.0};
+        for (double from : rates) {
+            for (double to : rates) {
+                double f = linear::frame_rates(from, to).factor;
+                bool known = false;
+                for (double g : factors) known = known || std::abs(f - g) < 1e-9;
+                if (!known && std::abs(f - 1.0) < 0.05) factors.push_back(f);
+            }
+        }
+
+        std::vector<std::int64_t> starts(n), ends(n);
+        std::int64_t best_score = -1;
+        for (double f : factors) {
+            linear::transform tr;
+            tr.factor = f;
+            std::copy(track.starts.begin(), track.starts.end(), starts.begin());
+            std::copy(track.ends.begin(), track.ends.end(), ends.begin());
+            linear::apply(tr, starts.data(), n);
+            linear::apply(tr, ends.data(), n);
+
+            bitmap bits_coarse(coarse*bin, starts.data(), ends.data(), n, 0);
+            std::int64_t score = 0;
+            std::int64_t range = o.max_offset/bin/coarse;
+            std::int64_t shift = coarse*best_shift(ref_coarse, bits_coarse, -range, range, score);
+
+            bitmap bits(bin, starts.data(), ends.data(), n, 0);
+            shift = best_shift(ref_bits, bits, shift - 2*coarse, shift + 2*coarse, score);
+
+            // Another frame rate must do clearly better
+            if (best_score < 0 || score > best_score + best_score/50) {
+                best_score = score;
+                c.tr.factor = f;
+                c.tr.offset = double(shift*bin);
+            }
+        }
+
+        std::copy(track.starts.begin(), track.starts.end(), starts.begin());
+        std::copy(track.ends.begin(), track.ends.end(), ends.begin());
+        linear::apply(c.tr, starts.data(), n);
+        linear::apply(c.tr, ends.data(), n);
+
+        // Pieces of the track, in entry order: each starts a window later than the
+        // one before at least
+        std::vector<std::size_t> window_first;
+        std::int64_t origin = starts[0];
+        for (std::size_t i = 0; i < n; ++i) {
+            std::int64_t w = std::max<std::int64_t>(0, (starts[i] - origin)/o.window);
+            while (std::int64_t(window_first.size()) <= w) window_first.push_back(i);
+        }
+
+        window_first.push_back(n);
+        std::size_t windows = window_first.size() - 1;
+
+        // Shift of each piece, relative to the global one
+        const std::int64_t max_jump = o.max_jump/bin;
+        const std::size_t shifts = std::size_t(2*max_jump + 1);
+        std::vector<std::int64_t> scores(windows*shifts);
+        parallel::for_chunks(windows, 1, [&](std::size_t b, std::size_t e, std::size_t) {
+            for (std::size_t w = b; w < e; ++w) {
+                std::size_t first = window_first[w], count = window_first[w + 1] - first;
+                if (count == 0) continue;
+
+                bitmap piece(bin, &starts[first], &ends[first], count, 0);
+                for (std::size_t k = 0; k < shifts; ++k) {
+                    scores[w*shifts + k] = common(ref_bits, piece, std::int64_t(k) - max_jump);
+                }
+            }
+        });
+
+        // Best shift of each piece, when changing shifts from one piece to the next
+        // costs as much as a tenth of a piece matching (a banded dynamic time warping,
+        // with pieces that move as a block)
+        const std::int64_t jump_cost = o.window/bin/10;
+        std::vector<std::int64_t> value(shifts, 0), next(shifts);
+        std::vector<char> jumped(windows*shifts, 0);
+        std::vector<std::size_t> came_from(windows, 0);
+        for (std::size_t w = 0; w < windows; ++w) {
+            std::size_t best = max_jump;
+            for (std::size_t k = 0; k < shifts; ++k) {
+                if (value[k] > value[best]) best = k;
+            }
+
+            came_from[w] = best;
+            for (std::size_t k = 0; k < shifts; ++k) {
+                bool jump = w != 0 && value[best] - jump_cost > value[k];
+                jumped[w*shifts + k] = jump;
+                next[k] = scores[w*shifts + k] + (jump ? value[best] - jump_cost : value[k]);
+            }
+
+            value.swap(next);
+        }
+
+        std::vector<std::int64_t> piece_shift(windows);
+        std::size_t k = max_jump;
+        for (std::size_t s = 0; s < shifts; ++s) {
+            if (value[s] > value[k]) k = s;
+        }
+
+        for (std::size_t w = windows; w-- > 0; ) {
+            piece_shift[w] = (std::int64_t(k) - max_jump)*bin;
+            if (jumped[w*shifts + k]) k = came_from[w];
+        }
+
+        // Entries where the shift changes: the cut that matches best, between the
+        // two pieces
+        std::vector<std::pair<std::size_t, std::int64_t>> pieces;
+        std::size_t last = windows;
+        for (std::size_t w = 0; w < windows; ++w) {
+            if (window_first[w] == window_first[w + 1]) continue;
+
+            if (pieces.empty()) {
+                pieces.push_back(std::make_pair(std::size_t(0), piece_shift[w]));
+            } else if (piece_shift[w] != pieces.back().second) {
+                std::size_t b = std::max(pieces.back().first + 1, window_first[last]);
+                std::size_t e = window_first[w + 1];
+                std::int64_t s1 = pieces.back().second, s2 = piece_shift[w];
+
+                std::int64_t score = matched(ref, starts, ends, b, e, s2);
+                std::int64_t best = score;
+                std::size_t cut = b;
+                for (std::size_t i = b; i + 1 < e; ++i) {
+                    score += ref.overlap(starts[i] + s1, ends[i] + s1) -
+                        ref.overlap(starts[i] + s2, ends[i] + s2);
+                    if (score > best) {
+                        best = score;
+                        cut = i + 1;
+                    }
+                }
+
+                pieces.push_back(std::make_pair(cut, s2));
+            }
+
+            last = w;
+        }
+
+        // Then to the millisecond
+        std::vector<std::int64_t> exact(pieces.size());
+        for (std::size_t p = 0; p < pieces.size(); ++p) {
+            std::size_t e = p + 1 < pieces.size() ? pieces[p + 1].first : n;
+            exact[p] = refine(ref, starts, ends, pieces[p].first, e, pieces[p].second, bin);
+        }
+
+        c.tr.offset += double(exact[0]);
+        c.shifts.clear();
+        for (std::size_t p = 1; p < pieces.size(); ++p) {
+            if (exact[p] != exact[p - 1]) {
+                c.shifts.push_back(std::make_pair(pieces[p].first, exact[p] - exact[p - 1]));
+            }
+        }
+
+        c.before = double(matched(ref, track.starts, track.ends, 0, n, 0))/total;
+        std::int64_t after = 0;
+        for (std::size_t p = 0; p < pieces.size(); ++p) {
+            std::size_t e = p + 1 < pieces.size() ? pieces[p + 1].first : n;
+            after += matched(ref, starts, ends, pieces[p].first, e, exact[p]);
+        }
+
+        c.after = double(after)/total;
+        return true;
+    }
+}
+
+namespace audio {
+    namespace {
+        std::uint32_t le32(const unsigned char* p) {
+            return std::uint32_t(p[0]) | std::uint32_t(p[1]) << 8 | std::uint32_t(p[2]) << 16 |
+                std::uint32_t(p[3]) << 24;
+        }
+
+        std::uint16_t le16(const unsigned char* p) {
+            return std::uint16_t(p[0] | p[1] << 8);
+        }
+
+        // Mix the 'n' frames of 'p' into mono 16 bit samples
+        void decode(const wav_format& f, const char* p, std::size_t n, std::int16_t* out) {
+            const unsigned char* u = reinterpret_cast<const unsigned char*>(p);
+            const std::size_t width = f.bits/8;
+            for (std::size_t i = 0; i < n; ++i) {
+                std::int32_t sum = 0;
+                for (std::size_t c = 0; c < f.channels; ++c, u += width) {
+                    if (f.floating) {
+                        float x;
+                        std::memcpy(&x, u, 4);
+                        sum += std::int32_t(std::max(-1.0f, std::min(1.0f, x))*32767.0f);
+                    } else if (width == 1) {
+                        sum += (std::int32_t(u[0]) - 128) << 8;
+                    } else {
+                        // The 16 most significant bits
+                        sum += std::int16_t(u[width - 2] | u[width - 1] << 8);
+                    }
+                }
+
+                out[i] = std::int16_t(sum/std::int32_t(f.channels));
+            }
+        }
+    }
+
+    bool read_header(int fd, wav_format& f, std::string& err) {
+        struct stat st;
+        unsigned char h[12];
+        if (::fstat(fd, &st) != 0 || !file::read_all(fd, reinterpret_cast<char*>(h), 12, 0) ||
+            std::memcmp(h, "RIFF", 4) != 0 || std::memcmp(h + 8, "WAVE", 4) != 0) {
+            err = "not a WAV file";
+            return false;
+        }
+
+        std::uint64_t size = std::uint64_t(st.st_size);
+        std::uint64_t pos = 12;
+        bool has_format = false;
+        while (pos + 8 <= size) {
+            unsigned char c[8];
+            if (!file::read_all(fd, reinterpret_cast<char*>(c), 8, pos)) break;
+
+            std::uint64_t length = le32(c + 4);
+            pos += 8;
+            if (std::memcmp(c, "fmt ", 4) == 0 && length >= 16) {
+                unsigned char fmt[40] = {};
+                if (!file::read_all(fd, reinterpret_cast<char*>(fmt),
+                    std::min<std::uint64_t>(length, sizeof(fmt)), pos)) break;
+
+                std::uint16_t tag = le16(fmt);
+                // WAVE_FORMAT_EXTENSIBLE: the real tag starts the sub-format
+                if (tag == 0xfffe && length >= 26) tag = le16(fmt + 24);
+
+                f.channels = le16(fmt + 2);
+                f.rate = le32(fmt + 4);
+                f.bits = le16(fmt + 14);
+                f.floating = tag == 3;
+                bool ok = (tag == 1 && (f.bits == 8 || f.bits == 16 || f.bits == 24 ||
+                    f.bits == 32)) || (tag == 3 && f.bits == 32);
+                if (!ok || f.channels == 0 || f.rate < 1000) {
+                    err = "unsupported WAV format: only PCM and 32 bit float samples can be read";
+                    return false;
+                }
+
+                has_format = true;
+            } else if (std::memcmp(c, "data", 4) == 0 && has_format) {
+                // Files too large for the header give a wrong or maximal size
+                f.data_offset = pos;
+                f.data_size = std::min(length, size - pos);
+                if (length == 0xffffffff || length == 0) f.data_size = size - pos;
+                return true;
+            }
+
+            pos += length + (length & 1);
+        }
+
+        err = "no sound in the WAV file";
+        return false;
+    }
+
+    frame_stats analyze_scalar(const std::int16_t* s, std::size_t n, std::int16_t prev) {
+        frame_stats r;
+        for (std::size_t i = 0; i < n; ++i) {
+            std::int32_t h = s[i] >> 1;
+            r.energy += std::uint64_t(h*h);
+            r.crossings += (s[i] ^ prev) < 0;
+            prev = s[i];
+        }
+
+        return r;
+    }
+
+#if defined(__x86_64__)
+    frame_stats analyze_sse2(const std::int16_t* s, std::size_t n, std::int16_t prev) {
+        if (n == 0) return frame_stats();
+
+        // The first sample is compared to 'prev', the others to the one before them
+        frame_stats r = analyze_scalar(s, 1, prev);
+        const __m128i zero = _mm_setzero_si128();
+        __m128i energy = zero, crossings = zero, counts = zero;
+        std::size_t i = 1, k = 0;
+        for (; i + 8 <= n; i += 8) {
+            __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(s + i));
+            __m128i p = _mm_loadu_si128(reinterpret_cast<const __m128i*>(s + i - 1));
+            __m128i h = _mm_srai_epi16(v, 1);
+            __m128i sq = _mm_madd_epi16(h, h);
+            energy = _mm_add_epi64(energy, _mm_unpacklo_epi32(sq, zero));
+            energy = _mm_add_epi64(energy, _mm_unpackhi_epi32(sq, zero));
+            counts = _mm_sub_epi16(counts, _mm_srai_epi16(_mm_xor_si128(v, p), 15));
+
+            // 16 bit counts must not overflow
+            if (++k == 0x4000) {
+                crossings = _mm_add_epi32(crossings, _mm_madd_epi16(counts, _mm_set1_epi16(1)));
+                counts = zero;
+                k = 0;
+            }
+        }
+
+        crossings = _mm_add_epi32(crossings, _mm_madd_epi16(counts, _mm_set1_epi16(1)));
+
+        std::uint64_t e[2];
+        std::uint32_t c[4];
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(e), energy);
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(c), crossings);
+        frame_stats rest = analyze_scalar(s + i, n - i, s[i - 1]);
+        r.energy += e[0] + e[1] + rest.energy;
+        r.crossings += std::uint64_t(c[0]) + c[1] + c[2] + c[3] + rest.crossings;
+        return r;
+    }
+
+    __attribute__((target("avx2")))
+    frame_stats analyze_avx2(const std::int16_t* s, std::size_t n, std::int16_t prev) {
+        if (n == 0) return frame_stats();
+
+        frame_stats r = analyze_scalar(s, 1, prev);
+        const __m256i zero = _mm256_setzero_si256();
+        __m256i energy = zero, crossings = zero, counts = zero;
+        std::size_t i = 1, k = 0;
+        for (; i + 16 <= n; i += 16) {
+            __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(s + i));
+            __m256i p = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(s + i - 1));
+            __m256i h = _mm256_srai_epi16(v, 1);
+            __m256i sq = _mm256_madd_epi16(h, h);
+            energy = _mm256_add_epi64(energy, _mm256_unpacklo_epi32(sq, zero));
+            energy = _mm256_add_epi64(energy, _mm256_unpackhi_epi32(sq, zero));
+            counts = _mm256_sub_epi16(counts, _mm256_srai_epi16(_mm256_xor_si256(v, p), 15));
+
+            if (++k == 0x4000) {
+                crossings = _mm256_add_epi32(crossings,
+                    _mm256_madd_epi16(counts, _mm256_set1_epi16(1)));
+                counts = zero;
+                k = 0;
+            }
+        }
+
+        crossings = _mm256_add_epi32(crossings, _mm256_madd_epi16(counts, _mm256_set1_epi16(1)));
+
+        std::uint64_t e[4];
+        std::uint32_t c[8];
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(e), energy);
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(c), crossings);
+        frame_stats rest = analyze_scalar(s + i, n - i, s[i - 1]);
+        r.energy += e[0] + e[1] + e[2] + e[3] + rest.energy;
+        r.crossings += rest.crossings;
+        for (auto x : c) r.crossings += x;
+        return r;
+    }
+#endif
+
+    frame_stats analyze(const std::int16_t* s, std::size_t n, std::int16_t prev) {
+#if defined(__x86_64__)
+        switch (search::kernel) {
+            case search::isa::avx2 : return analyze_avx2(s, n, prev);
+            case search::isa::sse2 : return analyze_sse2(s, n, prev);
+            default : break;
+        }
+#endif
+        return analyze_scalar(s, n, prev);
+    }
+
+    bool voice_activity(const std::string& file_name, const options& o,
+        align::activity& a, double& seconds, std::string& err) {
+
+        int fd = ::open(file_name.c_str(), O_RDONLY);
+        if (fd < 0) {
+            err = file::system_error("cannot open file", file_name);
+            return false;
+        }
+
+        wav_format f;
+        if (!read_header(fd, f, err)) {
+            err = file_name+": "+err;
+            ::close(fd);
+            return false;
+        }
+
+        const std::size_t frame = std::max<std::size_t>(1, f.rate*o.frame_msec/1000);
+        const std::size_t frame_bytes = frame*f.frame_bytes();
+        const std::size_t frames = f.data_size/frame_bytes;
+        seconds = f.seconds();
+
+        // Level (dB) and sign changes per second of each frame
+        std::vector<float> level(frames), crossings(frames);
+        std::atomic<bool> failed(false);
+        std::size_t pieces = (frames + o.piece_frames - 1)/o.piece_frames;
+        parallel::for_each_task(pieces, parallel::thread_count(), [&](std::size_t p, std::size_t) {
+            // A few seconds at a time
+            const std::size_t block = 256;
+            std::size_t first = p*o.piece_frames;
+            std::size_t last = std::min(frames, first + o.piece_frames);
+            std::vector<char> raw;
+            std::vector<std::int16_t> mono;
+            std::int16_t prev = 0;
+            for (std::size_t b = first; b < last && !failed; b += block) {
+                std::size_t n = std::min(block, last - b);
+                raw.resize(n*frame_bytes);
+                mono.resize(n*frame);
+                if (!file::read_all(fd, raw.data(), raw.size(), f.data_offset + b*frame_bytes)) {
+                    failed = true;
+                    return;
+                }
+
+                decode(f, raw.data(), n*frame, mono.data());
+                for (std::size_t k = 0; k < n; ++k) {
+                    frame_stats st = analyze(&mono[k*frame], frame, prev);
+                    prev = mono[k*frame + frame - 1];
+                    level[b + k] = float(10.0*std::log10(1.0 + 4.0*st.energy/frame));
+                    crossings[b + k] = float(st.crossings*1000.0/o.frame_msec);
+                }
+            }
+        });
+
+        if (failed) {
+            err = file::system_error("cannot read file", file_name);
+        }
+
+        ::close(fd);
+        if (failed) return false;
+
+        stats::add(stats::counter::bytes_read, frames*frame_bytes);
+        if (frames == 0) {
+            err = file_name+": no sound in the WAV file";
+            return false;
+        }
+
+        // Voice is loud compared to the quietest parts of the file
+        std::vector<float> sorted(level);
+        auto quantile = [&](double q) {
+            std::size_t k = std::min(frames - 1, std::size_t(q*frames));
+            std::nth_element(sorted.begin(), sorted.begin() + k, sorted.end());
+            return sorted[k];
+        };
+
+        double quiet = quantile(0.1);
+        double loud = quantile(0.95);
+        double threshold = quiet + std::max(6.0, o.threshold*(loud - quiet));
+
+        a.starts.clear();
+        a.ends.clear();
+        const std::int64_t ms = std::int64_t(o.frame_msec);
+        for (std::size_t k = 0; k < frames; ) {
+            if (level[k] <= threshold || crossings[k] > o.max_crossings_per_second) {
+                ++k;
+                continue;
+            }
+
+            std::size_t e = k + 1;
+            while (e < frames && level[e] > threshold &&
+                crossings[e] <= o.max_crossings_per_second) ++e;
+
+            std::int64_t b = std::int64_t(k)*ms;
+            if (!a.ends.empty() && b - a.ends.back() < o.min_pause) {
+                a.ends.back() = std::int64_t(e)*ms;
+            } else {
+                if (!a.ends.empty() && a.ends.back() - a.starts.back() < o.min_voice) {
+                    a.starts.pop_back();
+                    a.ends.pop_back();
+                }
+
+                a.starts.push_back(b);
+                a.ends.push_back(std::int64_t(e)*ms);
+            }
+
+            k = e;
+        }
+
+        if (!a.ends.empty() && a.ends.back() - a.starts.back() < o.min_voice) {
+            a.starts.pop_back();
+            a.ends.pop_back();
+        }
+
+        return true;
+    }
+}
+
+namespace encoding {
+    namespace {
+        void put_utf8(std::uint32_t c, char*& o) {
+            if (c < 0x80) {
+                *o++ = char(c);
+            } else if (c < 0x800) {
+                *o++ = char(0xc0 | c >> 6);
+                *o++ = char(0x80 | (c & 0x3f));
+            } else if (c < 0x10000) {
+                *o++ = char(0xe0 | c >> 12);
+                *o++ = char(0x80 | (c >> 6 & 0x3f));
+                *o++ = char(0x80 | (c & 0x3f));
+            } else {
+                *o++ = char(0xf0 | c >> 18);
+                *o++ = char(0x80 | (c >> 12 & 0x3f));
+                *o++ = char(0x80 | (c >> 6 & 0x3f));
+                *o++ = char(0x80 | (c & 0x3f));
+            }
+        }
+
+        // Read the UTF-8 character at 'i' into 'c', and return the position after
+        // it, or 0 if it is not valid
+        std::size_t next_utf8(const unsigned char* p, std::size_t n, std::size_t i,
+            std::uint32_t& c) {
+
+            c = p[i];
+            if (c < 0x80) return i + 1;
+
+            std::size_t size = 0;
+            std::uint32_t min = 0;
+            if (c >= 0xc2 && c <= 0xdf) {
+                size = 2;
+                min = 0x80;
+                c &= 0x1f;
+            } else if ((c & 0xf0) == 0xe0) {
+                size = 3;
+                min = 0x800;
+                c &= 0x0f;
+            } else if (c >= 0xf0 && c <= 0xf4) {
+                size = 4;
+                min = 0x10000;
+                c &= 0x07;
+            } else {
+                return 0;
+            }
+
+            if (n - i < size) return 0;
+
+            for (std::size_t k = 1; k < size; ++k) {
+                if ((p[i + k] & 0xc0) != 0x80) return 0;
+                c = c << 6 | (p[i + k] & 0x3f);
+            }
+
+            if (c < min || c > 0x10ffff || (c >= 0xd800 && c <= 0xdfff)) return 0;
+
+            return i + size;
+        }
+
+        // Convert the UTF-16 character at unit 'i' of 'p' ('n' units), and return
+        // the next unit
+        std::size_t put_utf16(const unsigned char* p, std::size_t n, std::size_t i, bool big,
+            char*& o) {
+
+            auto unit = [&](std::size_t k) {
+                return big ? std::uint32_t(p[2*k] << 8 | p[2*k + 1]) :
+                    std::uint32_t(p[2*k] | p[2*k + 1] << 8);
+            };
+
+            std::uint32_t c = unit(i++);
+            if (c >= 0xd800 && c < 0xdc00 && i < n) {
+                std::uint32_t d = unit(i);
+                if (d >= 0xdc00 && d < 0xe000) {
+                    c = 0x10000 + ((c - 0xd800) << 10) + (d - 0xdc00);
+                    ++i;
+                }
+            }
+
+            put_utf8(c >= 0xd800 && c < 0xe000 ? 0xfffd : c, o);
+            return i;
+        }
+
+        // Windows-1252 characters 0x80 to 0x9f; the five unused ones are read as
+        // Latin-1 (control characters)
+        const std::uint16_t cp1252_high[32] = {
+            0x20ac, 0x0081, 0x201a, 0x0192, 0x201e, 0x2026, 0x2020, 0x2021,
+            0x02c6, 0x2030, 0x0160, 0x2039, 0x0152, 0x008d, 0x017d, 0x008f,
+            0x0090, 0x2018, 0x2019, 0x201c, 0x201d, 0x2022, 0x2013, 0x2014,
+            0x02dc, 0x2122, 0x0161, 0x203a, 0x0153, 0x009d, 0x017e, 0x0178
+        };
+
+        void put_cp1252(unsigned char c, char*& o) {
+            if (c < 0x80) {
+                *o++ = char(c);
+            } else {
+                put_utf8(c < 0xa0 ? cp1252_high[c - 0x80] : c, o);
+            }
+        }
+
+        char to_cp1252(std::uint32_t c) {
+            if (c < 0x80 || (c >= 0xa0 && c <= 0xff)) return char(c);
+
+            for (std::size_t k = 0; k < 32; ++k) {
+                if (cp1252_high[k] == c) return char(0x80 + k);
+            }
+
+            return '?';
+        }
+
+#if defined(__x86_64__)
+        // Shuffles that gather the bytes of a group of 8 whose bits are set in
+        // 'keep', and how many there are
+        struct compaction {
+            std::uint8_t shuffle[256][8];
+            std::uint8_t count[256];
+
+            compaction() {
+                for (std::size_t keep = 0; keep < 256; ++keep) {
+                    std::size_t k = 0;
+                    for (std::size_t b = 0; b < 8; ++b) {
+                        if (keep >> b & 1) shuffle[keep][k++] = std::uint8_t(b);
+                    }
+
+                    count[keep] = std::uint8_t(k);
+                    for (std::size_t b = k; b < 8; ++b) shuffle[keep][b] = 0x80;
+                }
+            }
+        };
+
+        const compaction& compactions() {
+            static const compaction c;
+            return c;
+        }
+#endif
+    }
+
+    const char* name(charset c) {
+        switch (c) {
+            case charset::utf16le : return "UTF-16 (little endian)";
+            case charset::utf16be : return "UTF-16 (big endian)";
+            case charset::cp1252  : return "Windows-1252";
+            default : return "UTF-8";
+        }
+    }
+
+    text_format detect(const char* p, std::size_t n) {
+        const unsigned char* u = reinterpret_cast<const unsigned char*>(p);
+        text_format f;
+        std::size_t skip = 0;
+        if (n >= 3 && u[0] == 0xef && u[1] == 0xbb && u[2] == 0xbf) {
+            f.bom = true;
+            skip = 3;
+        } else if (n >= 2 && ((u[0] == 0xff && u[1] == 0xfe) || (u[0] == 0xfe && u[1] == 0xff))) {
+            f.set = u[0] == 0xff ? charset::utf16le : charset::utf16be;
+            f.bom = true;
+            skip = 2;
+        } else {
+            // Without a byte order mark, UTF-16 text is mostly ASCII characters, each
+            // with a zero byte. A few other characters have a zero byte on the other
+            // side (U+0100, the low surrogate of U+1F600).
+            std::size_t m = std::min<std::size_t>(n, 4096) & ~std::size_t(1);
+            std::size_t zeros[2] = {0, 0};
+            for (std::size_t k = 0; k < m; ++k) {
+                zeros[k & 1] += u[k] == 0;
+            }
+
+            if (m >= 4 && zeros[1] >= m/4 && zeros[0] <= zeros[1]/16) f.set = charset::utf16le;
+            if (m >= 4 && zeros[0] >= m/4 && zeros[1] <= zeros[0]/16) f.set = charset::utf16be;
+        }
+
+        if (f.set == charset::utf16le || f.set == charset::utf16be) {
+            std::size_t lo = f.set == charset::utf16le ? 0 : 1;
+            for (std::size_t k = skip; k + 1 < n; k += 2) {
+                if (u[k + lo] == '\n' && u[k + 1 - lo] == 0) {
+                    f.crlf = k >= skip + 2 && u[k - 2 + lo] == '\r' && u[k - 1 - lo] == 0;
+                    break;
+                }
+            }
+
+            f.converted = true;
+            return f;
+        }
+
+        if (!valid_utf8(p + skip, n - skip)) f.set = charset::cp1252;
+
+        const char* lf = static_cast<const char*>(memchr(p + skip, '\n', n - skip));
+        f.crlf = lf && lf != p + skip && lf[-1] == '\r';
+        f.converted = f.bom || f.set != charset::utf8 || memchr(p + skip, '\r', n - skip);
+        return f;
+    }
+
+    void decode(const text_format& f, const char* p, std::size_t n, std::string& out) {
+        if (f.set == charset::utf8) {
+            std::size_t skip = f.bom ? 3 : 0;
+            out.assign(p + skip, n - skip);
+        } else if (f.set == charset::cp1252) {
+            out.resize(3*n);
+            out.resize(from_cp1252(p, n, &out[0]));
+        } else {
+            std::size_t skip = f.bom ? 2 : 0;
+            out.resize(3*n);
+            out.resize(from_utf16(p + skip, n - skip, f.set == charset::utf16be, &out[0]));
+        }
+
+        if (!out.empty()) out.resize(remove_cr(&out[0], out.size()));
+    }
+
+    void encode(const text_format& f, const std::string& in, std::string& out) {
+        out.clear();
+        if (f.set == charset::utf8) {
+            out.reserve(in.size() + in.size()/16 + 3);
+            if (f.bom) out += "\xef\xbb\xbf";
+            if (!f.crlf) {
+                out += in;
+                return;
+            }
+
+            for (std::size_t b = 0; b < in.size(); ) {
+                std::size_t e = in.find('\n', b);
+                if (e == std::string::npos) {
+                    out.append(in, b, std::string::npos);
+                    break;
+                }
+
+                out.append(in, b, e - b);
+                out += "\r\n";
+                b = e + 1;
+            }
+
+            return;
+        }
+
+        const unsigned char* u = reinterpret_cast<const unsigned char*>(in.data());
+        const bool big = f.set == charset::utf16be;
+        auto unit = [&](std::uint32_t c) {
+            out += char(big ? c >> 8 : c & 0xff);
+            out += char(big ? c & 0xff : c >> 8);
+        };
+
+        out.reserve(f.set == charset::cp1252 ? in.size() + in.size()/16 : 2*in.size() + 2);
+        if (f.bom && f.set != charset::cp1252) unit(0xfeff);
+
+        for (std::size_t i = 0; i < in.size(); ) {
+            std::uint32_t c = 0;
+            std::size_t next = next_utf8(u, in.size(), i, c);
+            if (next == 0) {
+                c = 0xfffd;
+                next = i + 1;
+            }
+
+            i = next;
+            if (f.set == charset::cp1252) {
+                if (c == '\n' && f.crlf) out += '\r';
+                out += to_cp1252(c);
+            } else if (c < 0x10000) {
+                if (c == '\n' && f.crlf) unit('\r');
+                unit(c);
+            } else {
+                unit(0xd800 + ((c - 0x10000) >> 10));
+                unit(0xdc00 + ((c - 0x10000) & 0x3ff));
+            }
+        }
+    }
+
+    std::size_t complete(const text_format& f, const char* p, std::size_t n) {
+        const unsigned char* u = reinterpret_cast<const unsigned char*>(p);
+        if (f.set == charset::utf16le || f.set == charset::utf16be) {
+            n &= ~std::size_t(1);
+            if (n == 0) return 0;
+
+            std::size_t lo = f.set == charset::utf16le ? 0 : 1;
+            std::uint32_t c = u[n - 2 + lo] | (u[n - 1 - lo] << 8);
+            return c == '\r' || (c >= 0xd800 && c < 0xdc00) ? n - 2 : n;
+        }
+
+        if (f.set == charset::utf8) {
+            // Back to the lead byte of the last character, if it is not whole
+            std::size_t b = n;
+            while (b > 0 && n - b < 3 && (u[b-1] & 0xc0) == 0x80) --b;
+            if (b > 0 && u[b-1] >= 0xc0) {
+                std::size_t length = u[b-1] >= 0xf0 ? 4 : u[b-1] >= 0xe0 ? 3 : 2;
+                if (n - b + 1 < length) n = b - 1;
+            }
+        }
+
+        return n > 0 && u[n-1] == '\r' ? n - 1 : n;
+    }
+
+    bool valid_utf8_scalar(const char* p, std::size_t n) {
+        const unsigned char* u = reinterpret_cast<const unsigned char*>(p);
+        std::uint32_t c = 0;
+        for (std::size_t i = 0; i < n; ) {
+            // Eight ASCII characters at once
+            std::uint64_t w;
+            if (i + 8 <= n && (std::memcpy(&w, p + i, 8), (w & 0x8080808080808080ull) == 0)) {
+                i += 8;
+                continue;
+            }
+
+            i = next_utf8(u, n, i, c);
+            if (i == 0) return false;
+        }
+
+        return true;
+    }
+
+    std::size_t remove_cr_scalar(char* p, std::size_t n) {
+        std::size_t j = 0;
+        for (std::size_t i = 0; i < n; ++i) {
+            char c = p[i];
+            p[j] = c;
+            j += !(c == '\r' && i + 1 < n && p[i + 1] == '\n');
+        }
+
+        return j;
+    }
+
+    std::size_t from_utf16_scalar(const char* p, std::size_t n, bool big, char* out) {
+        const unsigned char* u = reinterpret_cast<const unsigned char*>(p);
+        char* o = out;
+        for (std::size_t i = 0; i < n/2; ) {
+            i = put_utf16(u, n/2, i, big, o);
+        }
+
+        return o - out;
+    }
+
+    std::size_t from_cp1252_scalar(const char* p, std::size_t n, char* out) {
+        const unsigned char* u = reinterpret_cast<const unsigned char*>(p);
+        char* o = out;
+        for (std::size_t i = 0; i < n; ++i) {
+            put_cp1252(u[i], o);
+        }
+
+        return o - out;
+    }
+
+#if defined(__x86_64__)
+    // ASCII characters are skipped 16 at a time, the others checked one by one
+    bool valid_utf8_sse2(const char* p, std::size_t n) {
+        const unsigned char* u = reinterpret_cast<const unsigned char*>(p);
+        std::uint32_t c = 0;
+        std::size_t i = 0;
+        while (i + 16 <= n) {
+            int m = _mm_movemask_epi8(_mm_loadu_si128(reinterpret_cast<const __m128i*>(p + i)));
+            if (m == 0) {
+                i += 16;
+                continue;
+            }
+
+            i = next_utf8(u, n, i + __builtin_ctz(m), c);
+            if (i == 0) return false;
+        }
+
+        return valid_utf8_scalar(p + i, n - i);
+    }
+
+    // The whole text goes through the same steps (Keiser and Lemire, "Validating
+    // UTF-8 in less than one instruction per byte"): each byte and the three before
+    // it tell which errors they could make, through three 16-entry tables.
+    __attribute__((target("avx2")))
+    bool valid_utf8_avx2(const char* p, std::size_t n) {
+        const std::uint8_t too_short = 1 << 0, too_long = 1 << 1, overlong_3 = 1 << 2,
+            too_large = 1 << 3, surrogate = 1 << 4, overlong_2 = 1 << 5,
+            too_large_1000 = 1 << 6, overlong_4 = 1 << 6, two_conts = 1 << 7;
+        const std::uint8_t carry = too_short | too_long | two_conts;
+        const std::uint8_t large = too_large | too_large_1000;
+
+        // First byte's high and low nibbles, second byte's high nibble
+        static const std::uint8_t first_high[16] = {
+            too_long, too_long, too_long, too_long, too_long, too_long, too_long, too_long,
+            two_conts, two_conts, two_conts, two_conts, too_short | overlong_2, too_short,
+            too_short | overlong_3 | surrogate, too_short | large | overlong_4
+        };
+
+        static const std::uint8_t first_low[16] = {
+            carry | overlong_3 | overlong_2 | overlong_4, carry | overlong_2, carry, carry,
+            carry | too_large, carry | large, carry | large, carry | large,
+            carry | large, carry | large, carry | large, carry | large,
+            carry | large, carry | large | surrogate, carry | large, carry | large
+        };
+
+        const std::uint8_t cont = too_long | overlong_2 | two_conts;
+        static const std::uint8_t second_high[16] = {
+            too_short, too_short, too_short, too_short, too_short, too_short, too_short,
+            too_short, cont | overlong_3 | too_large_1000 | overlong_4,
+            cont | overlong_3 | too_large, cont | surrogate | too_large,
+            cont | surrogate | too_large, too_short, too_short, too_short, too_short
+        };
+
+        auto table = [](const std::uint8_t* t) {
+            return _mm_loadu_si128(reinterpret_cast<const __m128i*>(t));
+        };
+
+        const __m256i t1 = _mm256_broadcastsi128_si256(table(first_high));
+        const __m256i t2 = _mm256_broadcastsi128_si256(table(first_low));
+        const __m256i t3 = _mm256_broadcastsi128_si256(table(second_high));
+        const __m256i nibble = _mm256_set1_epi8(0x0f);
+        // A block ending with the start of a character that it does not finish
+        const __m256i last = _mm256_setr_epi8(-1, -1, -1, -1, -1, -1, -1, -1,
+            -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+            -1, -1, -1, -1, -1, char(0xf0 - 1), char(0xe0 - 1), char(0xc0 - 1));
+
+        __m256i prev = _mm256_setzero_si256();
+        __m256i error = _mm256_setzero_si256();
+        __m256i incomplete = _mm256_setzero_si256();
+        char tail[32];
+        for (std::size_t i = 0; i < n; i += 32) {
+            const char* b = p + i;
+            if (n - i < 32) {
+                memset(tail, 0, sizeof(tail));
+                memcpy(tail, b, n - i);
+                b = tail;
+            }
+
+            __m256i in = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(b));
+            if (_mm256_movemask_epi8(in) == 0) {
+                error = _mm256_or_si256(error, incomplete);
+                incomplete = _mm256_setzero_si256();
+                prev = in;
+                continue;
+            }
+
+            __m256i before = _mm256_permute2x128_si256(prev, in, 0x21);
+            __m256i prev1 = _mm256_alignr_epi8(in, before, 15);
+            __m256i prev2 = _mm256_alignr_epi8(in, before, 14);
+            __m256i prev3 = _mm256_alignr_epi8(in, before, 13);
+
+            __m256i special = _mm256_and_si256(
+                _mm256_and_si256(
+                    _mm256_shuffle_epi8(t1, _mm256_and_si256(_mm256_srli_epi16(prev1, 4), nibble)),
+                    _mm256_shuffle_epi8(t2, _mm256_and_si256(prev1, nibble))),
+                _mm256_shuffle_epi8(t3, _mm256_and_si256(_mm256_srli_epi16(in, 4), nibble)));
+
+            // Third and fourth bytes of a character must be continuations
+            __m256i must23 = _mm256_or_si256(
+                _mm256_subs_epu8(prev2, _mm256_set1_epi8(char(0xe0 - 0x80))),
+                _mm256_subs_epu8(prev3, _mm256_set1_epi8(char(0xf0 - 0x80))));
+            must23 = _mm256_and_si256(must23, _mm256_set1_epi8(char(0x80)));
+
+            error = _mm256_or_si256(error, _mm256_xor_si256(must23, special));
+            incomplete = _mm256_subs_epu8(in, last);
+            prev = in;
+        }
+
+        error = _mm256_or_si256(error, incomplete);
+        return _mm256_testz_si256(error, error);
+    }
+
+    // Blocks of 32 bytes are packed by groups of 8, with shuffles from a table
+    __attribute__((target("avx2")))
+    std::size_t remove_cr_avx2(char* p, std::size_t n) {
+        const compaction& t = compactions();
+        const __m256i cr = _mm256_set1_epi8('\r');
+        const __m256i lf = _mm256_set1_epi8('\n');
+        std::size_t i = 0, j = 0;
+        for (; i + 33 <= n; i += 32) {
+            __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(p + i));
+            __m256i next = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(p + i + 1));
+            std::uint32_t drop = std::uint32_t(_mm256_movemask_epi8(_mm256_and_si256(
+                _mm256_cmpeq_epi8(v, cr), _mm256_cmpeq_epi8(next, lf))));
+            if (drop == 0) {
+                _mm256_storeu_si256(reinterpret_cast<__m256i*>(p + j), v);
+                j += 32;
+                continue;
+            }
+
+            for (std::size_t g = 0; g < 4; ++g) {
+                __m128i half = g < 2 ? _mm256_castsi256_si128(v) : _mm256_extracti128_si256(v, 1);
+                std::size_t keep = ~(drop >> 8*g) & 0xff;
+                __m128i order = _mm_loadl_epi64(reinterpret_cast<const __m128i*>(t.shuffle[keep]));
+                if (g & 1) order = _mm_add_epi8(order, _mm_set1_epi8(8));
+                // Only 8 bytes are written: the rest of the block is yet to be packed
+                _mm_storel_epi64(reinterpret_cast<__m128i*>(p + j), _mm_shuffle_epi8(half, order));
+                j += t.count[keep];
+            }
+        }
+
+        for (; i < n; ++i) {
+            char c = p[i];
+            p[j] = c;
+            j += !(c == '\r' && i + 1 < n && p[i + 1] == '\n');
+        }
+
+        return j;
+    }
+
+    // ASCII characters are packed 8 or 16 at a time: those of a block that come
+    // before the first other character are kept, and that one is converted alone.
+    // Whole blocks are written: 'out' has room for them.
+    std::size_t from_utf16_sse2(const char* p, std::size_t n, bool big, char* out) {
+        const unsigned char* u = reinterpret_cast<const unsigned char*>(p);
+        const __m128i high = _mm_set1_epi16(short(0xff80));
+        const __m128i zero = _mm_setzero_si128();
+        const std::size_t units = n/2;
+        char* o = out;
+        std::size_t i = 0;
+        while (i + 8 <= units) {
+            __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(u + 2*i));
+            if (big) v = _mm_or_si128(_mm_slli_epi16(v, 8), _mm_srli_epi16(v, 8));
+            unsigned other = ~unsigned(_mm_movemask_epi8(
+                _mm_cmpeq_epi16(_mm_and_si128(v, high), zero))) & 0xffff;
+            _mm_storel_epi64(reinterpret_cast<__m128i*>(o), _mm_packus_epi16(v, v));
+            if (other == 0) {
+                o += 8;
+                i += 8;
+                continue;
+            }
+
+            std::size_t ascii = __builtin_ctz(other)/2;
+            o += ascii;
+            i = put_utf16(u, units, i + ascii, big, o);
+        }
+
+        while (i < units) {
+            i = put_utf16(u, units, i, big, o);
+        }
+
+        return o - out;
+    }
+
+    __attribute__((target("avx2")))
+    std::size_t from_utf16_avx2(const char* p, std::size_t n, bool big, char* out) {
+        const unsigned char* u = reinterpret_cast<const unsigned char*>(p);
+        const __m256i high = _mm256_set1_epi16(short(0xff80));
+        const std::size_t units = n/2;
+        char* o = out;
+        std::size_t i = 0;
+        while (i + 16 <= units) {
+            __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(u + 2*i));
+            if (big) v = _mm256_or_si256(_mm256_slli_epi16(v, 8), _mm256_srli_epi16(v, 8));
+            std::uint32_t other = ~std::uint32_t(_mm256_movemask_epi8(_mm256_cmpeq_epi16(
+                _mm256_and_si256(v, high), _mm256_setzero_si256())));
+            __m128i bytes = _mm_packus_epi16(_mm256_castsi256_si128(v),
+                _mm256_extracti128_si256(v, 1));
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(o), bytes);
+            if (other == 0) {
+                o += 16;
+                i += 16;
+                continue;
+            }
+
+            std::size_t ascii = __builtin_ctz(other)/2;
+            o += ascii;
+            i = put_utf16(u, units, i + ascii, big, o);
+        }
+
+        while (i < units) {
+            i = put_utf16(u, units, i, big, o);
+        }
+
+        return o - out;
+    }
+
+    std::size_t from_cp1252_sse2(const char* p, std::size_t n, char* out) {
+        const unsigned char* u = reinterpret_cast<const unsigned char*>(p);
+        char* o = out;
+        std::size_t i = 0;
+        while (i + 16 <= n) {
+            __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p + i));
+            int other = _mm_movemask_epi8(v);
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(o), v);
+            if (other == 0) {
+                o += 16;
+                i += 16;
+                continue;
+            }
+
+            std::size_t ascii = __builtin_ctz(other);
+            o += ascii;
+            i += ascii;
+            put_cp1252(u[i++], o);
+        }
+
+        for (; i < n; ++i) {
+            put_cp1252(u[i], o);
+        }
+
+        return o - out;
+    }
+
+    __attribute__((target("avx2")))
+    std::size_t from_cp1252_avx2(const char* p, std::size_t n, char* out) {
+        const unsigned char* u = reinterpret_cast<const unsigned char*>(p);
+        char* o = out;
+        std::size_t i = 0;
+        while (i + 32 <= n) {
+            __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(p + i));
+            std::uint32_t other = std::uint32_t(_mm256_movemask_epi8(v));
+            _mm256_storeu_si256(reinterpret_cast<__m256i*>(o), v);
+            if (other == 0) {
+                o += 32;
+                i += 32;
+                continue;
+            }
+
+            std::size_t ascii = __builtin_ctz(other);
+            o += ascii;
+            i += ascii;
+            put_cp1252(u[i++], o);
+        }
+
+        for (; i < n; ++i) {
+            put_cp1252(u[i], o);
+        }
+
+        return o - out;
+    }
+#endif
+
+    bool valid_utf8(const char* p, std::size_t n) {
+        // Chunks start at the start of a character, if they can
+        const unsigned char* u = reinterpret_cast<const unsigned char*>(p);
+        auto start = [&](std::size_t b) {
+            for (std::size_t k = 0; k < 3 && b < n && (u[b] & 0xc0) == 0x80; ++k) ++b;
+            return b;
+        };
+
+        std::atomic<bool> valid(true);
+        parallel::for_chunks(n, std::size_t(1) << 20,
+            [&](std::size_t b, std::size_t e, std::size_t) {
+                b = b == 0 ? 0 : start(b);
+                e = e == n ? n : start(e);
+                if (b >= e) return;
+
+                bool ok = true;
+#if defined(__x86_64__)
+                switch (search::kernel) {
+                    case search::isa::avx2 : ok = valid_utf8_avx2(p + b, e - b); break;
+                    case search::isa::sse2 : ok = valid_utf8_sse2(p + b, e - b); break;
+                    default : ok = valid_utf8_scalar(p + b, e - b); break;
+                }
+#else
+                ok = valid_utf8_scalar(p + b, e - b);
+#endif
+                if (!ok) valid = false;
+            });
+
+        return valid;
+    }
+
+    std::size_t remove_cr(char* p, std::size_t n) {
+#if defined(__x86_64__)
+        switch (search::kernel) {
+            case search::isa::avx2 : return remove_cr_avx2(p, n);
+            default : break;
+        }
+#endif
+        return remove_cr_scalar(p, n);
+    }
+
+    std::size_t from_utf16(const char* p, std::size_t n, bool big, char* out) {
+#if defined(__x86_64__)
+        switch (search::kernel) {
+            case search::isa::avx2 : return from_utf16_avx2(p, n, big, out);
+            case search::isa::sse2 : return from_utf16_sse2(p, n, big, out);
+            default : break;
+        }
+#endif
+        return from_utf16_scalar(p, n, big, out);
+    }
+
+    std::size_t from_cp1252(const char* p, std::size_t n, char* out) {
+#if defined(__x86_64__)
+        switch (search::kernel) {
+            case search::isa::avx2 : return from_cp1252_avx2(p, n, out);
+            case search::isa::sse2 : return from_cp1252_sse2(p, n, out);
+            default : break;
+        }
+#endif
+        return from_cp1252_scalar(p, n, out);
+    }
+}
+
+std::ostream& operator << (std::ostream& o, const text_view& t) {
+    return o.write(t.data, t.size);
+}
+
+namespace format {
+    char* entry(char* out, const ::entry& e) {
+        out = integer(out, e.id);
+        *out++ = '\n';
+        out = time(out, e.start.msec());
+        memcpy(out, " --> ", 5);
+        out = time(out + 5, e.end.msec());
+        *out++ = '\n';
+        if (e.content.size != 0) {
+            memcpy(out, e.content.data, e.content.size);
+            out += e.content.size;
+        }
+        *out++ = '\n';
+        return out;
+    }
+
+}
+
+std::ostream& operator << (std::ostream& o, const entry& e) {
+    std::string buf(format::max_entry_header_size + e.content.size, '\0');
+    return o.write(&buf[0], format::entry(&buf[0], e) - &buf[0]);
+}
+
+namespace hash {
+    std::uint64_t bytes(const char* p, std::size_t n, std::uint64_t seed) {
+        std::uint64_t h = mix(seed ^ (n*0x9e3779b97f4a7c15ull));
+        for (; n >= 8; p += 8, n -= 8) {
+            std::uint64_t v;
+            memcpy(&v, p, 8);
+            h = (h ^ mix(v))*0x9e3779b97f4a7c15ull;
+            h ^= h >> 29;
+        }
+
+        std::uint64_t v = 0;
+        memcpy(&v, p, n);
+        return mix(h ^ mix(v ^ n));
+    }
+
+    std::uint64_t large(const char* p, std::size_t n) {
+        const std::uint64_t k = 0x9e3779b97f4a7c15ull;
+        std::uint64_t h0 = mix(n*k), h1 = mix(h0), h2 = mix(h1), h3 = mix(h2);
+        auto step = [k](std::uint64_t h, const char* q) {
+            std::uint64_t v;
+            memcpy(&v, q, 8);
+            h = (h ^ mix(v))*k;
+            return h ^ (h >> 29);
+        };
+
+        for (; n >= 32; p += 32, n -= 32) {
+            h0 = step(h0, p);
+            h1 = step(h1, p + 8);
+            h2 = step(h2, p + 16);
+            h3 = step(h3, p + 24);
+        }
+
+        return mix(bytes(p, n, h0) ^ mix(h1 ^ mix(h2 ^ mix(h3))));
+    }
+
+}
+
+mapped_file::~mapped_file() {
+    close();
+}
+
+bool mapped_file::open(const std::string& file_name) {
+    close();
+
+    int fd = ::open(file_name.c_str(), O_RDONLY);
+    if (fd < 0) return false;
+
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        ::close(fd);
+        return false;
+    }
+
+    state_ = file_state(st);
+    size_ = st.st_size;
+    if (size_ != 0) {
+        void* p = mmap(nullptr, size_, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (p == MAP_FAILED) {
+            ::close(fd);
+            size_ = 0;
+            return false;
+        }
+
+        data_ = static_cast<const char*>(p);
+        madvise(p, size_, MADV_SEQUENTIAL);
+    }
+
+    ::close(fd);
+    return true;
+}
+
+void mapped_file::close() {
+    if (data_) {
+        munmap(const_cast<char*>(data_), size_);
+    }
+
+    data_ = nullptr;
+    size_ = 0;
+}
+
+bool text_buffer::open(const std::string& file_name) {
+    copy_.reset();
+    spill_.clear();
+    size_ = 0;
+    data_ = nullptr;
+    std::shared_ptr<mapped_file> file = std::make_shared<mapped_file>();
+    if (!file->open(file_name)) {
+        file_.reset();
+        return false;
+    }
+
+    file_ = file;
+    state_ = file_->state();
+    size_ = file_->size();
+    data_ = file_->data();
+
+    // Only UTF-8 text with '\n' line ends is used straight from the file
+    format_ = encoding::detect(data_, size_);
+    if (format_.converted) {
+        std::string s;
+        encoding::decode(format_, data_, size_, s);
+        copy_ = std::make_shared<const std::string>(std::move(s));
+        file_.reset();
+        size_ = copy_->size();
+        data_ = copy_->data();
+    }
+
+    return true;
+}
+
+std::uint64_t text_buffer::store(const std::string& s) {
+    std::uint64_t offset = size_ + spill_.size();
+    std::vector<char>& v = spill_.own();
+    v.insert(v.end(), s.begin(), s.end());
+    return offset;
+}
+
+void text_buffer::assign(std::string s) {
+    file_.reset();
+    format_ = encoding::text_format();
+    copy_ = std::make_shared<const std::string>(std::move(s));
+    spill_.clear();
+    size_ = copy_->size();
+    data_ = copy_->data();
+}
+
+void text_buffer::detach() {
+    if (!file_) return;
+
+    copy_ = std::make_shared<const std::string>(file_->data(), file_->size());
+    file_.reset();
+    data_ = copy_->data();
+}
+
+namespace parser {
+    const char* skip_blanks(const char* b, const char* e) {
+        while (b != e && (*b == ' ' || *b == '\t')) ++b;
+        return b;
+    }
+
+    const char* skip_blanks_back(const char* b, const char* e) {
+        while (e != b && (*(e-1) == ' ' || *(e-1) == '\t')) --e;
+        return e;
+    }
+
+    bool blank(const char* b, const char* e) {
+        for (; b != e; ++b) {
+            if (*b != ' ' && *b != '\t' && *b != '\r') return false;
+        }
+
+        return true;
+    }
+
+    bool parse_id(const char* b, const char* e, std::size_t& id) {
+        while (b != e && isspace(static_cast<unsigned char>(*b))) ++b;
+        if (b != e && *b == '+') ++b;
+        if (b == e || *b < '0' || *b > '9') return false;
+
+        std::size_t v = 0;
+        for (; b != e && *b >= '0' && *b <= '9'; ++b) {
+            std::size_t d = *b - '0';
+            if (v > (std::size_t(-1) - d)/10) return false;
+            v = v*10 + d;
+        }
+
+        id = v;
+        return true;
+    }
+
+    const char* find(const char* b, const char* e, const char* str, std::size_t n) {
+        while (std::size_t(e - b) >= n) {
+            b = static_cast<const char*>(memchr(b, str[0], (e - b) - n + 1));
+            if (!b) return nullptr;
+            if (memcmp(b, str, n) == 0) return b;
+            ++b;
+        }
+
+        return nullptr;
+    }
+
+}
+
+bool read_entries(text_buffer& buffer, entry_columns& entries, std::size_t first_line) {
+    return parse_entries(buffer.data(), 0, buffer.size(), first_line, entries,
+        [&](const std::string& s) {
+            return buffer.store(s);
+        });
+}
+
+namespace parser {
+    std::size_t next_entry(const char* data, std::size_t size, std::size_t from) {
+        if (from == 0) return 0;
+
+        const char* p = data + from - 1;
+        const char* e = data + size;
+        while (p != e) {
+            p = static_cast<const char*>(memchr(p, '\n', e - p));
+            if (!p || p + 1 == e) break;
+            if (p[1] == '\n') return p + 2 - data;
+            ++p;
+        }
+
+        return size;
+    }
+
+}
+
+bool read_entries(text_buffer& buffer, entry_columns& entries, std::size_t first_line,
+    std::size_t threads) {
+
+    const std::size_t min_piece_size = 1 << 20;
+    std::size_t size = buffer.size();
+    std::size_t npiece = std::min(4*threads, size/min_piece_size);
+    if (threads <= 1 || npiece <= 1) {
+        return read_entries(buffer, entries, first_line);
+    }
+
+    std::vector<std::size_t> bounds(npiece + 1, size);
+    bounds[0] = 0;
+    for (std::size_t c = 1; c < npiece; ++c) {
+        bounds[c] = parser::next_entry(buffer.data(), size,
+            std::max(bounds[c-1], std::size_t(size*c/npiece)));
+    }
+
+    // Copied text is kept by each piece, and moved to the buffer afterwards
+    struct piece {
+        entry_columns entries;
+        std::string spill;
+        bool ok = false;
+    };
+
+    std::vector<piece> pieces(npiece);
+    parallel::for_each_task(npiece, threads, [&](std::size_t c, std::size_t) {
+        // Messages are shown below, once it is known which error comes first
+        std::ostringstream log;
+        std::ostream* old = output;
+        output = &log;
+        piece& pc = pieces[c];
+        pc.ok = parse_entries(buffer.data(), bounds[c], bounds[c+1], 0, pc.entries,
+            [&](const std::string& s) {
+                std::uint64_t offset = size + pc.spill.size();
+                pc.spill += s;
+                return offset;
+            });
+        output = old;
+    });
+
+    for (std::size_t c = 0; c < npiece; ++c) {
+        if (!pieces[c].ok) {
+            // Parse again to report the error with the right line number
+            std::size_t line = first_line +
+                std::count(buffer.data(), buffer.data() + bounds[c], '\n');
+            entry_columns dummy;
+            std::string spill;
+            return parse_entries(buffer.data(), bounds[c], bounds[c+1], line, dummy,
+                [&](const std::string& s) {
+                    spill += s;
+                    return std::uint64_t(0);
+                });
+        }
+    }
+
+    std::size_t total = 0;
+    for (auto& pc : pieces) {
+        total += pc.entries.size();
+    }
+
+    entries.ids.reserve(entries.ids.size() + total);
+    entries.starts.reserve(entries.starts.size() + total);
+    entries.ends.reserve(entries.ends.size() + total);
+    entries.text_offsets.reserve(entries.text_offsets.size() + total);
+    entries.text_sizes.reserve(entries.text_sizes.size() + total);
+    entries.positions.reserve(entries.positions.size() + total);
+
+    for (auto& pc : pieces) {
+        entry_columns& e = pc.entries;
+        std::uint64_t base = buffer.store(pc.spill) - size;
+        for (auto& offset : e.text_offsets.own()) {
+            if (offset >= size) offset += base;
+        }
+
+        entries.ids.append(e.ids);
+        entries.starts.append(e.starts);
+        entries.ends.append(e.ends);
+        entries.text_offsets.append(e.text_offsets);
+        entries.text_sizes.append(e.text_sizes);
+        entries.positions.append(e.positions);
+        e = entry_columns();
+    }
+
+    return true;
+}
+
+void write_entries(const track_snapshot& track, std::string& out, std::size_t from,
+    std::uint64_t base, std::vector<std::uint64_t>* positions) {
+
+    std::size_t max_size = 0;
+    for (std::size_t i = from; i < track.size(); ++i) {
+        max_size += format::max_entry_header_size + track.entries.text_sizes[i];
+    }
+
+    if (positions) {
+        positions->clear();
+        positions->reserve(track.size() - from);
+    }
+
+    out.resize(max_size);
+    char* begin = &out[0];
+    char* p = begin;
+    track.for_each(from, [&](const entry& e) {
+        if (positions) positions->push_back(base + (p - begin));
+        p = format::entry(p, e);
+    });
+
+    out.resize(p - begin);
+}
+
+void time_index::build(const column<std::int64_t>& starts, const column<std::int64_t>& ends) {
+    segments_.clear();
+    max_duration_ = 0;
+    sorted_ = true;
+    for (std::size_t i = 0; i < starts.size(); ++i) {
+        max_duration_ = std::max(max_duration_, ends[i] - starts[i]);
+    }
+
+    if (starts.empty()) return;
+
+    segment seg;
+    seg.begin = 0;
+    seg.end = starts.size();
+    seg.sorted = std::is_sorted(starts.begin(), starts.end());
+    sorted_ = seg.sorted;
+
+    if (!seg.sorted) {
+        seg.order.resize(starts.size());
+        for (std::size_t i = 0; i < starts.size(); ++i) {
+            seg.order[i] = i;
+        }
+
+        std::stable_sort(seg.order.begin(), seg.order.end(),
+            [&](std::size_t i1, std::size_t i2) {
+                return starts[i1] < starts[i2];
+            });
+    }
+
+    segments_.push_back(std::move(seg));
+}
+
+void time_index::split(std::size_t i) {
+    auto iter = std::upper_bound(segments_.begin(), segments_.end(), i,
+        [](std::size_t p, const segment& seg) {
+            return p < seg.begin;
+        });
+
+    if (iter == segments_.begin()) return;
+    --iter;
+    if (iter->begin == i || i >= iter->end) return;
+
+    segment right;
+    right.begin = i;
+    right.end = iter->end;
+    right.sorted = iter->sorted;
+    iter->end = i;
+
+    if (!iter->sorted) {
+        std::vector<std::size_t> left;
+        left.reserve(i - iter->begin);
+        right.order.reserve(right.end - i);
+        for (auto k : iter->order) {
+            (k < i ? left : right.order).push_back(k);
+        }
+
+        iter->order.swap(left);
+    }
+
+    segments_.insert(iter + 1, std::move(right));
+}
+
+std::size_t time_index::lower_bound(const column<std::int64_t>& starts, const offset_tree& offsets,
+    const time_key& t) const {
+
+    std::size_t best = starts.size();
+    std::int64_t best_start = 0;
+    for (auto& seg : segments_) {
+        std::int64_t offset = offsets.at(seg.begin);
+        std::int64_t tt = t.msec() - offset;
+        std::size_t k = seg.sorted ?
+            first_(seg, [&](std::size_t j) { return starts[j] < tt; }) :
+            first_(seg, [&](std::size_t j) { return starts[seg.order[j - seg.begin]] < tt; });
+
+        if (k == seg.end) continue;
+
+        std::size_t i = seg.sorted ? k : seg.order[k - seg.begin];
+        std::int64_t start = starts[i] + offset;
+        if (best == starts.size() || start < best_start ||
+            (start == best_start && i < best)) {
+            best = i;
+            best_start = start;
+        }
+    }
+
+    return best;
+}
+
+void time_index::active(const column<std::int64_t>& starts, const column<std::int64_t>& ends,
+    const offset_tree& offsets, const time_key& t, std::vector<std::size_t>& out) const {
+
+    out.clear();
+    for (auto& seg : segments_) {
+        std::int64_t offset = offsets.at(seg.begin);
+        std::int64_t tt = t.msec() - offset;
+        std::int64_t earliest = tt - max_duration_;
+
+        // Only entries that started less than the longest duration ago can
+        // still be on screen
+        auto at = [&](std::size_t j) {
+            return seg.sorted ? j : seg.order[j - seg.begin];
+        };
+
+        std::size_t k = first_(seg, [&](std::size_t j) {
+            return starts[at(j)] < earliest;
+        });
+
+        for (; k < seg.end; ++k) {
+            std::size_t i = at(k);
+            if (starts[i] > tt) break;
+            if (ends[i] > tt) out.push_back(i);
+        }
+    }
+
+    std::sort(out.begin(), out.end(), [&](std::size_t i1, std::size_t i2) {
+        std::int64_t s1 = starts[i1] + offsets.at(i1);
+        std::int64_t s2 = starts[i2] + offsets.at(i2);
+        return s1 < s2 || (s1 == s2 && i1 < i2);
+    });
+}
+
+void text_index::clear() {
+    lists_.clear();
+    built_ = false;
+}
+
+void text_index::insert(std::size_t i, const text_view& content) {
+    for_each_trigram_(content, [&](std::uint32_t key) {
+        auto& list = lists_[key];
+        auto iter = std::lower_bound(list.begin(), list.end(), i);
+        if (iter == list.end() || *iter != i) {
+            list.insert(iter, i);
+        }
+    });
+}
+
+void text_index::remove(std::size_t i, const text_view& content) {
+    for_each_trigram_(content, [&](std::uint32_t key) {
+        auto found = lists_.find(key);
+        if (found == lists_.end()) return;
+
+        auto& list = found->second;
+        auto iter = std::lower_bound(list.begin(), list.end(), i);
+        if (iter != list.end() && *iter == i) {
+            list.erase(iter);
+        }
+    });
+}
+
+void text_index::intersect_(std::vector<std::uint32_t>& a, const std::vector<std::uint32_t>& b) {
+    auto bi = b.begin();
+    std::size_t n = 0;
+    for (auto v : a) {
+        bi = std::lower_bound(bi, b.end(), v);
+        if (bi == b.end()) break;
+        if (*bi == v) a[n++] = v;
+    }
+
+    a.resize(n);
+}
+
+void subtitle_track::assign(entry_columns entries) {
+    entries_ = std::move(entries);
+
+    // IDs are most often just the entry number: no need to store them then
+    bool numbered = true;
+    for (std::size_t i = 0; i < entries_.ids.size() && numbered; ++i) {
+        numbered = entries_.ids[i] == i + 1;
+    }
+
+    if (numbered) {
+        entries_.ids.clear();
+    }
+
+    entries_.shrink_to_fit();
+    offsets_.resize(entries_.size());
+    index_.build(entries_.starts, entries_.ends);
+    text_index_.clear();
+    dirty_from_ = entries_.size();
+}
+
+void subtitle_track::shift(std::size_t i, std::int64_t msec) {
+    if (i >= size()) return;
+
+    stats::timer t(stats::phase::edit);
+    stats::add(stats::counter::entries_shifted, size() - std::min(i, size()));
+    offsets_.add_from(i, msec);
+    index_.split(i);
+    dirty_from_ = std::min(dirty_from_, i);
+}
+
+void subtitle_track::retime(std::size_t i, const linear::transform& tr) {
+    if (i == size()) return;
+
+    stats::timer t(stats::phase::edit);
+    stats::add(stats::counter::entries_shifted, size() - i);
+    // Resolve the pending shifts first: they do not commute with scaling
+    resolve_offsets_();
+    linear::apply(tr, &entries_.starts.own()[i], size() - i);
+    linear::apply(tr, &entries_.ends.own()[i], size() - i);
+    index_.build(entries_.starts, entries_.ends);
+    dirty_from_ = std::min(dirty_from_, i);
+}
+
+void subtitle_track::reorder(const std::vector<std::size_t>& order, column<std::size_t> ids) {
+    stats::timer t(stats::phase::edit);
+    stats::add(stats::counter::entries_shifted, size());
+    resolve_offsets_();
+    permute_(entries_.starts, order);
+    permute_(entries_.ends, order);
+    permute_(entries_.text_offsets, order);
+    permute_(entries_.text_sizes, order);
+    permute_(entries_.positions, order);
+    entries_.ids = std::move(ids);
+    index_.build(entries_.starts, entries_.ends);
+    text_index_.clear();
+    dirty_from_ = 0;
+}
+
+subtitle_track::saved_times subtitle_track::times() const {
+    saved_times t;
+    t.starts = entries_.starts;
+    t.ends = entries_.ends;
+    t.shifts = offsets_.log();
+    return t;
+}
+
+void subtitle_track::restore(const saved_times& t, std::size_t i) {
+    stats::timer st(stats::phase::edit);
+    stats::add(stats::counter::entries_shifted, size() - std::min(i, size()));
+    entries_.starts = t.starts;
+    entries_.ends = t.ends;
+    offsets_.resize(size());
+    index_.build(entries_.starts, entries_.ends);
+    for (auto& s : t.shifts) {
+        offsets_.add_from(s.from, s.msec);
+        index_.split(s.from);
+    }
+
+    dirty_from_ = std::min(dirty_from_, i);
+}
+
+void subtitle_track::index_text() {
+    if (!text_index_.built()) {
+        text_index_.build(size(), [this](std::size_t i) { return content(i); });
+    }
+}
+
+void subtitle_track::find_fuzzy(const std::string& str, std::size_t max, bool fold,
+    std::vector<std::size_t>& found, std::vector<std::size_t>& distances) {
+
+    found.clear();
+    distances.clear();
+
+    // With at most 'max' edits, one of 'max+1' pieces of the pattern must be
+    // found exactly: use exact searches to pick the candidates, if the
+    // pieces are long enough for that to be selective.
+    std::vector<std::size_t> candidates;
+    bool filtered = str.size()/(max + 1) >= 3;
+    if (filtered) {
+        std::vector<std::size_t> piece_found, merged;
+        // Pieces must not start in the middle of a UTF-8 character, so that
+        // case folding sees them as in the text
+        auto cut = [&](std::size_t k) {
+            std::size_t b = str.size()*k/(max + 1);
+            while (b < str.size() && (static_cast<unsigned char>(str[b]) & 0xc0) == 0x80) ++b;
+            return b;
+        };
+
+        for (std::size_t k = 0; k <= max; ++k) {
+            std::size_t b = cut(k);
+            std::size_t e = cut(k + 1);
+            if (e - b < 3) {
+                candidates.clear();
+                filtered = false;
+                break;
+            }
+
+            find_text(str.substr(b, e - b), fold, piece_found);
+            merged.clear();
+            std::set_union(candidates.begin(), candidates.end(),
+                piece_found.begin(), piece_found.end(), std::back_inserter(merged));
+            candidates.swap(merged);
+        }
+    }
+
+    std::size_t n = filtered ? candidates.size() : size();
+    stats::add(stats::counter::search_comparisons, n);
+    fuzzy::pattern pat(str, fold);
+    std::vector<std::vector<std::pair<std::size_t, std::size_t>>> results(
+        parallel::thread_count());
+
+    parallel::for_chunks(n, 1024, [&](std::size_t b, std::size_t e, std::size_t c) {
+        for (std::size_t k = b; k < e; ++k) {
+            std::size_t i = filtered ? candidates[k] : k;
+            text_view t = content(i);
+            std::size_t d = fuzzy::distance(pat, t.data, t.size, max);
+            if (d <= max) {
+                results[c].push_back(std::make_pair(d, i));
+            }
+        }
+    });
+
+    std::vector<std::pair<std::size_t, std::size_t>> all;
+    for (auto& r : results) {
+        all.insert(all.end(), r.begin(), r.end());
+    }
+
+    std::sort(all.begin(), all.end());
+    for (auto& r : all) {
+        distances.push_back(r.first);
+        found.push_back(r.second);
+    }
+}
+
+void subtitle_track::find_active(const time_key& t, std::vector<std::size_t>& found) const {
+    index_.active(entries_.starts, entries_.ends, offsets_, t, found);
+}
+
+void subtitle_track::find_text(const std::string& str, bool fold, std::vector<std::size_t>& found) {
+    auto get_content = [this](std::size_t i) {
+        return content(i);
+    };
+
+    if (!fold && str.size() >= 3) {
+        if (!text_index_.built()) {
+            text_index_.build(size(), get_content);
+        }
+
+        text_index_.find(size(), get_content, str, found);
+        return;
+    }
+
+    found.clear();
+    search::pattern pat(str, fold);
+    std::vector<std::size_t> hits;
+    search::find_all(text_.data(), text_.size(), pat, hits);
+    stats::add(stats::counter::search_comparisons, size());
+
+    // Hits are sorted, and so is the text of the entries in the buffer, unless
+    // they were reordered: then look for the first hit again
+    std::size_t h = 0;
+    std::uint64_t last = 0;
+    for (std::size_t i = 0; i < size(); ++i) {
+        std::uint64_t tb = entries_.text_offsets[i];
+        std::size_t ts = entries_.text_sizes[i];
+        if (tb >= text_.size()) {
+            if (content(i).find(pat) != std::string::npos) {
+                found.push_back(i);
+            }
+
+            continue;
+        }
+
+        if (tb < last) {
+            h = std::lower_bound(hits.begin(), hits.end(), tb) - hits.begin();
+        }
+
+        last = tb;
+        while (h < hits.size() && hits[h] < tb) ++h;
+        if (h < hits.size() && hits[h] + pat.size() <= tb + ts) {
+            found.push_back(i);
+        }
+    }
+}
+
+void subtitle_track::detach() {
+    text_.detach();
+}
+
+track_snapshot subtitle_track::snapshot() {
+    track_snapshot s;
+    s.text = text_;
+    s.entries = entries_;
+    s.shifts = offsets_.log();
+    s.from = dirty_from_;
+    dirty_from_ = entries_.size();
+    return s;
+}
+
+void subtitle_track::resolve_offsets_() {
+    if (!offsets_.pending()) return;
+
+    std::vector<std::int64_t>& starts = entries_.starts.own();
+    std::vector<std::int64_t>& ends = entries_.ends.own();
+    std::int64_t offset = 0;
+    for (std::size_t k = 0; k < size(); ++k) {
+        offset += offsets_.delta(k);
+        starts[k] += offset;
+        ends[k] += offset;
+    }
+
+    offsets_.resize(size());
+}
+
+namespace check {
+    namespace {
+        // Times of all entries, with the pending shifts applied
+        void read_times(const subtitle_track& t, std::vector<std::int64_t>& starts,
+            std::vector<std::int64_t>& ends) {
+
+            starts.resize(t.size());
+            ends.resize(t.size());
+            parallel::for_chunks(t.size(), 16384, [&](std::size_t b, std::size_t e, std::size_t) {
+                for (std::size_t i = b; i < e; ++i) {
+                    starts[i] = t.start(i) - time_key(0);
+                    ends[i] = t.end(i) - time_key(0);
+                }
+            });
+        }
+
+        // Sort chunks in parallel, then merge them
+        template<typename T, typename L>
+        void sort(std::vector<T>& v, L less) {
+            const std::size_t n = v.size();
+            std::size_t nchunk = parallel::for_chunks(n, 65536,
+                [&](std::size_t b, std::size_t e, std::size_t) {
+                    std::sort(v.begin() + b, v.begin() + e, less);
+                });
+
+            auto bound = [&](std::size_t c) {
+                return v.begin() + n*std::min(c, nchunk)/nchunk;
+            };
+
+            for (std::size_t w = 1; w < nchunk; w *= 2) {
+                for (std::size_t c = 0; c + w < nchunk; c += 2*w) {
+                    std::inplace_merge(bound(c), bound(c + w), bound(c + 2*w), less);
+                }
+            }
+        }
+
+        const char* names[] = {
+            "ending before they start", "out of order", "overlapping", "with a duplicate ID",
+            "after missing IDs", "too short", "too long"
+        };
+    }
+
+    void run(const subtitle_track& t, const options& o, report& r) {
+        r = report();
+        const std::size_t n = t.size();
+        std::vector<std::int64_t> starts, ends;
+        read_times(t, starts, ends);
+
+        // Entry that ends last in each chunk, to carry the sweep across chunks
+        struct latest {
+            std::int64_t end;
+            std::size_t entry;
+        };
+
+        const latest none = {std::numeric_limits<std::int64_t>::min(), n};
+        const std::size_t min_size = 16384;
+        std::vector<latest> chunk_latest(parallel::thread_count(), none);
+        parallel::for_chunks(n, min_size, [&](std::size_t b, std::size_t e, std::size_t c) {
+            latest l = none;
+            for (std::size_t i = b; i < e; ++i) {
+                if (ends[i] > l.end) l = latest{ends[i], i};
+            }
+
+            chunk_latest[c] = l;
+        });
+
+        std::vector<std::vector<issue>> found(parallel::thread_count() + 1);
+        parallel::for_chunks(n, min_size, [&](std::size_t b, std::size_t e, std::size_t c) {
+            latest l = none;
+            for (std::size_t k = 0; k < c; ++k) {
+                if (chunk_latest[k].end > l.end) l = chunk_latest[k];
+            }
+
+            for (std::size_t i = b; i < e; ++i) {
+                std::int64_t d = ends[i] - starts[i];
+                if (d < 0) {
+                    found[c].push_back(issue{problem::reversed, i, i});
+                } else if (d < o.min_duration) {
+                    found[c].push_back(issue{problem::too_short, i, i});
+                } else if (d > o.max_duration) {
+                    found[c].push_back(issue{problem::too_long, i, i});
+                }
+
+                // An entry out of order is not also reported as overlapping
+                if (i != 0 && starts[i] < starts[i - 1]) {
+                    found[c].push_back(issue{problem::unordered, i, i - 1});
+                } else if (starts[i] < l.end) {
+                    found[c].push_back(issue{problem::overlap, i, l.entry});
+                }
+
+                if (ends[i] > l.end) l = latest{ends[i], i};
+            }
+        });
+
+        // IDs that are not just the entry number: look for repeated and missing ones
+        const column<std::size_t>& ids = t.columns().ids;
+        if (!ids.empty()) {
+            std::vector<std::pair<std::size_t, std::size_t>> sorted(n);
+            for (std::size_t i = 0; i < n; ++i) {
+                sorted[i] = std::make_pair(ids[i], i);
+            }
+
+            sort(sorted, std::less<std::pair<std::size_t, std::size_t>>());
+
+            std::vector<issue>& id_issues = found.back();
+            std::size_t first = 0;
+            for (std::size_t k = 0; k < n; ++k) {
+                std::size_t prev = k == 0 ? 0 : sorted[k - 1].first;
+                if (k != 0 && sorted[k].first == prev) {
+                    id_issues.push_back(issue{problem::duplicate_id, sorted[k].second, first});
+                    continue;
+                }
+
+                first = sorted[k].second;
+                if (sorted[k].first > prev + 1) {
+                    id_issues.push_back(issue{problem::missing_id, sorted[k].second,
+                        sorted[k].first - prev - 1});
+                }
+            }
+        }
+
+        for (auto& f : found) {
+            r.issues.insert(r.issues.end(), f.begin(), f.end());
+        }
+
+        std::sort(r.issues.begin(), r.issues.end(), [](const issue& a, const issue& b) {
+            return a.entry != b.entry ? a.entry < b.entry : a.what < b.what;
+        });
+
+        for (auto& i : r.issues) {
+            ++r.counts[std::size_t(i.what)];
+        }
+    }
+
+    std::vector<std::size_t> sorted_order(const subtitle_track& t) {
+        std::vector<std::int64_t> starts, ends;
+        read_times(t, starts, ends);
+
+        std::vector<std::size_t> order(t.size());
+        for (std::size_t i = 0; i < order.size(); ++i) {
+            order[i] = i;
+        }
+
+        sort(order, [&](std::size_t a, std::size_t b) {
+            return starts[a] != starts[b] ? starts[a] < starts[b] : a < b;
+        });
+
+        return order;
+    }
+
+    void print(const subtitle_track& t, const report& r, std::size_t max) {
+        auto name = [&](std::size_t i) {
+            return "["+std::to_string(i)+"] (ID "+std::to_string(t.id(i))+")";
+        };
+
+        for (std::size_t k = 0; k < std::min(max, r.issues.size()); ++k) {
+            const issue& is = r.issues[k];
+            std::size_t i = is.entry;
+            if (is.what == problem::reversed) {
+                warning(name(i), " ends before it starts (", t.start(i), " --> ", t.end(i), ")");
+            } else if (is.what == problem::too_short || is.what == problem::too_long) {
+                warning(name(i), " lasts ", string::seconds(t.end(i) - t.start(i)), " seconds");
+            } else if (is.what == problem::unordered) {
+                warning(name(i), " starts before ", name(is.other), " (", t.start(i), " < ",
+                    t.start(is.other), ")");
+            } else if (is.what == problem::overlap) {
+                warning(name(i), " starts ", string::seconds(t.end(is.other) - t.start(i)),
+                    " seconds before ", name(is.other), " ends");
+            } else if (is.what == problem::duplicate_id) {
+                warning(name(i), " has the same ID as [", is.other, "]");
+            } else if (is.other == 1) {
+                warning("ID ", t.id(i) - 1, " is missing before ", name(i));
+            } else {
+                warning("IDs ", t.id(i) - is.other, " to ", t.id(i) - 1, " are missing before ",
+                    name(i));
+            }
+        }
+
+        if (r.issues.size() > max) {
+            note("... and ", r.issues.size() - max, " more");
+        }
+
+        std::string summary;
+        for (std::size_t p = 0; p < std::size_t(problem::count); ++p) {
+            if (r.counts[p] == 0) continue;
+            summary += (summary.empty() ? "" : ", ") + std::to_string(r.counts[p]) + " " +
+                names[p];
+        }
+
+        note("found ", r.issues.size(), " issues in ", t.size(), " entries: ", summary);
+    }
+}
+
+namespace file {
+    bool write_all(int fd, const char* p, std::size_t n, std::uint64_t pos) {
+        while (n != 0) {
+            ssize_t w = ::pwrite(fd, p, n, pos);
+            if (w < 0) {
+                if (errno == EINTR) continue;
+                return false;
+            }
+
+            p += w;
+            n -= w;
+            pos += w;
+        }
+
+        return true;
+    }
+
+    bool write_all(int fd, const char* p, std::size_t n) {
+        while (n != 0) {
+            ssize_t w = ::write(fd, p, n);
+            if (w < 0) {
+                if (errno == EINTR) continue;
+                return false;
+            }
+
+            p += w;
+            n -= w;
+        }
+
+        return true;
+    }
+
+    ssize_t read_some(int fd, char* p, std::size_t n) {
+        while (true) {
+            ssize_t r = ::read(fd, p, n);
+            if (r >= 0 || errno != EINTR) return r;
+        }
+    }
+
+    bool read_all(int fd, char* p, std::size_t n, std::uint64_t pos) {
+        while (n != 0) {
+            ssize_t r = ::pread(fd, p, n, pos);
+            if (r < 0) {
+                if (errno == EINTR) continue;
+                return false;
+            } else if (r == 0) {
+                return false;
+            }
+
+            p += r;
+            n -= r;
+            pos += r;
+        }
+
+        return true;
+    }
+
+    std::string system_error(const std::string& what, const std::string& file_name) {
+        return what+": "+file_name+" ("+strerror(errno)+")";
+    }
+
+    bool replace(const std::string& file_name, const std::string& data, std::string& err) {
+        return replace(file_name, data, err, [](const file_state&) {});
+    }
+
+    std::string pending_name(const std::string& file_name) {
+        return file_name + ".subedit-pending";
+    }
+
+    bool recover(const std::string& file_name, bool& recovered, std::string& err) {
+        recovered = false;
+
+        std::string pending = pending_name(file_name);
+        int pfd = ::open(pending.c_str(), O_RDONLY);
+        if (pfd < 0) return true;
+
+        pending_header h;
+        std::string data;
+        bool complete = read_all(pfd, reinterpret_cast<char*>(&h), sizeof(h), 0) &&
+            memcmp(h.magic, pending_magic, sizeof(h.magic)) == 0;
+        if (complete) {
+            data.resize(h.size);
+            complete = read_all(pfd, &data[0], data.size(), sizeof(h)) &&
+                hash::bytes(data.data(), data.size()) == h.hash;
+        }
+
+        ::close(pfd);
+
+        if (complete) {
+            // The file itself may be half written: finish the job
+            int fd = ::open(file_name.c_str(), O_WRONLY);
+            if (fd < 0 || !write_all(fd, data.data(), data.size(), h.position) ||
+                ::ftruncate(fd, h.position + data.size()) != 0 || ::fdatasync(fd) != 0) {
+                err = system_error("cannot recover interrupted save of", file_name);
+                if (fd >= 0) ::close(fd);
+                return false;
+            }
+
+            ::close(fd);
+            recovered = true;
+        }
+
+        // An incomplete record means the file itself was never touched
+        ::unlink(pending.c_str());
+        return true;
+    }
+
+}
+
+edit_journal::~edit_journal() {
+    if (fd_ >= 0) ::close(fd_);
+}
+
+bool edit_journal::read(std::vector<std::string>& lines, std::vector<file_state>& saved) const {
+    std::ifstream in(journal_name_, std::ios::binary);
+    if (!in.is_open()) return false;
+
+    std::string all((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+    std::size_t b = all.find('\n');
+    if (b == std::string::npos || all.compare(0, b, magic_) != 0) return false;
+
+    // A last line without its end was being written when the program stopped
+    lines.clear();
+    saved.clear();
+    for (std::size_t e; (e = all.find('\n', ++b)) != std::string::npos; b = e) {
+        std::string line = all.substr(b, e - b);
+        if (line.compare(0, 6, "saved ") != 0) {
+            lines.push_back(line);
+            continue;
+        }
+
+        std::istringstream ss(line.substr(6));
+        file_state state;
+        long long size = 0, mtime = 0;
+        ss >> size >> mtime >> state.mtime_ns >> state.device >> state.inode;
+        state.size = size;
+        state.mtime = mtime;
+        saved.push_back(state);
+    }
+
+    return true;
+}
+
+bool edit_journal::start(const text_buffer& text, std::string& err) {
+    ::unlink(base_name_.c_str());
+    file_state base;
+    if (::link(loaded_name_.c_str(), base_name_.c_str()) != 0) {
+        err = file::system_error("cannot create link", base_name_);
+        return false;
+    } else if (!base.read(base_name_) || base.device != text.state().device ||
+        base.inode != text.state().inode) {
+        err = loaded_name_+" was replaced since it was loaded";
+        ::unlink(base_name_.c_str());
+        return false;
+    }
+
+    fd_ = ::open(journal_name_.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_APPEND, 0600);
+    if (fd_ < 0) {
+        err = file::system_error("cannot create file", journal_name_);
+        ::unlink(base_name_.c_str());
+        return false;
+    }
+
+    file_state disk;
+    disk.read(file_name_);
+    write_(std::string(magic_) + "\n");
+    saved(disk);
+    return true;
+}
+
+bool edit_journal::resume(std::string& err) {
+    fd_ = ::open(journal_name_.c_str(), O_WRONLY | O_APPEND);
+    if (fd_ < 0) {
+        err = file::system_error("cannot open file", journal_name_);
+        return false;
+    }
+
+    return true;
+}
+
+void edit_journal::record(const edit& e) {
+    char line[128];
+    const char* joined = e.joined ? " joined" : "";
+    if (e.kind == edit::shift) {
+        snprintf(line, sizeof(line), "shift %zu %lld%s\n", e.from, (long long)e.msec,
+            joined);
+    } else if (e.kind == edit::reorder) {
+        snprintf(line, sizeof(line), "sort%s\n", joined);
+    } else {
+        snprintf(line, sizeof(line), "retime %zu %.17g %.17g%s\n", e.from, e.tr.factor,
+            e.tr.offset, joined);
+    }
+
+    write_(line);
+}
+
+void edit_journal::undone() {
+    write_("undo\n");
+}
+
+void edit_journal::redone() {
+    write_("redo\n");
+}
+
+void edit_journal::saved(const file_state& state) {
+    char line[160];
+    snprintf(line, sizeof(line), "saved %lld %lld %ld %llu %llu\n", (long long)state.size,
+        (long long)state.mtime, state.mtime_ns, (unsigned long long)state.device,
+        (unsigned long long)state.inode);
+    write_(line);
+}
+
+void edit_journal::close(bool saved) {
+    if (fd_ < 0) return;
+
+    ::close(fd_);
+    fd_ = -1;
+    if (saved) {
+        ::unlink(journal_name_.c_str());
+        ::unlink(base_name_.c_str());
+    }
+}
+
+void edit_journal::write_(const std::string& line) {
+    if (fd_ >= 0) file::write_all(fd_, line.data(), line.size());
+}
+
+bool track_writer::save(const track_snapshot& track, std::string& err) {
+    std::size_t from = std::min(track.from, unsaved_from_);
+    if (from >= track.size()) return true;
+
+    stats::timer t(stats::phase::save);
+    // A file that is still mapped must not be written over: it would change
+    // the text of the track under its feet. Replacing it is fine. Positions in
+    // converted text are not those of the file: it is always replaced then.
+    file_state disk;
+    const encoding::text_format& f = track.text.format();
+    bool in_place = from != 0 && !f.converted && disk.read(file_name_) && disk == disk_ &&
+        !(track.text.mapped() && disk.device == loaded_.device &&
+          disk.inode == loaded_.inode);
+    std::uint64_t pos = in_place ? positions_[from] : 0;
+    if (in_place && pos < std::uint64_t(disk.size)/2) {
+        in_place = false;
+        pos = 0;
+        from = 0;
+    } else if (!in_place) {
+        from = 0;
+    }
+
+    std::string data;
+    std::vector<std::uint64_t> positions;
+    write_entries(track, data, from, pos, &positions);
+    if (!f.plain()) {
+        std::string text;
+        encoding::encode(f, data, text);
+        data.swap(text);
+    }
+
+    // The journal must know the new state before the save is complete
+    auto written = [this](const file_state& state) {
+        if (journal_) journal_->saved(state);
+    };
+
+    bool ok = in_place ? file::update(file_name_, data, pos, err, written) :
+        file::replace(file_name_, data, err, written);
+    if (!ok) {
+        unsaved_from_ = from;
+        return false;
+    }
+
+    stats::add(stats::counter::bytes_written, data.size());
+    disk_.read(file_name_);
+    std::copy(positions.begin(), positions.end(), positions_.own().begin() + from);
+    unsaved_from_ = std::size_t(-1);
+    return true;
+}
+
+bool find_next(const subtitle_track& track, std::size_t& i, const std::string& str) {
+    std::size_t first = i;
+    while (i != track.size()) {
+        if (track.content(i).find(str) != std::string::npos) {
+            stats::add(stats::counter::search_comparisons, i + 1 - first);
+            return true;
+        }
+
+        ++i;
+    }
+
+    stats::add(stats::counter::search_comparisons, i - first);
+    return false;
+}
+
+bool find_previous(const subtitle_track& track, std::size_t& i, const std::string& str) {
+    std::size_t first = i;
+    while (i != 0) {
+        --i;
+
+        if (track.content(i).find(str) != std::string::npos) {
+            stats::add(stats::counter::search_comparisons, first - i);
+            return true;
+        }
+    }
+
+    stats::add(stats::counter::search_comparisons, first);
+    return false;
+}
+
+std::size_t search_results::rank(std::size_t i, bool& found) const {
+    if (!ranked) {
+        auto iter = std::lower_bound(entries.begin(), entries.end(), i);
+        found = iter != entries.end() && *iter == i;
+        return iter - entries.begin();
+    }
+
+    auto iter = std::find(entries.begin(), entries.end(), i);
+    found = iter != entries.end();
+    return found ? iter - entries.begin() : 0;
+}
+
+bool parse_search_flags(std::string& text, bool& fold, bool& fuzzy, std::size_t& max) {
+    fold = false;
+    fuzzy = false;
+    max = 0;
+
+    std::size_t slash = text.find_last_of('/');
+    if (slash == text.npos || slash == 0 || slash + 1 == text.size()) return false;
+
+    bool has_max = false;
+    for (std::size_t i = slash + 1; i < text.size(); ++i) {
+        char c = text[i];
+        if (c == 'i' && !fold) {
+            fold = true;
+        } else if (c == '~' && !fuzzy) {
+            fuzzy = true;
+            for (; i + 1 < text.size() && text[i+1] >= '0' && text[i+1] <= '9'; ++i) {
+                max = max*10 + (text[i+1] - '0');
+                has_max = true;
+            }
+        } else {
+            fold = fuzzy = false;
+            max = 0;
+            return false;
+        }
+    }
+
+    text = string::trim(string::trim(text.substr(0, slash)), "\"\'");
+    if (fuzzy && !has_max) {
+        max = std::max<std::size_t>(1, text.size()/5);
+    }
+
+    return true;
+}
+
+bool parse_retime(const std::string& args, linear::transform& tr, std::string& err) {
+    std::vector<std::string> w = string::words(args);
+    if (w.size() == 2 && w[0].find('=') != w[0].npos && w[1].find('=') != w[1].npos) {
+        time_key t[4];
+        for (std::size_t i = 0; i < 4; ++i) {
+            const std::string& a = w[i/2];
+            std::size_t eq = a.find('=');
+            t[i] = time_key(i % 2 == 0 ? a.substr(0, eq) : a.substr(eq + 1), err);
+            if (!t[i].valid()) return false;
+        }
+
+        if (!(t[0] < t[2]) || !(t[1] < t[3])) {
+            err = "anchors must be given in increasing time order";
+            return false;
+        }
+
+        tr = linear::transform::anchors(t[0].msec(), t[1].msec(), t[2].msec(), t[3].msec());
+        return true;
+    }
+
+    if (w.empty() || w.size() > 2) {
+        err = "expected a factor and an offset, or two anchors 'old=new'";
+        return false;
+    }
+
+    if (!string::to_positive(w[0], tr.factor)) {
+        err = "invalid factor '"+w[0]+"'";
+        return false;
+    }
+
+    std::int64_t msec = 0;
+    if (w.size() == 2 && !string::to_milliseconds(w[1], msec)) {
+        err = "invalid offset '"+w[1]+"'";
+        return false;
+    }
+
+    tr.offset = double(msec);
+    return true;
+}
+
+bool parse_frame_rates(const std::string& args, linear::transform& tr, std::string& err) {
+    std::vector<std::string> w = string::words(args);
+    double from = 0.0, to = 0.0;
+    if (w.size() != 2 || !string::to_positive(w[0], from) || !string::to_positive(w[1], to)) {
+        err = "expected two frame rates, e.g., 'fps 25 23.976'";
+        return false;
+    }
+
+    tr = linear::frame_rates(from, to);
+    return true;
+}
+
+namespace stream {
+    bool parse_script(const std::string& script, std::vector<rule>& rules, std::string& err) {
+        std::istringstream in(script);
+        rule sel;
+        std::string s;
+        while (getline(in, s)) {
+            if (!s.empty() && s.back() == '\r') s.pop_back();
+            s = string::trim(s);
+            std::string low = string::to_lower(s);
+
+            std::string correction;
+            if (s.empty()) {
+                if (!getline(in, correction)) break;
+                if (!correction.empty() && correction.back() == '\r') correction.pop_back();
+                correction = string::trim(correction);
+                if (correction.empty()) continue;
+            } else if (low.compare(0, 6, "shift ") == 0) {
+                correction = string::trim(s.substr(6));
+            }
+
+            if (!correction.empty()) {
+                rule r = sel;
+                if (correction[0] == '+' || correction[0] == '-') {
+                    if (!string::to_milliseconds(correction, r.msec)) {
+                        err = "invalid time duration '"+correction+"'";
+                        return false;
+                    }
+                } else {
+                    time_key t(correction, err);
+                    if (!t.valid()) return false;
+                    r.kind = rule::shift_to;
+                    r.target = t.msec();
+                }
+
+                rules.push_back(r);
+            } else if (low.compare(0, 7, "retime ") == 0 || low.compare(0, 4, "fps ") == 0) {
+                rule r = sel;
+                r.kind = rule::transform;
+                bool ok = low[0] == 'r' ? parse_retime(s.substr(7), r.tr, err) :
+                    parse_frame_rates(s.substr(4), r.tr, err);
+                if (!ok) return false;
+
+                rules.push_back(r);
+            } else if (s[0] == '#') {
+                sel.by_time = false;
+                if (!string::from_string(s.substr(1), sel.from)) {
+                    err = "invalid number of entry";
+                    return false;
+                }
+            } else if (low == "q" || low == "quit") {
+                break;
+            } else if (s != ".") {
+                std::string terr;
+                time_key t(s, terr);
+                if (!t.valid()) {
+                    err = "'"+s+"' cannot be used when streaming";
+                    return false;
+                }
+
+                sel.by_time = true;
+                sel.time = t.msec();
+            }
+        }
+
+        return true;
+    }
+
+    void apply(std::vector<rule>& rules, std::size_t index, std::int64_t& start,
+        std::int64_t& end) {
+
+        for (auto& r : rules) {
+            if (!r.active) {
+                // Later rules see the times as modified by the earlier ones, as
+                // when they are typed one after the other
+                r.active = r.by_time ? start >= r.time : index >= r.from;
+                if (!r.active) continue;
+                if (r.kind == rule::shift_to) {
+                    r.msec = r.target - start;
+                }
+            }
+
+            if (r.kind == rule::transform) {
+                start = linear::apply(r.tr, start);
+                end = linear::apply(r.tr, end);
+            } else {
+                start += r.msec;
+                end += r.msec;
+            }
+        }
+    }
+
+    bool read(int fd, queue& out) {
+        const std::size_t block_size = 1 << 20;
+        // Bytes read and not converted yet, and the converted text not parsed yet
+        std::string raw, pending, converted;
+        encoding::text_format format;
+        bool detected = false;
+        std::size_t line = 0;
+        std::size_t index = 0;
+        bool eof = false;
+
+        while (!eof) {
+            std::size_t old = raw.size();
+            raw.resize(old + block_size);
+            ssize_t r = file::read_some(fd, &raw[old], block_size);
+            if (r < 0) {
+                error(file::system_error("cannot read", "input"));
+                return false;
+            }
+
+            raw.resize(old + r);
+            eof = r == 0;
+            stats::add(stats::counter::bytes_read, r);
+
+            if (!detected) {
+                if (raw.size() < 4096 && !eof) continue;
+
+                format = encoding::detect(raw.data(),
+                    eof ? raw.size() : encoding::complete(format, raw.data(), raw.size()));
+                if (format.bom) raw.erase(0, format.set == encoding::charset::utf8 ? 3 : 2);
+                if (format.set != encoding::charset::utf8) {
+                    note("reading the input as ", encoding::name(format.set),
+                        format.set == encoding::charset::cp1252 ?
+                        ", since it is not valid UTF-8" : "");
+                }
+
+                detected = true;
+            }
+
+            std::size_t n = eof ? raw.size() : encoding::complete(format, raw.data(), raw.size());
+            old = pending.size();
+            if (format.set == encoding::charset::utf8) {
+                if (!encoding::valid_utf8(raw.data(), n)) {
+                    error("the input is not valid UTF-8 after its start; it can only be read"
+                        " without --stream");
+                    return false;
+                }
+
+                pending.append(raw, 0, n);
+                if (n != 0) pending.resize(old + encoding::remove_cr(&pending[old], n));
+            } else {
+                encoding::text_format piece = format;
+                piece.bom = false;
+                encoding::decode(piece, raw.data(), n, converted);
+                pending += converted;
+            }
+
+            raw.erase(0, n);
+
+            // 'pending' always starts at the beginning of a line, and what was
+            // there before this block has no empty line. As for the parser, lines
+            // with only blanks or '\r' count as empty.
+            std::size_t cut = eof ? pending.size() : 0;
+            for (std::size_t k = pending.size(); k > old && cut == 0; --k) {
+                if (pending[k-1] != '\n') continue;
+
+                std::size_t b = k - 1;
+                while (b > 0 && pending[b-1] != '\n') --b;
+                if (parser::blank(&pending[b], &pending[k-1])) cut = k;
+            }
+
+            if (cut == 0) continue;
+
+            std::unique_ptr<batch> b(new batch);
+            b->text.assign(pending.substr(0, cut));
+            pending.erase(0, cut);
+            {
+                stats::timer t(stats::phase::parse);
+                if (!read_entries(b->text, b->entries, line)) {
+                    return false;
+                }
+            }
+
+            stats::add(stats::counter::entries_parsed, b->entries.size());
+            line += std::count(b->text.data(), b->text.data() + b->text.size(), '\n');
+            b->first = index;
+            b->format = format;
+            index += b->entries.size();
+            if (!out.push(std::move(b))) break;
+        }
+
+        return true;
+    }
+
+    void transform(std::vector<rule>& rules, queue& in, queue& out) {
+        std::unique_ptr<batch> b;
+        while (in.pop(b)) {
+            stats::timer t(stats::phase::edit);
+            std::vector<std::int64_t>& starts = b->entries.starts.own();
+            std::vector<std::int64_t>& ends = b->entries.ends.own();
+            for (std::size_t i = 0; i < starts.size(); ++i) {
+                apply(rules, b->first + i, starts[i], ends[i]);
+            }
+
+            stats::add(stats::counter::entries_shifted, starts.size());
+            if (!out.push(std::move(b))) break;
+        }
+    }
+
+    bool write(int fd, queue& in) {
+        std::string buf, encoded;
+        bool started = false;
+        std::unique_ptr<batch> b;
+        while (in.pop(b)) {
+            const entry_columns& e = b->entries;
+            std::size_t max_size = 0;
+            for (std::size_t i = 0; i < e.size(); ++i) {
+                max_size += format::max_entry_header_size + e.text_sizes[i];
+            }
+
+            buf.resize(max_size);
+            char* p = &buf[0];
+            for (std::size_t i = 0; i < e.size(); ++i) {
+                entry en;
+                en.id = e.ids[i];
+                en.start = time_key(e.starts[i]);
+                en.end = time_key(e.ends[i]);
+                en.content = b->text.view(e.text_offsets[i], e.text_sizes[i]);
+                p = format::entry(p, en);
+            }
+
+            const char* data = buf.data();
+            std::size_t size = p - buf.data();
+            if (!b->format.plain()) {
+                // In the format of the input; the byte order mark only comes first
+                encoding::text_format f = b->format;
+                f.bom = f.bom && !started;
+                buf.resize(size);
+                encoding::encode(f, buf, encoded);
+                data = encoded.data();
+                size = encoded.size();
+            }
+
+            started = true;
+            if (!file::write_all(fd, data, size)) {
+                error(file::system_error("cannot write", "output"));
+                return false;
+            }
+
+            stats::add(stats::counter::bytes_written, size);
+        }
+
+        return true;
+    }
+
+    bool run(int in_fd, int out_fd, std::vector<rule>& rules) {
+        queue parsed(4), edited(4);
+        bool read_ok = true;
+
+        std::thread reader([&]() {
+            output = &std::cerr;
+            read_ok = read(in_fd, parsed);
+            parsed.close();
+        });
+
+        std::thread editor([&]() {
+            transform(rules, parsed, edited);
+            edited.close();
+        });
+
+        bool write_ok = write(out_fd, edited);
+        // Stop the other threads if writing failed
+        edited.close();
+        parsed.close();
+
+        reader.join();
+        editor.join();
+        return read_ok && write_ok;
+    }
+
+}
+
+void print_help() {
+    print("\nsubedit v1.0\n");
+
+    print("  This program can do some basic editing on subtitles.");
+    print("  Its main function is to be able to add a delay to a");
+    print("  particular sentence, shifting all the following ones.");
+    print("  To do so, you must first pick the sentence you want to shift");
+    print("  (using any of the various possibilities described below),");
+    print("  then press 'Enter' to input the amount of seconds you want");
+    print("  to add/remove. The program will update the subtitle accordingly");
+    print("  and save it right away, so you can immediately check the result");
+    print("  in your favorite movie player.");
+    print("  Note that some players require a restart for the changes to be");
+    print("  effectives (VLC for example).\n");
+
+    print("Available search commands:");
+    print("  hh:mm:ss,mili : select the sentence just after the provided time stamp");
+    print("  @hh:mm:ss,mili: list the sentences displayed at the provided time stamp");
+    print("  any text      : search for the first occurrence of 'any text' and enters search mode");
+    print("  any text/i    : same, ignoring case");
+    print("  any text/~n   : approximate search, allowing 'n' typos (best matches first)");
+    print("  ?             : exit search mode");
+    print("  #n            : select the 'n'th sentence ('n'th occurrence in search mode)");
+    print("  +x            : advance 'x' times (next occurrences in search mode)");
+    print("  +             : advance once (next occurrence in search mode)");
+    print("  -x            : step back 'x' times (previous occurrences in search mode)");
+    print("  -             : step back once (previous occurrence in search mode)\n");
+    print("  .             : recall the current sentence\n");
+
+    print("Other commands:");
+    print("  'empty'       : start editing the current sentence's time stamp");
+    print("  shift x       : shift the current sentence and all the following ones, by");
+    print("                  'x' seconds ('+1.5', '-2') or to the time stamp 'x'");
+    print("  retime a [b]  : multiply the time stamps of the current sentence and all the");
+    print("                  following ones by 'a', then add 'b' seconds");
+    print("  retime t1=n1 t2=n2");
+    print("                : same, with 'a' and 'b' such that time stamp 't1' becomes 'n1'");
+    print("                  and 't2' becomes 'n2'");
+    print("  fps f1 f2     : same, to convert from 'f1' to 'f2' frames per second");
+    print("  align ref     : match all the time stamps to those of the subtitle 'ref', made");
+    print("                  for the same video (or to 'ref/name' if 'ref' is a directory");
+    print("                  and the subtitle is 'name'): corrects frame rates, offsets and");
+    print("                  cuts at once. 'ref' can also be the sound of the video, in a");
+    print("                  .wav file (or 'ref/name.wav'): the times then match when");
+    print("                  someone speaks");
+    print("  undo          : revert the last edit");
+    print("  redo          : apply the last edit reverted by 'undo' again");
+    print("  check         : look for entries that overlap, are out of order, end before they");
+    print("                  start, last implausibly short or long, or whose IDs are repeated");
+    print("                  or skip numbers");
+    print("  check fix     : same, after sorting the entries by time and numbering them");
+    print("                  from 1, which fixes the order and IDs");
+    print("  sync          : wait until all edits are saved, and show save statistics");
+    print("  stats         : show the time spent, work done and memory used so far");
+    print("  help or h     : display this text");
+    print("  quit or q     : exit the program\n");
+
+    print("Command line options:");
+    print("  --script file : run the commands in 'file' (one per line, as typed at the");
+    print("                  prompt) instead of prompting, then save once and exit;");
+    print("                  nothing is saved if a command fails");
+    print("  --exec \"cmds\" : same, with commands separated by ';'");
+    print("  --retime args : same as --exec \"retime args\"");
+    print("  --fps \"f1 f2\" : same as --exec \"fps f1 f2\"");
+    print("  --align ref   : same as --exec \"align ref\"");
+    print("  --check       : same as --exec \"check\": fails if anything is wrong");
+    print("  --fix         : same as --exec \"check fix\"");
+    print("  -o file       : save to 'file' instead of the subtitle file");
+    print("  -j n          : number of threads, when editing several files");
+    print("  --cache       : keep the parsed subtitle in 'file.subidx', to open it faster");
+    print("                  next time");
+    print("  --stats       : show the time spent, work done and memory used on exit");
+    print("  --stream      : read the subtitle from the file, or the standard input if");
+    print("                  none (or '-'), and write the result to the standard output");
+    print("                  (or -o) as it goes; the script can only select entries with");
+    print("                  '#n' or time stamps (in file order), and edit them\n");
+
+    print("  Several files, or directories (all the .srt files they contain), can be");
+    print("  given along with a script: they are all edited at once, in parallel.\n");
+
+    print("  --serve sock  : keep subtitles loaded and edit them on request, for clients of");
+    print("                  the local socket 'sock'. Requests are lines, answered with");
+    print("                  'ok ...' or 'error <message>'. Up to 64 clients at once:");
+    print("    load file            : load 'file' if needed -> ok <entries>");
+    print("    jump file #n|time    : entry 'n', or the first to start at or after 'time'");
+    print("                           -> ok <n> <start> <end> <text, '\\n' for new lines>");
+    print("    search file text     : as in search mode -> ok <matches> <first 100 entries>");
+    print("    shift file #n|time d : shift an entry and those after it by 'd' (+1.5, -2)");
+    print("                           -> ok <first shifted entry>");
+    print("    save file            : write the edits to 'file'");
+    print("    close file           : save 'file' and unload it");
+    print("    stats                : -> ok <loaded files>");
+    print("    quit, shutdown       : disconnect, or stop the server (saving all files)\n");
+}
+
+void note_transform(const linear::transform& tr) {
+    std::int64_t offset = std::llround(tr.offset);
+    if (offset == 0) {
+        note("multiplying times by ", tr.factor);
+    } else {
+        note("multiplying times by ", tr.factor, " and shifting them by ",
+            (offset > 0 ? "+" : ""), string::seconds(offset), " seconds");
+    }
+}
+
+namespace timing {
+    double now() {
+        return std::chrono::duration<double>(
+            std::chrono::steady_clock::now().time_since_epoch()).count();
+    }
+
+    double msec(double t0, double t1) {
+        return std::round((t1 - t0)*1e4)/10.0;
+    }
+
+}
+
+async_writer::~async_writer() {
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        stop_ = true;
+    }
+
+    changed_.notify_all();
+    thread_.join();
+}
+
+void async_writer::save(track_snapshot s) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (pending_) {
+        s.from = std::min(s.from, pending_->from);
+        ++stats_.coalesced;
+    } else {
+        requested_ = timing::now();
+    }
+
+    pending_.reset(new track_snapshot(std::move(s)));
+    changed_.notify_all();
+}
+
+bool async_writer::failed() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return failed_ && !pending_ && !writing_;
+}
+
+bool async_writer::busy() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return pending_ || writing_;
+}
+
+void async_writer::sync() {
+    std::unique_lock<std::mutex> lock(mutex_);
+    changed_.wait(lock, [this]() { return !pending_ && !writing_; });
+}
+
+std::vector<std::string> async_writer::errors() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    std::vector<std::string> e;
+    e.swap(errors_);
+    return e;
+}
+
+async_writer::statistics async_writer::stats() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return stats_;
+}
+
+void async_writer::run_() {
+    std::unique_lock<std::mutex> lock(mutex_);
+    while (true) {
+        changed_.wait(lock, [this]() { return pending_ || stop_; });
+        if (!pending_) return;
+
+        std::unique_ptr<track_snapshot> s = std::move(pending_);
+        double requested = requested_;
+        writing_ = true;
+        lock.unlock();
+
+        std::string err;
+        bool ok = writer_.save(*s, err);
+
+        // Let the track modify its arrays in place again
+        s.reset();
+        double t = timing::now();
+
+        lock.lock();
+        writing_ = false;
+        failed_ = !ok;
+        if (ok) {
+            ++stats_.saved;
+            double latency = timing::msec(requested, t);
+            stats_.total_latency += latency;
+            stats_.max_latency = std::max(stats_.max_latency, latency);
+        } else {
+            ++stats_.failed;
+            errors_.push_back(err);
+        }
+
+        changed_.notify_all();
+    }
+}
+
+session::session(subtitle_track& track, const std::string& file_name, bool interactive,
+    edit_journal* journal) :
+    track_(track), file_name_(file_name), interactive_(interactive), journal_(journal),
+    writer_(file_name, track, journal) {
+    if (interactive_) saver_.reset(new async_writer(writer_));
+}
+
+void session::prompt() {
+    report_saves_();
+
+    if (!no_display_ && cur_ != track_.size()) {
+        print("\n[", cur_, "] ", track_.start(cur_), " :\n\n", track_.content(cur_));
+    }
+
+    no_display_ = false;
+
+    if (search_mode_) {
+        bool is_match = false;
+        std::size_t rank = matches_.rank(cur_, is_match);
+        if (is_match && matches_.ranked) {
+            put("(match ", rank + 1, " of ", matches_.entries.size(), ", ",
+                matches_.distances[rank], " edits) ");
+        } else if (is_match) {
+            put("(match ", rank + 1, " of ", matches_.entries.size(), ") ");
+        }
+    }
+
+    put("> ");
+}
+
+bool session::save() {
+    // The new content must not be read from a mapping of the file being written
+    track_.detach();
+
+    std::string err;
+    if (!writer_.save(track_.snapshot(), err)) {
+        print(" failed.");
+        error(err, "\n");
+        return false;
+    }
+
+    print(" done.\n");
+    return true;
+}
+
+bool session::finish() {
+    bool ok = sync_(true);
+    if (journal_) {
+        journal_->close(ok);
+        if (!ok) note("the edits will be recovered when the file is opened again");
+    }
+
+    return ok;
+}
+
+bool session::replay(const std::vector<std::string>& lines) {
+    for (auto& line : lines) {
+        std::istringstream in(line);
+        std::string kind;
+        in >> kind;
+
+        bool ok = true;
+        if (kind == "undo") {
+            ok = undo_edit_() != nullptr;
+        } else if (kind == "redo") {
+            ok = redo_edit_() != nullptr;
+        } else {
+            edit e;
+            long long msec = 0;
+            if (kind == "shift" && in >> e.from >> msec) {
+                e.msec = msec;
+            } else if (kind == "retime" && in >> e.from >> e.tr.factor >> e.tr.offset) {
+                e.kind = edit::retime;
+            } else if (kind == "sort") {
+                e.kind = edit::reorder;
+            } else {
+                ok = false;
+            }
+
+            std::string more;
+            e.joined = in >> more && more == "joined";
+            ok = ok && e.from < track_.size();
+            if (ok) add_edit_(std::move(e));
+        }
+
+        if (!ok) {
+            error("invalid edit in the journal: '", line, "'");
+            return false;
+        }
+    }
+
+    note("recovered ", lines.size(), " edits from an interrupted session");
+    if (saver_) saver_->save(track_.snapshot());
+    return true;
+}
+
+bool session::run(std::string s, std::istream& in) {
+    s = string::trim(s);
+    std::string low = string::to_lower(s);
+
+    if (s.empty()) {
+        no_display_ = true;
+        if (track_.empty()) {
+            error("no entry to shift, the subtitle is empty\n");
+            return false;
+        }
+
+        if (interactive_) put("\ncorrected time (empty to abord): ");
+
+        std::int64_t msec = 0;
+        while (true) {
+            if (!getline(in, s)) s.clear();
+
+            if (s.empty()) {
+                if (interactive_) print("");
+                return true;
+            }
+
+            std::string err;
+            if (correction_(s, msec, err)) break;
+
+            if (!interactive_) {
+                error(err);
+                return false;
+            }
+
+            error(err, ", please enter a time stamp, a number, or nothing to abort): ");
+        }
+
+        shift_(msec);
+        no_display_ = false;
+        return true;
+    } else if (low.compare(0, 6, "shift ") == 0) {
+        std::int64_t msec = 0;
+        std::string err;
+        if (!correction_(s.substr(6), msec, err)) {
+            error(err, "\n");
+            return fail_();
+        }
+
+        shift_(msec);
+        return true;
+    } else if (low.compare(0, 7, "retime ") == 0 || low.compare(0, 4, "fps ") == 0) {
+        linear::transform tr;
+        std::string err;
+        bool ok = low[0] == 'r' ? parse_retime(s.substr(7), tr, err) :
+            parse_frame_rates(s.substr(4), tr, err);
+        if (!ok) {
+            error(err, "\n");
+            return fail_();
+        }
+
+        note_transform(tr);
+        if (interactive_) put("note: editing subtitle, please wait... ");
+
+        edit e;
+        e.kind = edit::retime;
+        e.from = cur_;
+        e.tr = tr;
+        record_(std::move(e));
+
+        edited_();
+        return true;
+    } else if (low.compare(0, 6, "align ") == 0) {
+        return align_(string::trim(s.substr(6)));
+    } else if (low == "check" || low == "check fix") {
+        return check_(low == "check fix");
+    } else if (low == "undo" || low == "redo") {
+        bool undo = low == "undo";
+        std::size_t count = 0;
+        const edit* e = undo ? undo_edit_(&count) : redo_edit_(&count);
+        if (!e) {
+            error("nothing to ", low, "\n");
+            return fail_();
+        }
+
+        if (journal_) {
+            if (undo) journal_->undone();
+            else      journal_->redone();
+        }
+
+        cur_ = e->from;
+        for (std::size_t k = 0; k < count; ++k) {
+            if (e[k].kind == edit::reorder) reordered_();
+        }
+
+        if (interactive_) {
+            put("note: ", undo ? "undoing " : "redoing ");
+            if (count > 1) {
+                put(count, " edits made at once... ");
+            } else if (e->kind == edit::shift) {
+                put("shift by ", (e->msec > 0 ? "+" : ""), string::seconds(e->msec),
+                    " seconds... ");
+            } else if (e->kind == edit::reorder) {
+                put("sorting and numbering of the entries... ");
+            } else {
+                put("retime by ", e->tr.factor, "... ");
+            }
+        }
+
+        edited_();
+        return true;
+    } else if (low == "sync") {
+        no_display_ = true;
+        if (!sync_(false)) return false;
+        if (saver_) {
+            async_writer::statistics st = saver_->stats();
+            note("saves: ", st.saved, " written, ", st.coalesced, " coalesced, ",
+                st.failed, " failed; latency ", (st.saved == 0 ? 0.0 :
+                std::round(st.total_latency*10.0/st.saved)/10.0), " ms on average, ",
+                st.max_latency, " ms at most");
+        }
+
+        return true;
+    } else if (low == "stats") {
+        no_display_ = true;
+        stats::print();
+        return true;
+    } else if (low == "q" || low == "quit") {
+        quit_ = true;
+        return true;
+    } else if (low == "h" || low == "help") {
+        print_help();
+        no_display_ = true;
+        return true;
+    }
+
+    char c = s[0];
+    if (c == '#') {
+        s = string::erase_start(s, 1);
+
+        std::size_t num = 0;
+        if (!string::from_string(s, num)) {
+            error("invalid number of entry\n");
+            return fail_();
+        }
+
+        if (!search_mode_) {
+            if (num >= track_.size()) {
+                error("not enough entries (max : ", track_.size()-1, ")\n");
+                return fail_();
+            }
+
+            cur_ = num;
+        } else {
+            if (num >= matches_.entries.size()) {
+                error("no further matches, displaying last one\n");
+                num = matches_.entries.size() - 1;
+            }
+
+            cur_ = matches_.entries[num];
+        }
+    } else if (c == '?') {
+        no_display_ = true;
+        if (search_mode_) {
+            search_mode_ = false;
+            note("leaving search mode");
+        } else {
+            note("you are not in search mode");
+        }
+    } else if (c == '@') {
+        std::string err;
+        time_key tmp = time_key(string::erase_start(s, 1), err);
+        if (!tmp.valid()) {
+            error(err, "\n");
+            return fail_();
+        }
+
+        std::vector<std::size_t> found;
+        track_.find_active(tmp, found);
+        if (found.empty()) {
+            error("no entry displayed at ", tmp, "\n");
+            return fail_();
+        }
+
+        if (interactive_) {
+            for (auto i : found) {
+                print("\n[", i, "] ", track_.start(i), " --> ", track_.end(i), " :\n\n",
+                    track_.content(i));
+            }
+        }
+
+        cur_ = found[0];
+        no_display_ = true;
+    } else if (c == '.') {
+        // Just recall current entry, nothing to do
+    } else if (c == '+') {
+        std::size_t num;
+
+        if (s.size() == 1) {
+            num = 1;
+        } else {
+            s = string::erase_start(s, 1);
+            if (!string::from_string(s, num)) {
+                error("invalid number of entries\n");
+                return fail_();
+            }
+        }
+
+        if (!search_mode_) {
+            if (num >= track_.size() - cur_) {
+                if (num == 1) {
+                    error("no further entry\n");
+                    no_display_ = true;
+                } else {
+                    error("only ", track_.size() - cur_, " further entries, displaying "
+                        "last one\n");
+                }
+
+                return false;
+            }
+
+            cur_ += num;
+        } else {
+            bool is_match = false;
+            std::size_t next = matches_.rank(cur_, is_match) + (is_match ? 1 : 0);
+            std::size_t left = matches_.entries.size() - next;
+
+            if (num > left) {
+                if (num == 1 || left == 0) {
+                    error("no further matches\n");
+                    return fail_();
+                } else {
+                    error("only ", left, " further matches, displaying last one\n");
+                    num = left;
+                }
+            }
+
+            cur_ = matches_.entries[next + num - 1];
+        }
+    } else if (c == '-') {
+        std::size_t num;
+
+        if (s.size() == 1) {
+            num = 1;
+        } else {
+            s = string::erase_start(s, 1);
+            if (!string::from_string(s, num)) {
+                error("invalid number of entries\n");
+                return fail_();
+            }
+        }
+
+        if (!search_mode_) {
+            if (num > cur_) {
+                if (num == 1) {
+                    error("no entry before this point\n");
+                    return fail_();
+                } else {
+                    error("only ", cur_, " entries before this point, "
+                        "displaying first one\n");
+                    num = cur_;
+                }
+            }
+
+            cur_ -= num;
+        } else {
+            bool is_match = false;
+            std::size_t before = matches_.rank(cur_, is_match);
+
+            if (num > before) {
+                if (num == 1 || before == 0) {
+                    error("no match before this point\n");
+                    return fail_();
+                } else {
+                    error("only ", before, " matches before this point, displaying first "
+                        "one\n");
+                    num = before;
+                }
+            }
+
+            cur_ = matches_.entries[before - num];
+        }
+    } else {
+        std::string err;
+        time_key tmp = time_key(s, err);
+        if (tmp.valid()) {
+            std::size_t found = track_.find_time(tmp);
+            if (found == track_.size()) {
+                error("no entry after ", tmp, "\n");
+                return fail_();
+            }
+
+            cur_ = found;
+        } else {
+            return search_(s);
+        }
+    }
+
+    return true;
+}
+
+bool session::fail_() {
+    no_display_ = true;
+    return false;
+}
+
+bool session::correction_(std::string s, std::int64_t& msec, std::string& err) {
+    if (track_.empty()) {
+        err = "no entry to shift, the subtitle is empty";
+        return false;
+    }
+
+    s = string::trim(s);
+    if (s[0] == '+' || s[0] == '-') {
+        if (!string::to_milliseconds(s, msec)) {
+            err = "invalid time duration";
+            return false;
+        }
+    } else {
+        time_key tmp(s, err);
+        if (!tmp.valid()) return false;
+
+        msec = tmp - track_.start(cur_);
+        note("shifting by ", (msec > 0 ? "+" : ""), string::seconds(msec), " seconds");
+    }
+
+    return true;
+}
+
+void session::shift_(std::int64_t msec) {
+    if (interactive_) put("note: editing subtitle, please wait... ");
+
+    edit e;
+    e.from = cur_;
+    e.msec = msec;
+    record_(std::move(e));
+
+    edited_();
+}
+
+bool session::align_(std::string ref_name) {
+    // A directory holds the references of files with the same name, subtitles
+    // or the sound of the video
+    struct stat st;
+    if (::stat(ref_name.c_str(), &st) == 0 && S_ISDIR(st.st_mode)) {
+        std::size_t slash = file_name_.find_last_of('/');
+        std::string base = file_name_.substr(slash == std::string::npos ? 0 : slash + 1);
+        std::string wav = ref_name + "/" + base.substr(0, base.find_last_of('.')) + ".wav";
+        ref_name += "/" + base;
+        if (::access(ref_name.c_str(), F_OK) != 0 && ::access(wav.c_str(), F_OK) == 0) {
+            ref_name = wav;
+        }
+    }
+
+    align::activity ref;
+    std::string err;
+    std::string ext = ref_name.substr(std::min(ref_name.size(), ref_name.size() - 4));
+    std::transform(ext.begin(), ext.end(), ext.begin(), ::tolower);
+    if (ext == ".wav") {
+        double t0 = timing::now();
+        double seconds = 0.0;
+        if (!audio::voice_activity(ref_name, audio::options(), ref, seconds, err)) {
+            error(err, "\n");
+            error("cannot use ", ref_name, " as a reference\n");
+            return fail_();
+        }
+
+        note("found ", ref.starts.size(), " voice segments in ", std::round(seconds),
+            " s of audio (", timing::msec(t0, timing::now()), " ms)");
+    } else {
+        subtitle_track track;
+        std::ostringstream log;
+        std::ostream* old = output;
+        output = &log;
+        bool loaded = load_track(ref_name, track);
+        output = old;
+        if (!loaded) {
+            put(log.str());
+            error("cannot use ", ref_name, " as a reference\n");
+            return fail_();
+        }
+
+        ref = activity_(track);
+    }
+
+    align::correction c;
+    if (!align::compute(activity_(track_), ref, align::options(), c, err)) {
+        error(err, "\n");
+        return fail_();
+    }
+
+    auto percent = [](double r) {
+        return std::round(r*1000.0)/10.0;
+    };
+
+    if (c.after <= c.before) {
+        note("the times already match ", ref_name, " best (", percent(c.before), "%)");
+        no_display_ = true;
+        return true;
+    }
+
+    if (c.tr.factor != 1.0) note_transform(c.tr);
+    note("aligned on ", ref_name, " in ", c.shifts.size() + 1, " pieces: ",
+        percent(c.after), "% of the time matches (", percent(c.before), "% before)");
+    if (c.after < 0.5) {
+        warning("this is little: is it a subtitle of the same video?");
+    }
+
+    if (interactive_) put("note: editing subtitle, please wait... ");
+
+    std::vector<edit> edits;
+    edit e;
+    if (c.tr.factor != 1.0) {
+        e.kind = edit::retime;
+        e.tr = c.tr;
+        edits.push_back(e);
+    } else if (std::llround(c.tr.offset) != 0) {
+        e.msec = std::llround(c.tr.offset);
+        edits.push_back(e);
+    }
+
+    for (auto& s : c.shifts) {
+        edit p;
+        p.from = s.first;
+        p.msec = s.second;
+        edits.push_back(p);
+    }
+
+    if (edits.empty()) {
+        no_display_ = true;
+        return true;
+    }
+
+    cur_ = edits[0].from;
+    for (std::size_t k = 0; k < edits.size(); ++k) {
+        edits[k].joined = k != 0;
+        record_(std::move(edits[k]));
+    }
+
+    edited_();
+    return true;
+}
+
+bool session::check_(bool fix) {
+    no_display_ = true;
+    check::options o;
+    check::report r;
+    check::run(track_, o, r);
+    if (fix && r.fixable()) {
+        std::size_t unordered = r.count(check::problem::unordered);
+        std::size_t ids = r.count(check::problem::duplicate_id) +
+            r.count(check::problem::missing_id);
+        if (interactive_) put("note: sorting and numbering the entries, please wait... ");
+
+        edit e;
+        e.kind = edit::reorder;
+        cur_ = 0;
+        record_(std::move(e));
+        edited_();
+        reordered_();
+
+        check::run(track_, o, r);
+        note("fixed ", unordered, " entries out of order and ", ids, " problems with IDs");
+    }
+
+    if (r.issues.empty()) {
+        note("no issue found in ", track_.size(), " entries");
+        return true;
+    }
+
+    check::print(track_, r, 20);
+    return fix;
+}
+
+align::activity session::activity_(const subtitle_track& t) {
+    align::activity a;
+    a.starts.resize(t.size());
+    a.ends.resize(t.size());
+    for (std::size_t i = 0; i < t.size(); ++i) {
+        a.starts[i] = t.start(i) - time_key(0);
+        a.ends[i] = t.end(i) - time_key(0);
+    }
+
+    return a;
+}
+
+void session::apply_(edit& e) {
+    if (e.kind == edit::shift) {
+        track_.shift(e.from, e.msec);
+    } else if (e.kind == edit::reorder) {
+        if (e.order.empty()) e.order = check::sorted_order(track_);
+        e.ids = track_.columns().ids;
+        track_.reorder(e.order, column<std::size_t>());
+    } else {
+        e.before = track_.times();
+        track_.retime(e.from, e.tr);
+    }
+}
+
+void session::add_edit_(edit e) {
+    history_.resize(done_);
+    apply_(e);
+    history_.push_back(std::move(e));
+    ++done_;
+}
+
+void session::record_(edit e) {
+    add_edit_(std::move(e));
+    if (!journal_) return;
+
+    if (!journal_->started()) {
+        std::string err;
+        if (!journal_->start(track_.text(), err)) {
+            warning("edits cannot be recovered if the program stops (", err, ")");
+            journal_ = nullptr;
+            return;
+        }
+    }
+
+    journal_->record(history_.back());
+}
+
+const edit* session::undo_edit_(std::size_t* count) {
+    if (done_ == 0) return nullptr;
+
+    std::size_t last = done_;
+    do {
+        edit& e = history_[--done_];
+        if (e.kind == edit::shift) {
+            track_.shift(e.from, -e.msec);
+        } else if (e.kind == edit::reorder) {
+            std::vector<std::size_t> back(e.order.size());
+            for (std::size_t k = 0; k < e.order.size(); ++k) {
+                back[e.order[k]] = k;
+            }
+
+            track_.reorder(back, std::move(e.ids));
+            e.ids = column<std::size_t>();
+        } else {
+            track_.restore(e.before, e.from);
+            e.before = subtitle_track::saved_times();
+        }
+    } while (history_[done_].joined && done_ != 0);
+
+    if (count) *count = last - done_;
+    return &history_[done_];
+}
+
+const edit* session::redo_edit_(std::size_t* count) {
+    if (done_ == history_.size()) return nullptr;
+
+    std::size_t first = done_;
+    do {
+        apply_(history_[done_++]);
+    } while (done_ != history_.size() && history_[done_].joined);
+
+    if (count) *count = done_ - first;
+    return &history_[first];
+}
+
+void session::reordered_() {
+    if (!search_mode_) return;
+
+    search_mode_ = false;
+    note("leaving search mode, since the entries were reordered");
+}
+
+void session::edited_() {
+    if (!interactive_) return;
+
+    print("done (", track_.size() - cur_, " entries modified, saving in the background).\n");
+    saver_->save(track_.snapshot());
+}
+
+bool session::sync_(bool last) {
+    if (!saver_) return true;
+
+    if (saver_->failed()) saver_->save(track_.snapshot());
+    if (saver_->busy()) {
+        put("note: waiting for the last edits to be saved... ");
+        saver_->sync();
+        print("done.");
+    }
+
+    return report_saves_(last);
+}
+
+bool session::report_saves_(bool last) {
+    if (!saver_) return true;
+
+    std::vector<std::string> errors = saver_->errors();
+    for (auto& err : errors) {
+        error("could not save the file (", err, ")");
+    }
+
+    if (!errors.empty() && !last) {
+        note("the edits will be saved again with the next one, or by typing 'sync'");
+    }
+
+    return errors.empty();
+}
+
+bool session::search_(const std::string& s) {
+    std::string tmp = string::trim(string::trim(s), "\"\'");
+    bool fold = false, fuzzy = false;
+    std::size_t max_edits = 0;
+    parse_search_flags(tmp, fold, fuzzy, max_edits);
+
+    if (fuzzy && tmp.size() > fuzzy::max_pattern_size) {
+        error("approximate search is limited to ", fuzzy::max_pattern_size,
+            " characters\n");
+        return fail_();
+    }
+
+    if (fuzzy && max_edits >= tmp.size()) {
+        error("too many typos allowed for '", tmp, "'\n");
+        return fail_();
+    }
+
+    if (tmp.empty()) return true;
+
+    search_results found;
+    {
+        stats::timer t(stats::phase::search);
+        if (fuzzy) {
+            track_.find_fuzzy(tmp, max_edits, fold, found.entries, found.distances);
+            found.ranked = true;
+        } else {
+            track_.find_text(tmp, fold, found.entries);
+        }
+    }
+
+    if (found.entries.empty()) {
+        error("no match for '"+tmp+"'\n");
+        return fail_();
+    }
+
+    if (fuzzy) {
+        cur_ = found.entries[0];
+    } else {
+        auto iter = std::lower_bound(found.entries.begin(), found.entries.end(), cur_);
+        if (iter == found.entries.end()) {
+            note("no further match from this point, starting over from begining");
+            iter = found.entries.begin();
+        }
+
+        cur_ = *iter;
+    }
+
+    matches_ = std::move(found);
+    search_string_ = tmp;
+    note("entering search mode for '", search_string_, "'",
+        (fold ? " (ignoring case)" : ""),
+        (fuzzy ? " (up to "+std::to_string(max_edits)+" typos)" : ""),
+        " (type '?' to stop)");
+    search_mode_ = true;
+    return true;
+}
+
+namespace cache {
+    bool enabled = false;
+
+    std::string name(const std::string& file_name) {
+        return file_name + ".subidx";
+    }
+
+    bool write(const std::string& file_name, const text_buffer& text,
+        const entry_columns& entries, std::string& err) {
+
+        static_assert(sizeof(std::size_t) == 8, "cache files assume 64bit sizes");
+
+        std::size_t n = entries.size();
+        text_view spill = text.spilled();
+        layout l(n, !entries.ids.empty(), spill.size);
+
+        header h;
+        memset(&h, 0, sizeof(h));
+        memcpy(h.magic, magic, sizeof(h.magic));
+        h.file_size = text.size();
+        h.mtime = text.state().mtime;
+        h.mtime_ns = text.state().mtime_ns;
+        h.hash = hash::large(text.data(), text.size());
+        h.count = n;
+        h.spill_size = spill.size;
+        h.has_ids = !entries.ids.empty();
+
+        std::string data(l.size, '\0');
+        memcpy(&data[0], &h, sizeof(h));
+        put_column(data, l.starts, entries.starts);
+        put_column(data, l.ends, entries.ends);
+        put_column(data, l.text_offsets, entries.text_offsets);
+        put_column(data, l.positions, entries.positions);
+        put_column(data, l.ids, entries.ids);
+        put_column(data, l.text_sizes, entries.text_sizes);
+        if (spill.size != 0) memcpy(&data[l.spill], spill.data, spill.size);
+
+        h.data_hash = hash::large(data.data() + sizeof(h), data.size() - sizeof(h));
+        memcpy(&data[0], &h, sizeof(h));
+
+        return file::replace(name(file_name), data, err);
+    }
+
+    bool read(const std::string& file_name, text_buffer& text, entry_columns& entries) {
+        std::shared_ptr<mapped_file> m(new mapped_file);
+        if (!m->open(name(file_name)) || m->size() < sizeof(header)) return false;
+
+        header h;
+        memcpy(&h, m->data(), sizeof(h));
+        if (memcmp(h.magic, magic, sizeof(h.magic)) != 0 || h.file_size != text.size() ||
+            h.mtime != text.state().mtime || h.mtime_ns != text.state().mtime_ns ||
+            h.count > m->size()/8) {
+            return false;
+        }
+
+        std::size_t n = h.count;
+        layout l(n, h.has_ids != 0, h.spill_size);
+        if (l.size != m->size() || h.hash != hash::large(text.data(), text.size()) ||
+            h.data_hash != hash::large(m->data() + sizeof(h), m->size() - sizeof(h))) {
+            return false;
+        }
+
+        borrow_column(*m, l.starts, n, entries.starts);
+        borrow_column(*m, l.ends, n, entries.ends);
+        borrow_column(*m, l.text_offsets, n, entries.text_offsets);
+        borrow_column(*m, l.positions, n, entries.positions);
+        if (h.has_ids) borrow_column(*m, l.ids, n, entries.ids);
+        borrow_column(*m, l.text_sizes, n, entries.text_sizes);
+        text.store(std::string(m->data() + l.spill, h.spill_size));
+        entries.source = m;
+        return true;
+    }
+
+}
+
+bool open_track(const std::string& file_name, subtitle_track& track) {
+    bool recovered = false;
+    std::string err;
+    if (!file::recover(file_name, recovered, err)) {
+        error(err);
+        return false;
+    } else if (recovered) {
+        note("completed a save that was interrupted");
+    }
+
+    stats::timer t(stats::phase::read);
+    if (!track.text().open(file_name)) {
+        error("cannot open file: "+file_name+".");
+        return false;
+    }
+
+    stats::add(stats::counter::bytes_read, track.text().size());
+    encoding::charset c = track.text().format().set;
+    if (c != encoding::charset::utf8) {
+        note("reading ", file_name, " as ", encoding::name(c),
+            c == encoding::charset::cp1252 ? ", since it is not valid UTF-8" : "");
+    }
+
+    return true;
+}
+
+bool parse_track(const std::string& file_name, subtitle_track& track) {
+    stats::timer t(stats::phase::parse);
+    entry_columns entries;
+    bool cached = cache::enabled && cache::read(file_name, track.text(), entries);
+    if (!cached && !read_entries(track.text(), entries, 0, parallel::thread_count())) {
+        return false;
+    }
+
+    stats::add(stats::counter::entries_parsed, entries.size());
+    track.assign(std::move(entries));
+    if (!track.sorted()) {
+        warning("entries are not sorted by start time");
+    }
+
+    if (cache::enabled && !cached) {
+        std::string err;
+        if (!cache::write(file_name, track.text(), track.columns(), err)) {
+            warning("could not write cache file (", err, ")");
+        }
+    }
+
+    note("subtitle successfully loaded!");
+    return true;
+}
+
+bool load_track(const std::string& file_name, subtitle_track& track) {
+    return open_track(file_name, track) && parse_track(file_name, track);
+}
+
+bool run_script(const std::string& file_name, const std::string& output_name,
+    const std::string& script, bool show_timings, std::uint64_t& bytes) {
+
+    bytes = 0;
+    double t0 = timing::now();
+
+    subtitle_track track;
+    if (!open_track(file_name, track)) return false;
+    bytes = track.text().size();
+
+    double t1 = timing::now();
+    if (!parse_track(file_name, track)) return false;
+
+    double t2 = timing::now();
+
+    session ses(track, output_name.empty() ? file_name : output_name, false);
+    std::istringstream in(script);
+    std::string s;
+    std::size_t n = 0;
+    while (!ses.done() && getline(in, s)) {
+        ++n;
+        if (!s.empty() && s.back() == '\r') s.pop_back();
+        if (!ses.run(s, in)) {
+            note("in command ", n, " ('", string::trim(s), "'), nothing was saved");
+            return false;
+        }
+    }
+
+    double t3 = timing::now();
+
+    put("note: saving... ");
+    bool ok = ses.save();
+
+    double t4 = timing::now();
+    if (show_timings) {
+        note("timings: read ", timing::msec(t0, t1), " ms, parse ", timing::msec(t1, t2),
+            " ms, edit ", timing::msec(t2, t3), " ms, save ", timing::msec(t3, t4), " ms");
+    }
+
+    return ok;
+}
+
+bool list_files(const std::string& dir, std::vector<std::string>& files) {
+    DIR* d = ::opendir(dir.c_str());
+    if (!d) {
+        error(file::system_error("cannot open directory", dir));
+        return false;
+    }
+
+    std::vector<std::string> names;
+    while (dirent* e = ::readdir(d)) {
+        std::string name = e->d_name;
+        if (name != "." && name != "..") names.push_back(name);
+    }
+
+    ::closedir(d);
+    std::sort(names.begin(), names.end());
+
+    bool ok = true;
+    for (auto& name : names) {
+        std::string path = dir + "/" + name;
+        struct stat st;
+        if (::stat(path.c_str(), &st) != 0) continue;
+
+        if (S_ISDIR(st.st_mode)) {
+            ok = list_files(path, files) && ok;
+        } else if (S_ISREG(st.st_mode) && name.size() > 4 &&
+            string::to_lower(name.substr(name.size() - 4)) == ".srt") {
+            files.push_back(path);
+        }
+    }
+
+    return ok;
+}
+
+int run_script_on_files(const std::vector<std::string>& files, const std::string& script,
+    std::size_t threads) {
+
+    std::vector<char> ok(files.size(), 0);
+    std::vector<std::uint64_t> bytes(files.size(), 0);
+    std::mutex mutex;
+
+    double t0 = timing::now();
+    parallel::for_each_task(files.size(), threads, [&](std::size_t i, std::size_t) {
+        // Messages are only shown for the files that failed, all at once
+        std::ostringstream log;
+        output = &log;
+        try {
+            ok[i] = run_script(files[i], "", script, false, bytes[i]);
+        } catch (std::exception& e) {
+            error(e.what());
+        }
+        output = &std::cout;
+
+        if (!ok[i]) {
+            std::lock_guard<std::mutex> lock(mutex);
+            error("failed to process ", files[i], ":");
+            std::cout << log.str() << std::flush;
+        }
+    });
+    double t1 = timing::now();
+
+    std::size_t failed = std::count(ok.begin(), ok.end(), 0);
+    double total = 0;
+    for (auto b : bytes) total += b;
+
+    double sec = std::max(t1 - t0, 1e-9);
+    note("processed ", files.size(), " files (", failed, " failed) in ",
+        timing::msec(t0, t1), " ms with ", threads, " threads: ",
+        std::round(files.size()/sec), " files/s, ", std::round(total/sec/1e5)/10, " MB/s");
+
+    return failed == 0 ? 0 : 1;
+}
+
+namespace server {
+    rw_lock::rw_lock() {
+        pthread_rwlockattr_t attr;
+        pthread_rwlockattr_init(&attr);
+#if defined(__GLIBC__)
+        pthread_rwlockattr_setkind_np(&attr, PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+#endif
+        pthread_rwlock_init(&lock_, &attr);
+        pthread_rwlockattr_destroy(&attr);
+    }
+
+    rw_lock::~rw_lock() {
+        pthread_rwlock_destroy(&lock_);
+    }
+
+    void rw_lock::lock() {
+        pthread_rwlock_wrlock(&lock_);
+    }
+
+    void rw_lock::lock_shared() {
+        pthread_rwlock_rdlock(&lock_);
+    }
+
+    void rw_lock::unlock() {
+        pthread_rwlock_unlock(&lock_);
+    }
+
+    shared_lock::shared_lock(rw_lock& l) : lock_(l) {
+        lock_.lock_shared();
+    }
+
+    shared_lock::~shared_lock() {
+        lock_.unlock();
+    }
+
+    std::size_t store::size() const {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return tracks_.size();
+    }
+
+    std::shared_ptr<loaded_track> store::get(const std::string& file_name, std::string& err) {
+        std::shared_ptr<loaded_track> t;
+        {
+            std::unique_lock<std::mutex> lock(mutex_);
+            closed_.wait(lock, [&]() { return closing_.find(file_name) == closing_.end(); });
+            auto& slot = tracks_[file_name];
+            if (!slot) slot = std::make_shared<loaded_track>();
+            t = slot;
+        }
+
+        {
+            shared_lock lock(t->lock);
+            if (t->loaded) return t;
+        }
+
+        // Other requests for this file wait while it is loaded
+        std::lock_guard<rw_lock> lock(t->lock);
+        if (!t->loaded && t->error.empty()) {
+            std::ostringstream log;
+            std::ostream* old = output;
+            output = &log;
+            bool ok = load_track(file_name, t->track);
+            output = old;
+
+            if (ok) {
+                t->writer.reset(new track_writer(file_name, t->track));
+                t->loaded = true;
+            } else {
+                // Keep the first error, without its prefix
+                std::string msg = log.str();
+                std::size_t p = msg.find("error: ");
+                t->error = p == msg.npos ? "cannot load "+file_name :
+                    msg.substr(p + 7, msg.find('\n', p) - p - 7);
+
+                std::lock_guard<std::mutex> lock(mutex_);
+                auto iter = tracks_.find(file_name);
+                if (iter != tracks_.end() && iter->second == t) tracks_.erase(iter);
+            }
+        }
+
+        if (!t->loaded) {
+            err = t->error;
+            return nullptr;
+        }
+
+        return t;
+    }
+
+    bool store::close(const std::string& file_name, std::string& err) {
+        std::shared_ptr<loaded_track> t;
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            auto iter = tracks_.find(file_name);
+            if (iter == tracks_.end()) {
+                err = file_name+" is not loaded";
+                return false;
+            }
+
+            t = iter->second;
+            tracks_.erase(iter);
+            closing_[file_name] = t;
+        }
+
+        // Other tracks can be used meanwhile, but this file must not be loaded
+        // again before it is saved
+        bool ok = save(*t, err);
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            closing_.erase(file_name);
+        }
+
+        closed_.notify_all();
+        return ok;
+    }
+
+    bool store::save_all() {
+        std::vector<std::pair<std::string, std::shared_ptr<loaded_track>>> all;
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            all.assign(tracks_.begin(), tracks_.end());
+        }
+
+        bool ok = true;
+        for (auto& t : all) {
+            std::string err;
+            if (t.second->writer && !save(*t.second, err)) {
+                error("could not save ", t.first, ": ", err);
+                ok = false;
+            }
+        }
+
+        return ok;
+    }
+
+    bool save(loaded_track& t, std::string& err) {
+        std::lock_guard<std::mutex> saving(t.save_mutex);
+        track_snapshot snapshot;
+        {
+            std::lock_guard<rw_lock> lock(t.lock);
+            if (!t.modified) return true;
+
+            snapshot = t.track.snapshot();
+            t.modified = false;
+        }
+
+        // Readers and editors are not held back while the file is written
+        if (!t.writer->save(snapshot, err)) {
+            std::lock_guard<rw_lock> lock(t.lock);
+            t.modified = true;
+            return false;
+        }
+
+        return true;
+    }
+
+    namespace {
+        // An entry given as '#n' or as a time stamp (the first entry that starts
+        // at or after it)
+        bool find_entry(const subtitle_track& track, const std::string& s, std::size_t& i,
+            std::string& err) {
+
+            if (!s.empty() && s[0] == '#') {
+                if (!string::from_string(s.substr(1), i)) {
+                    err = "invalid number of entry";
+                    return false;
+                }
+            } else {
+                time_key t(s, err);
+                if (!t.valid()) return false;
+                i = track.find_time(t);
+            }
+
+            if (i >= track.size()) {
+                err = "no such entry: "+s;
+                return false;
+            }
+
+            return true;
+        }
+
+        void escape(text_view t, std::string& out) {
+            for (std::size_t k = 0; k < t.size; ++k) {
+                char c = t.data[k];
+                if (c == '\\') {
+                    out += "\\\\";
+                } else if (c == '\n') {
+                    out += "\\n";
+                } else if (c != '\r') {
+                    out += c;
+                }
+            }
+        }
+
+        std::string next_word(std::string& s) {
+            s = string::trim(s);
+            std::size_t p = std::min(s.find(' '), s.size());
+            std::string word = s.substr(0, p);
+            s = string::trim(s.substr(p));
+            return word;
+        }
+    }
+
+    void handle(store& tracks, const std::string& request, std::string& reply,
+        bool& quit, bool& shutdown) {
+
+        std::string args = request;
+        std::string cmd = next_word(args);
+        std::string err;
+        auto fail = [&](const std::string& msg) {
+            reply = "error "+msg;
+        };
+
+        reply = "ok";
+        if (cmd == "quit") {
+            quit = true;
+            return;
+        } else if (cmd == "shutdown") {
+            shutdown = true;
+            quit = true;
+            return;
+        } else if (cmd == "stats") {
+            reply += " "+std::to_string(tracks.size());
+            return;
+        } else if (cmd == "close") {
+            if (!tracks.close(args, err)) fail(err);
+            return;
+        } else if (cmd != "load" && cmd != "jump" && cmd != "search" && cmd != "shift" &&
+            cmd != "save") {
+            fail("unknown request '"+cmd+"'");
+            return;
+        }
+
+        std::string file_name = next_word(args);
+        if (file_name.empty()) {
+            fail("missing file name");
+            return;
+        }
+
+        std::shared_ptr<loaded_track> t = tracks.get(file_name, err);
+        if (!t) {
+            fail(err);
+            return;
+        }
+
+        subtitle_track& track = t->track;
+        if (cmd == "load") {
+            shared_lock lock(t->lock);
+            reply += " "+std::to_string(track.size());
+        } else if (cmd == "jump") {
+            shared_lock lock(t->lock);
+            std::size_t i = 0;
+            if (!find_entry(track, args, i, err)) {
+                fail(err);
+                return;
+            }
+
+            std::ostringstream ss;
+            ss << " " << i << " " << track.start(i) << " " << track.end(i) << " ";
+            reply += ss.str();
+            escape(track.content(i), reply);
+        } else if (cmd == "search") {
+            bool fold = false, fuzzy = false;
+            std::size_t max_edits = 0;
+            parse_search_flags(args, fold, fuzzy, max_edits);
+            if (args.empty()) {
+                fail("nothing to search");
+                return;
+            } else if (fuzzy && (args.size() > fuzzy::max_pattern_size ||
+                max_edits >= args.size())) {
+                fail("invalid approximate search");
+                return;
+            }
+
+            // Searches only read the track once the index is built
+            if (!fold) {
+                bool indexed = false;
+                {
+                    shared_lock lock(t->lock);
+                    indexed = track.text_indexed();
+                }
+
+                if (!indexed) {
+                    std::lock_guard<rw_lock> lock(t->lock);
+                    track.index_text();
+                }
+            }
+
+            shared_lock lock(t->lock);
+            std::vector<std::size_t> found, distances;
+            if (fuzzy) {
+                track.find_fuzzy(args, max_edits, fold, found, distances);
+            } else {
+                track.find_text(args, fold, found);
+            }
+
+            // Only the first matches: the client can search again from there
+            const std::size_t max_shown = 100;
+            reply += " "+std::to_string(found.size());
+            for (std::size_t k = 0; k < found.size() && k < max_shown; ++k) {
+                reply += " "+std::to_string(found[k]);
+            }
+        } else if (cmd == "shift") {
+            std::string where = next_word(args);
+            std::int64_t msec = 0;
+            if (!string::to_milliseconds(args, msec)) {
+                fail("invalid time duration");
+                return;
+            }
+
+            std::lock_guard<rw_lock> lock(t->lock);
+            std::size_t i = 0;
+            if (!find_entry(track, where, i, err)) {
+                fail(err);
+                return;
+            }
+
+            track.shift(i, msec);
+            t->modified = true;
+            reply += " "+std::to_string(i);
+        } else {
+            if (!save(*t, err)) fail(err);
+        }
+    }
+
+    bool send_all(int fd, const char* data, std::size_t n) {
+        while (n != 0) {
+            ssize_t w = ::send(fd, data, n, MSG_NOSIGNAL);
+            if (w < 0) {
+                if (errno == EINTR) continue;
+                return false;
+            }
+
+            data += w;
+            n -= w;
+        }
+
+        return true;
+    }
+
+    bool read_line(int fd, std::string& pending, std::string& line) {
+        // Longer lines are not requests
+        const std::size_t max_line = 1 << 20;
+        std::size_t scanned = 0;
+        while (true) {
+            std::size_t end = pending.find('\n', scanned);
+            if (end != pending.npos) {
+                line.assign(pending, 0, end);
+                pending.erase(0, end + 1);
+                if (!line.empty() && line.back() == '\r') line.pop_back();
+                return true;
+            }
+
+            scanned = pending.size();
+            if (scanned > max_line) return false;
+
+            char buf[4096];
+            ssize_t r = ::recv(fd, buf, sizeof(buf), 0);
+            if (r < 0 && errno == EINTR) continue;
+            if (r <= 0) return false;
+            pending.append(buf, r);
+        }
+    }
+
+    namespace {
+        bool make_address(const std::string& socket_name, sockaddr_un& addr, std::string& err) {
+            std::memset(&addr, 0, sizeof(addr));
+            addr.sun_family = AF_UNIX;
+            if (socket_name.empty() || socket_name.size() >= sizeof(addr.sun_path)) {
+                err = "invalid socket name: "+socket_name;
+                return false;
+            }
+
+            std::memcpy(addr.sun_path, socket_name.data(), socket_name.size());
+            return true;
+        }
+    }
+
+    client::~client() {
+        if (fd_ >= 0) ::close(fd_);
+    }
+
+    bool client::connect(const std::string& socket_name, std::string& err) {
+        sockaddr_un addr;
+        if (!make_address(socket_name, addr, err)) return false;
+
+        fd_ = ::socket(AF_UNIX, SOCK_STREAM, 0);
+        if (fd_ < 0 || ::connect(fd_, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) != 0) {
+            err = file::system_error("cannot connect to", socket_name);
+            return false;
+        }
+
+        return true;
+    }
+
+    bool client::request(const std::string& line, std::string& reply, std::string& err) {
+        std::string data = line+'\n';
+        if (!send_all(fd_, data.data(), data.size()) || !read_line(fd_, pending_, reply)) {
+            err = "connection to the server lost";
+            return false;
+        }
+
+        return true;
+    }
+
+    bool run(const std::string& socket_name) {
+        sockaddr_un addr;
+        std::string err;
+        if (!make_address(socket_name, addr, err)) {
+            error(err);
+            return false;
+        }
+
+        int fd = ::socket(AF_UNIX, SOCK_STREAM, 0);
+        if (fd < 0) {
+            error(file::system_error("cannot create socket", socket_name));
+            return false;
+        }
+
+        // A socket left by a server that is gone is replaced
+        auto bind_socket = [&]() {
+            return ::bind(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) == 0;
+        };
+
+        bool bound = bind_socket();
+        if (!bound && errno == EADDRINUSE) {
+            client other;
+            if (!other.connect(socket_name, err)) {
+                ::unlink(socket_name.c_str());
+                bound = bind_socket();
+            } else {
+                errno = EADDRINUSE;
+            }
+        }
+
+        const std::size_t max_clients = 64;
+        if (!bound || ::listen(fd, max_clients) != 0) {
+            error(file::system_error("cannot listen on", socket_name));
+            ::close(fd);
+            return false;
+        }
+
+        note("listening on ", socket_name, "; send 'shutdown' to stop");
+
+        store tracks;
+        std::mutex mutex;
+        std::condition_variable finished;
+        std::vector<int> clients;
+        // Threads of the clients, and those that are done and can be joined
+        std::vector<std::thread> threads;
+        std::vector<std::thread::id> exited;
+        bool stopping = false;
+
+        auto join_exited = [&]() {
+            for (auto id : exited) {
+                auto iter = std::find_if(threads.begin(), threads.end(),
+                    [&](const std::thread& t) { return t.get_id() == id; });
+                iter->join();
+                threads.erase(iter);
+            }
+
+            exited.clear();
+        };
+
+        // Stop accepting clients, and disconnect those who are waiting
+        auto stop = [&]() {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+            ::shutdown(fd, SHUT_RDWR);
+            for (int c : clients) ::shutdown(c, SHUT_RDWR);
+        };
+
+        auto serve = [&](int c) {
+            // Messages are not shown: errors go in the replies
+            std::ostringstream log;
+            output = &log;
+
+            std::string pending, line, reply;
+            bool quit = false, shutdown = false;
+            while (!quit && read_line(c, pending, line)) {
+                handle(tracks, line, reply, quit, shutdown);
+                reply += '\n';
+                if (!send_all(c, reply.data(), reply.size())) break;
+                log.str(std::string());
+            }
+
+            if (shutdown) stop();
+
+            std::lock_guard<std::mutex> lock(mutex);
+            clients.erase(std::find(clients.begin(), clients.end(), c));
+            ::close(c);
+            exited.push_back(std::this_thread::get_id());
+            finished.notify_all();
+        };
+
+        while (true) {
+            int c = ::accept(fd, nullptr, nullptr);
+            if (c < 0 && errno == EINTR) continue;
+
+            std::lock_guard<std::mutex> lock(mutex);
+            if (stopping) {
+                if (c >= 0) ::close(c);
+                break;
+            } else if (c < 0) {
+                error(file::system_error("cannot accept clients on", socket_name));
+                break;
+            }
+
+            join_exited();
+            if (clients.size() >= max_clients) {
+                const std::string busy = "error too many clients, try again later\n";
+                send_all(c, busy.data(), busy.size());
+                ::close(c);
+                continue;
+            }
+
+            clients.push_back(c);
+            threads.emplace_back(serve, c);
+        }
+
+        // Requests being handled are finished before the tracks are saved
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            for (int c : clients) ::shutdown(c, SHUT_RDWR);
+            finished.wait(lock, [&]() { return clients.empty(); });
+        }
+
+        for (auto& t : threads) {
+            t.join();
+        }
+
+        ::close(fd);
+        ::unlink(socket_name.c_str());
+
+        bool ok = tracks.save_all() && stopping;
+        note("server stopped");
+        return ok;
+    }
+}
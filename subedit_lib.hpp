@@ -0,0 +1,2627 @@
+#ifndef SUBEDIT_LIB_HPP
+#define SUBEDIT_LIB_HPP
+
+#include <string>
+#include <vector>
+#include <sstream>
+#include <fstream>
+#include <iostream>
+#include <algorithm>
+#include <iterator>
+#include <cmath>
+#include <cerrno>
+#include <cstdlib>
+#include <cstdint>
+#include <cstring>
+#include <chrono>
+#include <limits>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include <condition_variable>
+#include <unordered_map>
+#include <memory>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/stat.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <unistd.h>
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+
+// Where messages go. Threads that work on separate files each have their own.
+extern thread_local std::ostream* output;
+
+void print();
+
+template<typename T, typename ... Args>
+void print(const T& t, const Args& ... args) {
+    *output << t;
+    print(args...);
+}
+
+template<typename ... Args>
+void error(const Args& ... args) {
+    *output << "error: ";
+    print(args...);
+}
+
+template<typename ... Args>
+void warning(const Args& ... args) {
+    *output << "warning: ";
+    print(args...);
+}
+
+template<typename ... Args>
+void note(const Args& ... args) {
+    *output << "note: ";
+    print(args...);
+}
+
+void put();
+
+template<typename T, typename ... Args>
+void put(const T& t, const Args& ... args) {
+    *output << t;
+    put(args...);
+}
+
+// What the program spent its time and memory on, shown by 'stats' and --stats.
+// Counters and timers are only compiled in with SUBEDIT_STATS (the default in
+// debug builds); otherwise they cost nothing.
+namespace stats {
+    enum class counter {
+        bytes_read, entries_parsed, search_comparisons, entries_shifted, bytes_written,
+        count
+    };
+
+    enum class phase {
+        read, parse, search, edit, save,
+        count
+    };
+
+#if defined(SUBEDIT_STATS)
+    extern std::atomic<std::uint64_t> counters[std::size_t(counter::count)];
+    extern std::atomic<std::uint64_t> phase_calls[std::size_t(phase::count)];
+    extern std::atomic<std::uint64_t> phase_nsec[std::size_t(phase::count)];
+    // Counted by the replacement operator new
+    extern std::atomic<std::uint64_t> allocations;
+    extern std::atomic<std::uint64_t> allocated_bytes;
+
+    inline void add(counter c, std::uint64_t n) {
+        counters[std::size_t(c)].fetch_add(n, std::memory_order_relaxed);
+    }
+
+    // Adds the time spent in its scope to a phase. Timers of the same phase
+    // must not be nested.
+    class timer {
+    public :
+        explicit timer(phase p) : phase_(p), start_(std::chrono::steady_clock::now()) {}
+
+        timer(const timer&) = delete;
+        timer& operator=(const timer&) = delete;
+
+        ~timer() {
+            auto d = std::chrono::steady_clock::now() - start_;
+            std::size_t p = std::size_t(phase_);
+            phase_calls[p].fetch_add(1, std::memory_order_relaxed);
+            phase_nsec[p].fetch_add(
+                std::chrono::duration_cast<std::chrono::nanoseconds>(d).count(),
+                std::memory_order_relaxed);
+        }
+
+    private :
+        phase phase_;
+        std::chrono::steady_clock::time_point start_;
+    };
+#else
+    inline void add(counter, std::uint64_t) {}
+
+    class timer {
+    public :
+        explicit timer(phase) {}
+    };
+#endif
+
+    // Largest memory use of the process so far, in bytes
+    std::uint64_t peak_rss();
+
+    void print();
+
+    // Prints the statistics when going out of scope, if 'enabled'
+    struct report {
+        bool enabled = false;
+
+        ~report() {
+            if (enabled) print();
+        }
+    };
+}
+
+namespace string {
+    template<typename T>
+    bool from_string(const std::string& s, T& t) {
+        std::istringstream ss(s);
+        return static_cast<bool>(ss >> t);
+    }
+
+    std::string trim(std::string s, const std::string& chars = " \t");
+
+    std::string to_lower(std::string s);
+
+    std::string erase_start(std::string s, std::size_t n);
+
+    std::vector<std::string> words(const std::string& s);
+
+    // A strictly positive and finite number, with nothing after it
+    bool to_positive(const std::string& s, double& v);
+
+    std::vector<std::string> cut(const std::string& ts, const std::string& pattern);
+
+    // Parse a duration in seconds ('+1.5', '-0.04', ...) into milliseconds, without
+    // going through floating point numbers. Extra decimals are rounded.
+    bool to_milliseconds(const std::string& s, std::int64_t& msec);
+
+    // Print a number of milliseconds as seconds, with only the needed decimals
+    std::string seconds(std::int64_t msec);
+
+    template<typename T>
+    std::string convert(const T& t) {
+        std::ostringstream ss;
+        ss << t;
+        return ss.str();
+    }
+
+    template<typename T>
+    std::string convert(const T& t, std::size_t n, char fill = '0') {
+        if (n <= 1) {
+            return convert(t);
+        }
+        if (t == 0) {
+            return std::string(n-1, fill)+'0';
+        } else {
+            std::ostringstream ss;
+            ss << t;
+            std::size_t nz = n-1 - floor(log10(t));
+            if (nz > 0 && nz < 6) {
+                return std::string(nz, fill) + ss.str();
+            } else {
+                return ss.str();
+            }
+        }
+    }
+}
+
+// Formatting to raw character buffers, for fast output
+namespace format {
+    const char digit_pairs[] =
+        "00010203040506070809101112131415161718192021222324252627282930313233343536373839"
+        "40414243444546474849505152535455565758596061626364656667686970717273747576777879"
+        "8081828384858687888990919293949596979899";
+
+    // Enough for any 64bit number
+    const std::size_t max_integer_size = 21;
+
+    char* integer(char* out, std::uint64_t v);
+
+    // At least two digits; negative values are written without padding
+    char* two_digits(char* out, std::int64_t v);
+
+    const std::size_t max_time_size = 3*(max_integer_size + 1) + 4;
+
+    // 'HH:MM:SS,mmm'
+    char* time(char* out, std::int64_t milliseconds);
+}
+
+struct time_key {
+    time_key() : milliseconds(invalid_) {}
+
+    explicit time_key(std::int64_t msec) : milliseconds(msec) {}
+
+    time_key(int sec, int msec) : milliseconds(std::int64_t(sec)*1000 + msec) {}
+
+    time_key(const char* b, const char* e, std::string& err) : milliseconds(invalid_) {
+        if (!parse_fixed_(b, e) && !parse_flexible_(b, e, err)) {
+            milliseconds = invalid_;
+        }
+    }
+
+    time_key(const std::string& str, std::string& err) :
+        time_key(str.data(), str.data() + str.size(), err) {}
+
+    bool valid() const {
+        return milliseconds != invalid_;
+    }
+
+    std::int64_t msec() const {
+        return milliseconds;
+    }
+
+    time_key& operator += (std::int64_t msec) {
+        milliseconds += msec;
+        return *this;
+    }
+
+    time_key& operator -= (std::int64_t msec) {
+        milliseconds -= msec;
+        return *this;
+    }
+
+    time_key operator + (std::int64_t msec) const {
+        return time_key(milliseconds + msec);
+    }
+
+    time_key operator - (std::int64_t msec) const {
+        return time_key(milliseconds - msec);
+    }
+
+    // Difference in milliseconds
+    std::int64_t operator - (const time_key& t) const {
+        return milliseconds - t.milliseconds;
+    }
+
+    bool operator == (const time_key& t) const {
+        return milliseconds == t.milliseconds;
+    }
+
+    bool operator != (const time_key& t) const {
+        return milliseconds != t.milliseconds;
+    }
+
+    bool operator < (const time_key& t) const {
+        return milliseconds < t.milliseconds;
+    }
+
+    bool operator <= (const time_key& t) const {
+        return milliseconds <= t.milliseconds;
+    }
+
+    bool operator > (const time_key& t) const {
+        return milliseconds > t.milliseconds;
+    }
+
+    bool operator >= (const time_key& t) const {
+        return milliseconds >= t.milliseconds;
+    }
+
+private :
+    static constexpr std::int64_t invalid_ = std::numeric_limits<std::int64_t>::min();
+
+    std::int64_t milliseconds;
+
+    // 'HH:MM:SS,mmm', the format used by all well-formed SRT files
+    bool parse_fixed_(const char* b, const char* e) {
+        if (e - b != 12) return false;
+
+        const unsigned char* p = reinterpret_cast<const unsigned char*>(b);
+        unsigned d[12];
+        for (std::size_t i = 0; i < 12; ++i) {
+            d[i] = p[i] - unsigned('0');
+        }
+
+        unsigned bad = (p[2] ^ ':') | (p[5] ^ ':') | (p[8] ^ ',');
+        bad |= (d[0] > 9) | (d[1] > 9) | (d[3] > 9) | (d[4] > 9) | (d[6] > 9) | (d[7] > 9);
+        bad |= (d[9] > 9) | (d[10] > 9) | (d[11] > 9);
+        if (bad) return false;
+
+        std::int64_t h = d[0]*10 + d[1];
+        std::int64_t m = d[3]*10 + d[4];
+        std::int64_t s = d[6]*10 + d[7];
+        milliseconds = ((h*60 + m)*60 + s)*1000 + d[9]*100 + d[10]*10 + d[11];
+        return true;
+    }
+
+    // Same rules as reading an 'int' from an std::istream: leading spaces, a sign
+    // and at least one digit; whatever comes after is ignored.
+    static bool parse_int_(const char* b, const char* e, std::int64_t& v) {
+        while (b != e && isspace(static_cast<unsigned char>(*b))) ++b;
+
+        bool neg = false;
+        if (b != e && (*b == '+' || *b == '-')) {
+            neg = *b == '-';
+            ++b;
+        }
+
+        if (b == e || *b < '0' || *b > '9') return false;
+
+        std::int64_t r = 0;
+        for (; b != e && *b >= '0' && *b <= '9'; ++b) {
+            r = r*10 + (*b - '0');
+            if (r > std::int64_t(std::numeric_limits<int>::max()) + neg) return false;
+        }
+
+        v = neg ? -r : r;
+        return true;
+    }
+
+    // '[[HH:]MM:]SS[,mmm]', with arbitrary number of digits and spaces around
+    bool parse_flexible_(const char* b, const char* e, std::string& err) {
+        while (b != e && (*b == ' ' || *b == '\t')) ++b;
+        while (e != b && (*(e-1) == ' ' || *(e-1) == '\t')) --e;
+
+        const char* fields[3];
+        const char* fields_end[3];
+        std::size_t nfield = 0;
+        for (const char* p = b; nfield < 3; ) {
+            const char* q = static_cast<const char*>(memchr(p, ':', e - p));
+            fields[nfield] = p;
+            fields_end[nfield] = q ? q : e;
+            ++nfield;
+            if (!q) break;
+            p = q + 1;
+        }
+
+        bool more = nfield == 3 && fields_end[2] != e;
+        std::size_t i = 0;
+        std::int64_t total = 0;
+        std::int64_t tmp = 0;
+
+        if (nfield == 3 && !more) {
+            if (!parse_int_(fields[i], fields_end[i], tmp)) {
+                err = "invalid number of hours";
+                return false;
+            }
+
+            total += tmp*3600;
+            ++i;
+        }
+
+        if (nfield >= 2) {
+            if (!parse_int_(fields[i], fields_end[i], tmp)) {
+                err = "invalid number of minutes";
+                return false;
+            }
+
+            total += tmp*60;
+            ++i;
+        }
+
+        const char* sb = fields[i];
+        const char* se = fields_end[i];
+        const char* comma = static_cast<const char*>(memchr(sb, ',', se - sb));
+        if (!parse_int_(sb, comma ? comma : se, tmp)) {
+            err = "invalid number of seconds";
+            return false;
+        }
+
+        total = total*1000 + tmp*1000;
+
+        if (comma && !memchr(comma + 1, ',', se - comma - 1)) {
+            if (!parse_int_(comma + 1, se, tmp)) {
+                err = "invalid number of milliseconds";
+                return false;
+            }
+
+            total += tmp;
+        }
+
+        milliseconds = total;
+        return true;
+    }
+
+    friend std::ostream& operator << (std::ostream& o, const time_key& t) {
+        char buf[format::max_time_size];
+        return o.write(buf, format::time(buf, t.milliseconds) - buf);
+    }
+};
+
+// Substring search kernels. Candidates are found by comparing the first and last
+// bytes of the pattern with 16 or 32 bytes of text at once, and then checked
+// one by one. Case folding covers ASCII and the Latin-1 range of UTF-8.
+namespace search {
+    enum class isa {
+        scalar, sse2, avx2
+    };
+
+    isa detect_isa();
+
+    // Best instruction set on this CPU; can be lowered for testing
+    extern isa kernel;
+
+    // Lower case of 'c', given the byte before it
+    inline unsigned char fold(unsigned char prev, unsigned char c) {
+        if (unsigned(c - 'A') < 26u) return c | 0x20;
+        if (prev == 0xc3 && c >= 0x80 && c <= 0x9e && c != 0x97) return c | 0x20;
+        return c;
+    }
+
+    // Same as fold(), but without looking at the previous byte: may fold more
+    // than needed, so it is only used to find candidates
+    inline unsigned char loose_fold(unsigned char c) {
+        if (unsigned(c - 'A') < 26u) return c | 0x20;
+        if (c >= 0x80 && c <= 0x9e && c != 0x97) return c | 0x20;
+        return c;
+    }
+
+    struct pattern {
+        std::string text;
+        bool fold = false;
+        unsigned char first = 0, last = 0;
+
+        pattern() = default;
+
+        pattern(const std::string& str, bool case_fold) : text(str), fold(case_fold) {
+            if (text.empty()) return;
+
+            if (fold) {
+                unsigned char prev = 0;
+                for (auto& c : text) {
+                    unsigned char u = c;
+                    c = search::fold(prev, u);
+                    prev = u;
+                }
+
+                first = loose_fold(text.front());
+                last = loose_fold(text.back());
+            } else {
+                first = text.front();
+                last = text.back();
+            }
+        }
+
+        std::size_t size() const {
+            return text.size();
+        }
+
+        // Does the pattern match at 'p' (the first and last bytes are assumed to)?
+        bool match(const char* begin, const char* p) const {
+            if (!fold) {
+                return text.size() <= 2 || memcmp(p + 1, text.data() + 1, text.size() - 2) == 0;
+            }
+
+            unsigned char prev = p == begin ? 0 : *(p - 1);
+            for (std::size_t i = 0; i < text.size(); ++i) {
+                unsigned char c = p[i];
+                if (search::fold(prev, c) != static_cast<unsigned char>(text[i])) return false;
+                prev = c;
+            }
+
+            return true;
+        }
+    };
+
+    // Each 'scan' calls 'hit(position)' for every match starting at or after
+    // 'from', and stops if it returns false
+    template<typename F>
+    void scan_scalar(const char* data, std::size_t n, const pattern& pat, F&& hit,
+        std::size_t from = 0) {
+
+        std::size_t m = pat.size();
+        if (m == 0 || m > n) return;
+
+        const unsigned char* p = reinterpret_cast<const unsigned char*>(data);
+        for (std::size_t i = from; i + m <= n; ++i) {
+            unsigned char a = p[i], b = p[i + m - 1];
+            if (pat.fold) {
+                a = loose_fold(a);
+                b = loose_fold(b);
+            }
+
+            if (a == pat.first && b == pat.last && pat.match(data, data + i)) {
+                if (!hit(i)) return;
+            }
+        }
+    }
+
+#if defined(__x86_64__)
+    inline __m128i fold_16(__m128i x) {
+        __m128i upper = _mm_and_si128(_mm_cmpgt_epi8(x, _mm_set1_epi8('A' - 1)),
+            _mm_cmplt_epi8(x, _mm_set1_epi8('Z' + 1)));
+        // 0x80 to 0x9e are the negative numbers below -97
+        __m128i latin = _mm_andnot_si128(_mm_cmpeq_epi8(x, _mm_set1_epi8(char(0x97))),
+            _mm_cmplt_epi8(x, _mm_set1_epi8(char(0x9f))));
+        return _mm_or_si128(x, _mm_and_si128(_mm_or_si128(upper, latin), _mm_set1_epi8(0x20)));
+    }
+
+    template<typename F>
+    void scan_sse2(const char* data, std::size_t n, const pattern& pat, F&& hit,
+        std::size_t from = 0) {
+
+        std::size_t m = pat.size();
+        if (m == 0 || m > n) return;
+
+        const __m128i first = _mm_set1_epi8(char(pat.first));
+        const __m128i last = _mm_set1_epi8(char(pat.last));
+
+        std::size_t i = from;
+        for (; i + m - 1 + 16 <= n; i += 16) {
+            __m128i a = _mm_loadu_si128(reinterpret_cast<const __m128i*>(data + i));
+            __m128i b = _mm_loadu_si128(reinterpret_cast<const __m128i*>(data + i + m - 1));
+            if (pat.fold) {
+                a = fold_16(a);
+                b = fold_16(b);
+            }
+
+            unsigned mask = _mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(a, first),
+                _mm_cmpeq_epi8(b, last)));
+            while (mask != 0) {
+                std::size_t k = i + __builtin_ctz(mask);
+                if (pat.match(data, data + k) && !hit(k)) return;
+                mask &= mask - 1;
+            }
+        }
+
+        scan_scalar(data, n, pat, hit, i);
+    }
+
+    __attribute__((target("avx2")))
+    inline __m256i fold_32(__m256i x) {
+        __m256i upper = _mm256_and_si256(_mm256_cmpgt_epi8(x, _mm256_set1_epi8('A' - 1)),
+            _mm256_cmpgt_epi8(_mm256_set1_epi8('Z' + 1), x));
+        __m256i latin = _mm256_andnot_si256(_mm256_cmpeq_epi8(x, _mm256_set1_epi8(char(0x97))),
+            _mm256_cmpgt_epi8(_mm256_set1_epi8(char(0x9f)), x));
+        return _mm256_or_si256(x, _mm256_and_si256(_mm256_or_si256(upper, latin),
+            _mm256_set1_epi8(0x20)));
+    }
+
+    template<typename F>
+    __attribute__((target("avx2")))
+    void scan_avx2(const char* data, std::size_t n, const pattern& pat, F&& hit) {
+        std::size_t m = pat.size();
+        if (m == 0 || m > n) return;
+
+        const __m256i first = _mm256_set1_epi8(char(pat.first));
+        const __m256i last = _mm256_set1_epi8(char(pat.last));
+
+        std::size_t i = 0;
+        for (; i + m - 1 + 32 <= n; i += 32) {
+            __m256i a = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(data + i));
+            __m256i b = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(data + i + m - 1));
+            if (pat.fold) {
+                a = fold_32(a);
+                b = fold_32(b);
+            }
+
+            unsigned mask = _mm256_movemask_epi8(_mm256_and_si256(_mm256_cmpeq_epi8(a, first),
+                _mm256_cmpeq_epi8(b, last)));
+            while (mask != 0) {
+                std::size_t k = i + __builtin_ctz(mask);
+                if (pat.match(data, data + k) && !hit(k)) return;
+                mask &= mask - 1;
+            }
+        }
+
+        scan_sse2(data, n, pat, hit, i);
+    }
+#endif
+
+    template<typename F>
+    void scan(const char* data, std::size_t n, const pattern& pat, F&& hit) {
+#if defined(__x86_64__)
+        switch (kernel) {
+            case isa::avx2 : scan_avx2(data, n, pat, hit); return;
+            case isa::sse2 : scan_sse2(data, n, pat, hit); return;
+            default : break;
+        }
+#endif
+        scan_scalar(data, n, pat, hit);
+    }
+
+    // Position of the first match, or npos
+    std::size_t find_first(const char* data, std::size_t n, const pattern& pat);
+
+    // Positions of all the matches, in a single pass
+    void find_all(const char* data, std::size_t n, const pattern& pat,
+        std::vector<std::size_t>& hits);
+}
+
+// Approximate matching with Myers' bit-parallel algorithm: the smallest edit
+// distance between a pattern (up to 64 bytes) and any part of a text.
+namespace fuzzy {
+    const std::size_t max_pattern_size = 64;
+
+    struct pattern {
+        std::uint64_t peq[256];
+        std::size_t size = 0;
+        bool fold = false;
+
+        pattern(const std::string& str, bool case_fold) : size(str.size()), fold(case_fold) {
+            memset(peq, 0, sizeof(peq));
+
+            unsigned char prev = 0;
+            for (std::size_t i = 0; i < size; ++i) {
+                unsigned char c = str[i];
+                peq[fold ? search::fold(prev, c) : c] |= std::uint64_t(1) << i;
+                prev = c;
+            }
+        }
+    };
+
+    // Edit distance of the best match, or 'max+1' if there is no match within 'max'
+    std::size_t distance(const pattern& pat, const char* text, std::size_t n, std::size_t max);
+}
+
+// Running work on all cores
+namespace parallel {
+    std::size_t thread_count();
+
+    // Split [0,n) in contiguous chunks of at least 'min_size' elements, and call
+    // 'func(begin, end, chunk)' for each on its own thread. Returns the number of
+    // chunks.
+    template<typename F>
+    std::size_t for_chunks(std::size_t n, std::size_t min_size, F&& func) {
+        std::size_t nchunk = std::max<std::size_t>(1,
+            std::min(thread_count(), n/std::max<std::size_t>(1, min_size)));
+
+        if (nchunk == 1) {
+            func(std::size_t(0), n, std::size_t(0));
+            return 1;
+        }
+
+        std::vector<std::thread> threads;
+        threads.reserve(nchunk - 1);
+        for (std::size_t c = 1; c < nchunk; ++c) {
+            threads.emplace_back([&func, c, n, nchunk]() {
+                func(n*c/nchunk, n*(c + 1)/nchunk, c);
+            });
+        }
+
+        func(std::size_t(0), n/nchunk, std::size_t(0));
+        for (auto& t : threads) {
+            t.join();
+        }
+
+        return nchunk;
+    }
+
+    // Queue between threads, with a fixed capacity: push() waits while it is full
+    // and pop() while it is empty, until close() is called.
+    template<typename T>
+    class bounded_queue {
+    public :
+        explicit bounded_queue(std::size_t capacity) : capacity_(capacity) {}
+
+        // Returns false if the queue was closed
+        bool push(T t) {
+            std::unique_lock<std::mutex> lock(mutex_);
+            not_full_.wait(lock, [&]() { return items_.size() < capacity_ || closed_; });
+            if (closed_) return false;
+
+            items_.push_back(std::move(t));
+            not_empty_.notify_one();
+            return true;
+        }
+
+        // Returns false if the queue was closed and nothing is left
+        bool pop(T& t) {
+            std::unique_lock<std::mutex> lock(mutex_);
+            not_empty_.wait(lock, [&]() { return !items_.empty() || closed_; });
+            if (items_.empty()) return false;
+
+            t = std::move(items_.front());
+            items_.pop_front();
+            not_full_.notify_one();
+            return true;
+        }
+
+        void close() {
+            std::lock_guard<std::mutex> lock(mutex_);
+            closed_ = true;
+            not_full_.notify_all();
+            not_empty_.notify_all();
+        }
+
+    private :
+        std::mutex mutex_;
+        std::condition_variable not_full_;
+        std::condition_variable not_empty_;
+        std::deque<T> items_;
+        std::size_t capacity_ = 1;
+        bool closed_ = false;
+    };
+
+    // Call 'func(i, thread)' for all 'i' in [0,n) on 'threads' threads. Each thread
+    // starts with its own share of the tasks; once done, it steals half of what
+    // is left to another, so that a few long tasks do not leave threads idle.
+    template<typename F>
+    void for_each_task(std::size_t n, std::size_t threads, F&& func) {
+        struct queue {
+            std::mutex mutex;
+            std::size_t begin = 0, end = 0;
+        };
+
+        threads = std::max<std::size_t>(1, std::min(threads, n));
+        std::vector<queue> queues(threads);
+        for (std::size_t t = 0; t < threads; ++t) {
+            queues[t].begin = n*t/threads;
+            queues[t].end = n*(t + 1)/threads;
+        }
+
+        auto work = [&](std::size_t t) {
+            queue& own = queues[t];
+            while (true) {
+                std::size_t i = 0;
+                bool found = false;
+                {
+                    std::lock_guard<std::mutex> lock(own.mutex);
+                    if (own.begin != own.end) {
+                        i = own.begin++;
+                        found = true;
+                    }
+                }
+
+                for (std::size_t k = 1; k < threads && !found; ++k) {
+                    queue& other = queues[(t + k) % threads];
+                    std::size_t b = 0, e = 0;
+                    {
+                        std::lock_guard<std::mutex> lock(other.mutex);
+                        std::size_t left = other.end - other.begin;
+                        if (left == 0) continue;
+
+                        b = other.end - (left + 1)/2;
+                        e = other.end;
+                        other.end = b;
+                    }
+
+                    std::lock_guard<std::mutex> lock(own.mutex);
+                    own.begin = b + 1;
+                    own.end = e;
+                    i = b;
+                    found = true;
+                }
+
+                if (!found) return;
+                func(i, t);
+            }
+        };
+
+        std::vector<std::thread> pool;
+        for (std::size_t t = 1; t < threads; ++t) {
+            pool.emplace_back(work, t);
+        }
+
+        work(0);
+        for (auto& t : pool) {
+            t.join();
+        }
+    }
+}
+
+// Linear time transforms t' = factor*t + offset, over arrays of milliseconds.
+// The result is computed with doubles and rounded to the nearest millisecond
+// (ties to even), and all kernels give exactly the same result.
+namespace linear {
+    struct transform {
+        double factor = 1.0;
+        double offset = 0.0;
+
+        // Map 't1' to 'n1' and 't2' to 'n2'
+        static transform anchors(std::int64_t t1, std::int64_t n1, std::int64_t t2, std::int64_t n2) {
+            transform tr;
+            tr.factor = double(n2 - n1)/double(t2 - t1);
+            tr.offset = double(n1) - tr.factor*double(t1);
+            return tr;
+        }
+    };
+
+    // Adding 1.5*2^52 to a double below 2^51 (in absolute value) rounds it to an
+    // integer, which is then found in the low bits: conversions between doubles
+    // and integers are just additions.
+    const double magic = 6755399441055744.0;
+    const std::int64_t magic_bits = 0x4338000000000000;
+    const std::int64_t limit = std::int64_t(1) << 51;
+
+    inline std::int64_t apply(const transform& tr, std::int64_t t) {
+        double x = std::nearbyint(double(t)*tr.factor + tr.offset);
+        // 2^62, to leave room for later shifts
+        const double max = 4611686018427387904.0;
+        if (!(x < max)) return std::int64_t(max);
+        if (!(x > -max)) return -std::int64_t(max);
+        return std::int64_t(x);
+    }
+
+    void apply_scalar(const transform& tr, std::int64_t* t, std::size_t n);
+
+#if defined(__x86_64__)
+    void apply_sse2(const transform& tr, std::int64_t* t, std::size_t n);
+
+    __attribute__((target("avx2")))
+    void apply_avx2(const transform& tr, std::int64_t* t, std::size_t n);
+#endif
+
+    // Transform 't[0]' to 't[n-1]' in place
+    void apply(const transform& tr, std::int64_t* t, std::size_t n);
+
+    // Nominal frame rates of NTSC video are really 1000/1001 of the round number
+    double frame_rate(double fps);
+
+    // Times of a subtitle made for a video at 'from' frames per second, when
+    // played at 'to' frames per second instead
+    transform frame_rates(double from, double to);
+}
+
+// Automatic synchronization: the times of a track are matched to those when
+// something is said according to a reference (another subtitle of the same
+// video). The correction is a linear transform of all the times, for a change
+// of frame rate, then shifts of pieces of the track, for cuts and ad breaks.
+namespace align {
+    // Times when something is said: [starts[i], ends[i]) in milliseconds
+    struct activity {
+        std::vector<std::int64_t> starts;
+        std::vector<std::int64_t> ends;
+    };
+
+    struct options {
+        // Largest shift of the whole track
+        std::int64_t max_offset = 600000;
+        // Largest shift of a piece, relative to the whole track
+        std::int64_t max_jump = 30000;
+        // Resolution of the first searches
+        std::int64_t bin = 100;
+        // Length of the pieces that can be shifted on their own
+        std::int64_t window = 60000;
+    };
+
+    // 'tr' applies to all entries, then each shift (entry, msec) to an entry and
+    // all those after it, in order
+    struct correction {
+        linear::transform tr;
+        std::vector<std::pair<std::size_t, std::int64_t>> shifts;
+        // Fraction of the time of the track that matches the reference, before and
+        // after the correction
+        double before = 0.0;
+        double after = 0.0;
+    };
+
+    // Find the correction of 'track' (entry 'i' is the entry of the track with the
+    // same index) that best matches 'reference'
+    bool compute(const activity& track, const activity& reference, const options& o,
+        correction& c, std::string& err);
+}
+
+// Voice activity of the audio of a video, from a PCM WAV file, to align subtitles
+// on it when there is no other subtitle to use as a reference
+namespace audio {
+    struct wav_format {
+        std::size_t channels = 0;
+        std::size_t rate = 0;
+        // 8, 16, 24 or 32 bit integers, or 32 bit floats
+        std::size_t bits = 0;
+        bool floating = false;
+        std::uint64_t data_offset = 0;
+        std::uint64_t data_size = 0;
+
+        std::size_t frame_bytes() const {
+            return channels*(bits/8);
+        }
+
+        double seconds() const {
+            return double(data_size/frame_bytes())/rate;
+        }
+    };
+
+    bool read_header(int fd, wav_format& f, std::string& err);
+
+    // Sum of the squares of the samples (halved, so that pairs of squares fit in
+    // 32 bits) and number of sign changes, starting from the sample 'prev'
+    struct frame_stats {
+        std::uint64_t energy = 0;
+        std::uint64_t crossings = 0;
+    };
+
+    frame_stats analyze_scalar(const std::int16_t* s, std::size_t n, std::int16_t prev);
+
+#if defined(__x86_64__)
+    frame_stats analyze_sse2(const std::int16_t* s, std::size_t n, std::int16_t prev);
+
+    __attribute__((target("avx2")))
+    frame_stats analyze_avx2(const std::int16_t* s, std::size_t n, std::int16_t prev);
+#endif
+
+    frame_stats analyze(const std::int16_t* s, std::size_t n, std::int16_t prev);
+
+    struct options {
+        std::size_t frame_msec = 20;
+        // Pieces of a minute of audio are read and analyzed on their own
+        std::size_t piece_frames = 3000;
+        // Voice is louder than the noise floor by this fraction of the range between
+        // it and the loud parts (in dB)...
+        double threshold = 0.35;
+        // ...and changes sign less often than noise
+        double max_crossings_per_second = 5000.0;
+        // Short pauses are bridged, and short bursts ignored
+        std::int64_t min_pause = 300;
+        std::int64_t min_voice = 100;
+    };
+
+    // Times when something is said in a WAV file. The file is read on all threads,
+    // by blocks: memory only depends on its length by a few bytes per frame.
+    bool voice_activity(const std::string& file_name, const options& o,
+        align::activity& a, double& seconds, std::string& err);
+}
+
+// Non-owning view of a piece of text (C++11 has no std::string_view).
+struct text_view {
+    const char* data = nullptr;
+    std::size_t size = 0;
+
+    text_view() = default;
+    text_view(const char* d, std::size_t n) : data(d), size(n) {}
+
+    bool empty() const {
+        return size == 0;
+    }
+
+    std::string str() const {
+        return std::string(data, size);
+    }
+
+    std::size_t find(const std::string& str) const {
+        if (str.empty()) return 0;
+        return search::find_first(data, size, search::pattern(str, false));
+    }
+
+    std::size_t find(const search::pattern& pat) const {
+        if (pat.size() == 0) return 0;
+        return search::find_first(data, size, pat);
+    }
+};
+
+std::ostream& operator << (std::ostream& o, const text_view& t);
+
+struct entry {
+    std::size_t id;
+    time_key start;
+    time_key end;
+    text_view content;
+};
+
+namespace format {
+    const std::size_t max_entry_header_size = max_integer_size + 2*max_time_size + 8;
+
+    // Same layout as in the file: id, time tags, content and an empty line
+    char* entry(char* out, const ::entry& e);
+}
+
+std::ostream& operator << (std::ostream& o, const entry& e);
+
+// Identity of a file on disk, to detect modifications by other programs
+struct file_state {
+    dev_t device = 0;
+    ino_t inode = 0;
+    off_t size = -1;
+    time_t mtime = 0;
+    long mtime_ns = 0;
+
+    file_state() = default;
+
+    explicit file_state(const struct stat& st) : device(st.st_dev), inode(st.st_ino),
+        size(st.st_size), mtime(st.st_mtim.tv_sec), mtime_ns(st.st_mtim.tv_nsec) {}
+
+    bool read(const std::string& file_name) {
+        struct stat st;
+        if (::stat(file_name.c_str(), &st) != 0) return false;
+        *this = file_state(st);
+        return true;
+    }
+
+    bool operator == (const file_state& f) const {
+        return device == f.device && inode == f.inode && size == f.size &&
+            mtime == f.mtime && mtime_ns == f.mtime_ns;
+    }
+
+    bool operator != (const file_state& f) const {
+        return !(*this == f);
+    }
+};
+
+namespace hash {
+    inline std::uint64_t mix(std::uint64_t v) {
+        v ^= v >> 33;
+        v *= 0xff51afd7ed558ccdull;
+        v ^= v >> 33;
+        v *= 0xc4ceb9fe1a85ec53ull;
+        v ^= v >> 33;
+        return v;
+    }
+
+    // Fast non-cryptographic 64bit hash, eight bytes at a time
+    std::uint64_t bytes(const char* p, std::size_t n, std::uint64_t seed = 0);
+
+    // Same idea for large buffers, with four independent lanes so that the CPU
+    // can work on several words at once
+    std::uint64_t large(const char* p, std::size_t n);
+}
+
+// Read-only memory mapping of a whole file.
+class mapped_file {
+public :
+    mapped_file() = default;
+    mapped_file(const mapped_file&) = delete;
+    mapped_file& operator = (const mapped_file&) = delete;
+
+    ~mapped_file();
+
+    bool open(const std::string& file_name);
+
+    void close();
+
+    const char* data() const {
+        return data_;
+    }
+
+    std::size_t size() const {
+        return size_;
+    }
+
+    // State of the file when it was opened
+    const file_state& state() const {
+        return state_;
+    }
+
+private :
+    const char* data_ = nullptr;
+    std::size_t size_ = 0;
+    file_state state_;
+};
+
+// Array of values that are either owned, or borrowed from memory that someone
+// else keeps alive (e.g., a mapped cache file). Borrowed values are copied the
+// first time they are modified. Copies of a column share its values, until one
+// of them modifies them: taking a snapshot of a track does not copy it.
+template<typename T>
+class column {
+public :
+    std::size_t size() const {
+        return view_ ? view_size_ : owned_ ? owned_->size() : 0;
+    }
+
+    bool empty() const {
+        return size() == 0;
+    }
+
+    const T* data() const {
+        return view_ ? view_ : owned_ ? owned_->data() : nullptr;
+    }
+
+    const T& operator [] (std::size_t i) const {
+        return data()[i];
+    }
+
+    const T* begin() const {
+        return data();
+    }
+
+    const T* end() const {
+        return data() + size();
+    }
+
+    bool borrowed() const {
+        return view_ != nullptr;
+    }
+
+    void borrow(const T* p, std::size_t n) {
+        owned_.reset();
+        view_ = p;
+        view_size_ = n;
+    }
+
+    // The values, to modify them
+    std::vector<T>& own() {
+        if (view_) {
+            owned_ = std::make_shared<std::vector<T>>(view_, view_ + view_size_);
+            view_ = nullptr;
+            view_size_ = 0;
+        } else if (!owned_) {
+            owned_ = std::make_shared<std::vector<T>>();
+        } else if (owned_.use_count() > 1) {
+            owned_ = std::make_shared<std::vector<T>>(*owned_);
+        } else {
+            // The other copies may have just been released by another thread: see
+            // what it did with the values before changing them
+            std::atomic_thread_fence(std::memory_order_acquire);
+        }
+
+        return *owned_;
+    }
+
+    void push_back(const T& t) {
+        own().push_back(t);
+    }
+
+    void append(const column& c) {
+        std::vector<T>& v = own();
+        v.insert(v.end(), c.begin(), c.end());
+    }
+
+    void reserve(std::size_t n) {
+        own().reserve(n);
+    }
+
+    void clear() {
+        owned_.reset();
+        view_ = nullptr;
+        view_size_ = 0;
+    }
+
+    void shrink_to_fit() {
+        if (owned_ && owned_.use_count() == 1) owned_->shrink_to_fit();
+    }
+
+private :
+    std::shared_ptr<std::vector<T>> owned_;
+    const T* view_ = nullptr;
+    std::size_t view_size_ = 0;
+};
+
+// Charset and line ends of subtitle files. The track works on UTF-8 text with '\n'
+// line ends: files stored otherwise are converted when loaded, and back when saved.
+namespace encoding {
+    enum class charset {
+        utf8, utf16le, utf16be, cp1252
+    };
+
+    struct text_format {
+        charset set = charset::utf8;
+        // Starts with a byte order mark
+        bool bom = false;
+        // Lines end with "\r\n" (as the first one does)
+        bool crlf = false;
+        // The text is not UTF-8 with '\n' line ends as it is: it is converted when
+        // loaded (this also drops stray '\r' before '\n' in files saved with '\n')
+        bool converted = false;
+
+        // Saved as the track holds it
+        bool plain() const {
+            return set == charset::utf8 && !bom && !crlf;
+        }
+    };
+
+    const char* name(charset c);
+
+    // Format of the text [p, p+n): from its byte order mark, else UTF-16 if every
+    // other byte of its start is zero, else UTF-8 if it is valid, else Windows-1252
+    // (a superset of Latin-1)
+    text_format detect(const char* p, std::size_t n);
+
+    // UTF-8 text with '\n' line ends from text in format 'f'. Invalid UTF-16 gives
+    // U+FFFD; conversion never fails.
+    void decode(const text_format& f, const char* p, std::size_t n, std::string& out);
+
+    // Text in format 'f' from UTF-8 text with '\n' line ends
+    void encode(const text_format& f, const std::string& in, std::string& out);
+
+    // Size of the start of [p, p+n) that can be decoded on its own, when more text
+    // follows: it does not end within a character, a surrogate pair or "\r\n"
+    std::size_t complete(const text_format& f, const char* p, std::size_t n);
+
+    bool valid_utf8_scalar(const char* p, std::size_t n);
+
+    // Drop each '\r' before a '\n' in place, and return the new size
+    std::size_t remove_cr_scalar(char* p, std::size_t n);
+
+    // Convert the 'n' bytes of 'p' to UTF-8 in 'out', which must have room for 3n
+    // bytes, and return the number of bytes written
+    std::size_t from_utf16_scalar(const char* p, std::size_t n, bool big, char* out);
+
+    std::size_t from_cp1252_scalar(const char* p, std::size_t n, char* out);
+
+#if defined(__x86_64__)
+    bool valid_utf8_sse2(const char* p, std::size_t n);
+
+    std::size_t from_utf16_sse2(const char* p, std::size_t n, bool big, char* out);
+
+    std::size_t from_cp1252_sse2(const char* p, std::size_t n, char* out);
+
+    __attribute__((target("avx2")))
+    bool valid_utf8_avx2(const char* p, std::size_t n);
+
+    // Needs byte shuffles: there is no SSE2 version
+    __attribute__((target("avx2")))
+    std::size_t remove_cr_avx2(char* p, std::size_t n);
+
+    __attribute__((target("avx2")))
+    std::size_t from_utf16_avx2(const char* p, std::size_t n, bool big, char* out);
+
+    __attribute__((target("avx2")))
+    std::size_t from_cp1252_avx2(const char* p, std::size_t n, char* out);
+#endif
+
+    // Same as above with the best kernel; validation runs on all threads
+    bool valid_utf8(const char* p, std::size_t n);
+
+    std::size_t remove_cr(char* p, std::size_t n);
+
+    std::size_t from_utf16(const char* p, std::size_t n, bool big, char* out);
+
+    std::size_t from_cp1252(const char* p, std::size_t n, char* out);
+}
+
+// Owns the bytes the entries' content point to, addressed by offset: first the
+// mapped subtitle file, then private copies for the (rare) entries whose text is
+// not stored contiguously in the file, e.g., because of leading or trailing spaces.
+// Copies share the same bytes.
+class text_buffer {
+public :
+    bool open(const std::string& file_name);
+
+    // State of the file when it was loaded
+    const file_state& state() const {
+        return state_;
+    }
+
+    // How the file stores the text
+    const encoding::text_format& format() const {
+        return format_;
+    }
+
+    // The text of the file itself, i.e., offsets below size()
+    const char* data() const {
+        return data_;
+    }
+
+    // The text is read from the file itself, which must not be modified then
+    bool mapped() const {
+        return file_ != nullptr;
+    }
+
+    std::size_t size() const {
+        return size_;
+    }
+
+    text_view view(std::uint64_t offset, std::size_t size) const {
+        if (offset < size_) {
+            return text_view(data() + offset, size);
+        } else {
+            return text_view(spill_.data() + (offset - size_), size);
+        }
+    }
+
+    // Keep a copy of 's', and return its offset
+    std::uint64_t store(const std::string& s);
+
+    // Text that was stored, i.e., offsets from size() on
+    text_view spilled() const {
+        return text_view(spill_.data(), spill_.size());
+    }
+
+    // Own 's' instead of a file
+    void assign(std::string s);
+
+    // The mapping would be clobbered if the file was rewritten while it is
+    // still in use: move the text to private memory first.
+    void detach();
+
+private :
+    std::shared_ptr<mapped_file> file_;
+    std::shared_ptr<const std::string> copy_;
+    column<char> spill_;
+    const char* data_ = nullptr;
+    file_state state_;
+    encoding::text_format format_;
+    std::size_t size_ = 0;
+};
+
+// The entries of a subtitle file, one array per field, so that going through
+// one of them (e.g., the start times) does not drag the others along. The
+// content of each entry is a range of offsets in the track's text_buffer.
+struct entry_columns {
+    column<std::size_t> ids;
+    column<std::int64_t> starts;
+    column<std::int64_t> ends;
+    column<std::uint64_t> text_offsets;
+    column<std::uint32_t> text_sizes;
+    // Byte position of the entry's ID line in the file
+    column<std::uint64_t> positions;
+    // Keeps borrowed columns alive
+    std::shared_ptr<mapped_file> source;
+
+    std::size_t size() const {
+        return starts.size();
+    }
+
+    void shrink_to_fit() {
+        ids.shrink_to_fit();
+        starts.shrink_to_fit();
+        ends.shrink_to_fit();
+        text_offsets.shrink_to_fit();
+        text_sizes.shrink_to_fit();
+        positions.shrink_to_fit();
+    }
+};
+
+namespace parser {
+    const char* skip_blanks(const char* b, const char* e);
+
+    const char* skip_blanks_back(const char* b, const char* e);
+
+    // Only spaces, tabs or '\r': such lines end entries, like empty ones
+    bool blank(const char* b, const char* e);
+
+    // Same rules as reading an unsigned integer from an std::istream
+    bool parse_id(const char* b, const char* e, std::size_t& id);
+
+    const char* find(const char* b, const char* e, const char* str, std::size_t n);
+}
+
+// Parse the entries in bytes [begin, end) of 'data', which must start at line
+// 'first_line' right after an empty line (or at the start of the file).
+// Entries' content refer directly to 'data' whenever possible, otherwise to a
+// copy made by 'store(text)', which returns its offset.
+template<typename S>
+bool parse_entries(const char* data, std::size_t begin, std::size_t end,
+    std::size_t first_line, entry_columns& entries, S&& store) {
+
+    const char* data_end = data + end;
+    const char* p = data + begin;
+
+    const char arrow[] = " --> ";
+    const std::size_t arrow_size = sizeof(arrow) - 1;
+
+    std::size_t id = 0;
+    time_key start, stop;
+    std::size_t count = 0;
+    std::size_t l = first_line;
+
+    // Content is kept as a view [cb, ce) as long as lines follow each other;
+    // otherwise it is copied to 'spill'.
+    const char* cb = nullptr;
+    const char* ce = nullptr;
+    bool spilled = false;
+    std::string spill;
+
+    auto flush_entry = [&]() {
+        std::uint64_t offset = 0;
+        std::size_t size = 0;
+        if (spilled) {
+            offset = store(spill);
+            size = spill.size();
+            spill.clear();
+            spilled = false;
+        } else if (cb) {
+            offset = cb - data;
+            size = ce - cb;
+        }
+
+        if (size > std::numeric_limits<std::uint32_t>::max()) {
+            error("entry ", id, " is too long");
+            return false;
+        }
+
+        entries.ids.push_back(id);
+        entries.starts.push_back(start.msec());
+        entries.ends.push_back(stop.msec());
+        entries.text_offsets.push_back(offset);
+        entries.text_sizes.push_back(size);
+        cb = ce = nullptr;
+        count = 0;
+        return true;
+    };
+
+    while (p != data_end) {
+        ++l;
+        const char* eol = static_cast<const char*>(memchr(p, '\n', data_end - p));
+        const char* lb = p;
+        const char* le = eol ? eol : data_end;
+        p = eol ? eol + 1 : data_end;
+
+        if (parser::blank(lb, le)) {
+            if (count != 0 && !flush_entry()) {
+                return false;
+            }
+
+            continue;
+        }
+
+        const char* tb = parser::skip_blanks(lb, le);
+        const char* te = parser::skip_blanks_back(tb, le);
+
+        if (count == 0) {
+            entries.positions.push_back(lb - data);
+            if (!parser::parse_id(tb, te, id)) {
+                error("bad entry ID ('", std::string(tb, te), "')");
+                note("parsing l.", l);
+                return false;
+            }
+        } else if (count == 1) {
+            const char* sep = parser::find(tb, te, arrow, arrow_size);
+            const char* sep2 = sep ?
+                parser::find(sep + arrow_size, te, arrow, arrow_size) : nullptr;
+
+            if (sep && !sep2) {
+                std::string err;
+                start = time_key(tb, sep, err);
+                if (!start.valid()) {
+                    error(err);
+                    note("parsing l.", l, " start time (", std::string(tb, sep), ")");
+                    return false;
+                }
+
+                err.clear();
+                stop = time_key(sep + arrow_size, te, err);
+                if (!stop.valid()) {
+                    error(err);
+                    note("parsing l.", l, " end time (", std::string(sep + arrow_size, te), ")");
+                    return false;
+                }
+            } else {
+                error("bad time tag format ('", std::string(tb, te), "')");
+                note("expected <time1> --> <time2>");
+                note("parsing l.", l);
+                return false;
+            }
+        } else {
+            // Each line is stored trimmed and followed by a single '\n'
+            bool contiguous = !spilled && te != data_end && *te == '\n' &&
+                (count == 2 || tb == ce);
+
+            if (contiguous) {
+                if (count == 2) cb = tb;
+                ce = te + 1;
+            } else {
+                if (!spilled) {
+                    if (cb) spill.assign(cb, ce - cb);
+                    spilled = true;
+                }
+
+                spill.append(tb, te - tb);
+                spill += '\n';
+            }
+        }
+
+        ++count;
+    }
+
+    if (count != 0 && !flush_entry()) {
+        return false;
+    }
+
+    return true;
+}
+
+// Parse all the entries of a subtitle file, or of a piece of it that starts at
+// line 'first_line' right after an empty line.
+bool read_entries(text_buffer& buffer, entry_columns& entries, std::size_t first_line = 0);
+
+namespace parser {
+    // Start of the first line after an empty line, at or after byte 'from'
+    std::size_t next_entry(const char* data, std::size_t size, std::size_t from);
+}
+
+// Same as above for a whole file, split in pieces parsed by 'threads' threads.
+// The parser starts afresh after each empty line, so pieces start there and are
+// parsed exactly as in one go.
+bool read_entries(text_buffer& buffer, entry_columns& entries, std::size_t first_line,
+    std::size_t threads);
+
+// Fenwick tree of time offsets. Shifting all the entries from a given position
+// to the end is O(log n), and so is reading the resulting offset of an entry.
+// Nothing is allocated until the first shift.
+class offset_tree {
+public :
+    // A shift of entry 'from' and all those after it
+    struct shift {
+        std::size_t from;
+        std::int64_t msec;
+    };
+
+    void resize(std::size_t n) {
+        size_ = n;
+        tree_.clear();
+        delta_.clear();
+        log_.clear();
+        pending_ = false;
+    }
+
+    std::size_t size() const {
+        return size_;
+    }
+
+    // Add 'msec' to the offset of entry 'i' and all those after it
+    void add_from(std::size_t i, std::int64_t msec) {
+        if (i >= size_) return;
+
+        if (!pending_) {
+            tree_.assign(size_ + 1, 0);
+            delta_.assign(size_, 0);
+        }
+
+        delta_[i] += msec;
+        log_.push_back(shift{i, msec});
+        for (++i; i < tree_.size(); i += i & (~i + 1)) {
+            tree_[i] += msec;
+        }
+
+        pending_ = true;
+    }
+
+    // Total offset of entry 'i'
+    std::int64_t at(std::size_t i) const {
+        if (!pending_) return 0;
+
+        std::int64_t sum = 0;
+        for (++i; i != 0; i &= i - 1) {
+            sum += tree_[i];
+        }
+
+        return sum;
+    }
+
+    // Offset of entry 'i' relative to entry 'i-1', for sequential walks
+    std::int64_t delta(std::size_t i) const {
+        return pending_ ? delta_[i] : 0;
+    }
+
+    bool pending() const {
+        return pending_;
+    }
+
+    // The shifts added since the last resize, in order
+    const column<shift>& log() const {
+        return log_;
+    }
+
+private :
+    std::vector<std::int64_t> tree_;
+    std::vector<std::int64_t> delta_;
+    column<shift> log_;
+    std::size_t size_ = 0;
+    bool pending_ = false;
+};
+
+// The state of a track at some point, to save it while the track is being
+// edited. It shares its arrays with the track rather than copying them: the
+// shifts are kept as a list, which is short, instead of the offset tree.
+struct track_snapshot {
+    text_buffer text;
+    entry_columns entries;
+    column<offset_tree::shift> shifts;
+    // First entry modified since the previous snapshot
+    std::size_t from = 0;
+
+    std::size_t size() const {
+        return entries.size();
+    }
+
+    // Apply 'func(entry)' to all entries in order, starting at 'first'
+    template<typename F>
+    void for_each(std::size_t first, F&& func) const {
+        std::vector<offset_tree::shift> sorted(shifts.begin(), shifts.end());
+        std::sort(sorted.begin(), sorted.end(),
+            [](const offset_tree::shift& a, const offset_tree::shift& b) {
+                return a.from < b.from;
+            });
+
+        std::int64_t offset = 0;
+        auto s = sorted.begin();
+        for (std::size_t i = first; i < size(); ++i) {
+            for (; s != sorted.end() && s->from <= i; ++s) {
+                offset += s->msec;
+            }
+
+            entry e;
+            e.id = entries.ids.empty() ? i + 1 : entries.ids[i];
+            e.start = time_key(entries.starts[i] + offset);
+            e.end = time_key(entries.ends[i] + offset);
+            e.content = text.view(entries.text_offsets[i], entries.text_sizes[i]);
+            func(e);
+        }
+    }
+};
+
+// Start time order of the entries, to find them by time in O(log n). Entries are
+// grouped in segments of consecutive positions that share the same offset: a
+// shift only splits the segment it starts in, and leaves the order within each
+// segment unchanged. Segments that are already sorted in file order (the common
+// case) do not store their order.
+class time_index {
+public :
+    void build(const column<std::int64_t>& starts, const column<std::int64_t>& ends);
+
+    // Entries were sorted by start time when the index was built
+    bool sorted() const {
+        return sorted_;
+    }
+
+    // Entries from 'i' onward will have a different offset than those before
+    void split(std::size_t i);
+
+    // Entry with the earliest start at or after 't' (the first one in file order
+    // in case of a tie), or 'starts.size()' if none
+    std::size_t lower_bound(const column<std::int64_t>& starts, const offset_tree& offsets,
+        const time_key& t) const;
+
+    // All entries on screen at time 't' (start <= t < end), in start time order
+    void active(const column<std::int64_t>& starts, const column<std::int64_t>& ends,
+        const offset_tree& offsets, const time_key& t, std::vector<std::size_t>& out) const;
+
+private :
+    struct segment {
+        std::size_t begin = 0, end = 0;
+        bool sorted = true;
+        std::vector<std::size_t> order;
+    };
+
+    std::vector<segment> segments_;
+    std::int64_t max_duration_ = 0;
+    bool sorted_ = true;
+
+    // First position 'j' in the segment for which 'before(j)' is false
+    template<typename F>
+    static std::size_t first_(const segment& seg, F&& before) {
+
+        std::size_t lo = seg.begin, hi = seg.end;
+        while (lo < hi) {
+            std::size_t mid = lo + (hi - lo)/2;
+            if (before(mid)) {
+                lo = mid + 1;
+            } else {
+                hi = mid;
+            }
+        }
+
+        return lo;
+    }
+};
+
+// Trigram index of the entries' content: for each sequence of three bytes, the
+// sorted list of the entries that contain it. A search intersects the lists of
+// all the trigrams of the searched text, then only checks the entries left.
+class text_index {
+public :
+    void clear();
+
+    bool built() const {
+        return built_;
+    }
+
+    // Index the 'n' entries whose content is given by 'content(i)'
+    template<typename F>
+    void build(std::size_t n, F&& content) {
+        clear();
+        for (std::size_t i = 0; i < n; ++i) {
+            for_each_trigram_(content(i), [&](std::uint32_t key) {
+                auto& list = lists_[key];
+                if (list.empty() || list.back() != i) {
+                    list.push_back(i);
+                }
+            });
+        }
+
+        built_ = true;
+    }
+
+    // Entry 'i' now has 'content' (it was not indexed before)
+    void insert(std::size_t i, const text_view& content);
+
+    // Entry 'i' no longer has 'content'
+    void remove(std::size_t i, const text_view& content);
+
+    // All entries whose content contains 'str', in increasing order
+    template<typename F>
+    void find(std::size_t n, F&& content, const std::string& str,
+        std::vector<std::size_t>& out) const {
+
+        out.clear();
+        search::pattern pat(str, false);
+        if (str.size() < 3) {
+            // Too short to use the index
+            stats::add(stats::counter::search_comparisons, n);
+            for (std::size_t i = 0; i < n; ++i) {
+                if (content(i).find(pat) != std::string::npos) {
+                    out.push_back(i);
+                }
+            }
+
+            return;
+        }
+
+        std::vector<const std::vector<std::uint32_t>*> lists;
+        for_each_trigram_(text_view(str.data(), str.size()), [&](std::uint32_t key) {
+            auto found = lists_.find(key);
+            lists.push_back(found == lists_.end() ? nullptr : &found->second);
+        });
+
+        for (auto* l : lists) {
+            if (!l) return;
+        }
+
+        std::sort(lists.begin(), lists.end(),
+            [](const std::vector<std::uint32_t>* l1, const std::vector<std::uint32_t>* l2) {
+                return l1->size() < l2->size();
+            });
+
+        std::vector<std::uint32_t> candidates = *lists[0];
+        for (std::size_t k = 1; k < lists.size() && !candidates.empty(); ++k) {
+            intersect_(candidates, *lists[k]);
+        }
+
+        stats::add(stats::counter::search_comparisons, candidates.size());
+        for (auto i : candidates) {
+            if (content(i).find(pat) != std::string::npos) {
+                out.push_back(i);
+            }
+        }
+    }
+
+private :
+    std::unordered_map<std::uint32_t, std::vector<std::uint32_t>> lists_;
+    bool built_ = false;
+
+    template<typename F>
+    static void for_each_trigram_(const text_view& t, F&& func) {
+        if (t.size < 3) return;
+
+        const unsigned char* p = reinterpret_cast<const unsigned char*>(t.data);
+        std::uint32_t key = (p[0] << 8) | p[1];
+        for (std::size_t i = 2; i < t.size; ++i) {
+            key = ((key << 8) | p[i]) & 0xffffff;
+            func(key);
+        }
+    }
+
+    // Keep in 'a' only the elements also in 'b'; 'a' is the smallest
+    static void intersect_(std::vector<std::uint32_t>& a, const std::vector<std::uint32_t>& b);
+};
+
+// All the entries of a subtitle file. Time shifts are stored lazily in an
+// offset_tree, and resolved only when an entry's time is needed.
+class subtitle_track {
+public :
+    text_buffer& text() {
+        return text_;
+    }
+
+    const text_buffer& text() const {
+        return text_;
+    }
+
+    void assign(entry_columns entries);
+
+    std::size_t size() const {
+        return entries_.size();
+    }
+
+    bool empty() const {
+        return entries_.size() == 0;
+    }
+
+    std::size_t id(std::size_t i) const {
+        return entries_.ids.empty() ? i + 1 : entries_.ids[i];
+    }
+
+    time_key start(std::size_t i) const {
+        return time_key(entries_.starts[i] + offsets_.at(i));
+    }
+
+    time_key end(std::size_t i) const {
+        return time_key(entries_.ends[i] + offsets_.at(i));
+    }
+
+    text_view content(std::size_t i) const {
+        return text_.view(entries_.text_offsets[i], entries_.text_sizes[i]);
+    }
+
+    // Shift entry 'i' and all those after it
+    void shift(std::size_t i, std::int64_t msec);
+
+    // Apply a linear transform to the times of entry 'i' and all those after it
+    void retime(std::size_t i, const linear::transform& tr);
+
+    // Move entry 'order[k]' to position 'k', for all 'k', and give the entries
+    // the IDs 'ids' (none to number them from 1)
+    void reorder(const std::vector<std::size_t>& order, column<std::size_t> ids);
+
+    // The times of all entries, as they are now, to restore them later. This
+    // shares the arrays: it only costs a copy when they are next modified.
+    struct saved_times {
+        column<std::int64_t> starts;
+        column<std::int64_t> ends;
+        column<offset_tree::shift> shifts;
+    };
+
+    saved_times times() const;
+
+    // Go back to times saved earlier. Only entry 'i' and those after it changed
+    // since then.
+    void restore(const saved_times& t, std::size_t i);
+
+    // Exact searches need the text index: once it is built, searching only
+    // reads the track
+    bool text_indexed() const {
+        return text_index_.built();
+    }
+
+    void index_text();
+
+    // Entries were sorted by start time when loaded
+    bool sorted() const {
+        return index_.sorted();
+    }
+
+    // First entry that starts at or after 't', or size() if none
+    std::size_t find_time(const time_key& t) const {
+        return index_.lower_bound(entries_.starts, offsets_, t);
+    }
+
+    // Entries matching 'str' with at most 'max' edits (ignoring case if 'fold'),
+    // best matches first. 'distances' receives the edit distance of each match.
+    void find_fuzzy(const std::string& str, std::size_t max, bool fold,
+        std::vector<std::size_t>& found, std::vector<std::size_t>& distances);
+
+    // Entries displayed at time 't'
+    void find_active(const time_key& t, std::vector<std::size_t>& found) const;
+
+    // All entries containing 'str' (ignoring case if 'fold'), in increasing order.
+    // Exact searches go through the text index, built the first time it is
+    // needed; the others scan all the text in one pass.
+    void find_text(const std::string& str, bool fold, std::vector<std::size_t>& found);
+
+    // Make sure the file can be rewritten without affecting the content
+    void detach();
+
+    const entry_columns& columns() const {
+        return entries_;
+    }
+
+    // The current state, to be saved. Its 'from' is the first entry modified
+    // since the previous snapshot, or size() if none.
+    track_snapshot snapshot();
+
+private :
+    text_buffer text_;
+    entry_columns entries_;
+    offset_tree offsets_;
+    time_index index_;
+    text_index text_index_;
+    std::size_t dirty_from_ = 0;
+
+    // Add the pending shifts to the times themselves
+    void resolve_offsets_();
+
+    template<typename T>
+    static void permute_(column<T>& c, const std::vector<std::size_t>& order) {
+        if (c.size() != order.size()) return;
+
+        std::vector<T> v(order.size());
+        for (std::size_t k = 0; k < order.size(); ++k) {
+            v[k] = c[order[k]];
+        }
+
+        // Snapshots may share the old values: leave them alone
+        c.clear();
+        c.own().swap(v);
+    }
+};
+
+// Serialize entries 'from' and after into a single buffer. The position of
+// each entry, assuming the buffer is written at 'base', is stored in 'positions'.
+void write_entries(const track_snapshot& track, std::string& out, std::size_t from = 0,
+    std::uint64_t base = 0, std::vector<std::uint64_t>* positions = nullptr);
+
+// Consistency of the timeline and numbering of a track. The loader accepts entries
+// in any order and with any ID, but players expect them numbered from 1 in order,
+// each ending after it starts and before the next one.
+namespace check {
+    enum class problem {
+        reversed, unordered, overlap, duplicate_id, missing_id, too_short, too_long, count
+    };
+
+    struct issue {
+        problem what;
+        std::size_t entry;
+        // The earlier entry involved (unordered, overlap, duplicate_id), or the
+        // number of IDs missing before this one (missing_id)
+        std::size_t other;
+    };
+
+    struct options {
+        // Durations outside of this range (ms) are not plausible
+        std::int64_t min_duration = 100;
+        std::int64_t max_duration = 20000;
+    };
+
+    struct report {
+        // Sorted by entry
+        std::vector<issue> issues;
+        std::size_t counts[std::size_t(problem::count)] = {};
+
+        std::size_t count(problem p) const {
+            return counts[std::size_t(p)];
+        }
+
+        // Sorting and numbering the entries again fixes these
+        bool fixable() const {
+            return count(problem::unordered) != 0 || count(problem::duplicate_id) != 0 ||
+                count(problem::missing_id) != 0;
+        }
+    };
+
+    // Sweep through the entries in file order, in chunks checked in parallel
+    void run(const subtitle_track& t, const options& o, report& r);
+
+    // Positions of the entries sorted by start time, in file order for equal times
+    std::vector<std::size_t> sorted_order(const subtitle_track& t);
+
+    // Show the first 'max' issues, and how many there are of each kind
+    void print(const subtitle_track& t, const report& r, std::size_t max);
+}
+
+namespace file {
+    bool write_all(int fd, const char* p, std::size_t n, std::uint64_t pos);
+
+    // Same as above, at the current position, e.g., for pipes
+    bool write_all(int fd, const char* p, std::size_t n);
+
+    // Read what is available, up to 'n' bytes. Returns 0 at the end of the file,
+    // and -1 on error.
+    ssize_t read_some(int fd, char* p, std::size_t n);
+
+    bool read_all(int fd, char* p, std::size_t n, std::uint64_t pos);
+
+    std::string system_error(const std::string& what, const std::string& file_name);
+
+    // Write a complete new file next to the old one, then rename it over. The state
+    // of the new file is given to 'written(file_state)' just before the rename.
+    template<typename F>
+    bool replace(const std::string& file_name, const std::string& data, std::string& err,
+        F&& written) {
+        // Follow symbolic links, so that the link itself is not replaced
+        std::string target = file_name;
+        if (char* real = ::realpath(file_name.c_str(), nullptr)) {
+            target = real;
+            free(real);
+        }
+
+        std::string tmp = target + ".XXXXXX";
+        int fd = ::mkstemp(&tmp[0]);
+        if (fd < 0) {
+            err = system_error("cannot create temporary file", tmp);
+            return false;
+        }
+
+        struct stat st;
+        if (::stat(target.c_str(), &st) == 0) {
+            ::fchmod(fd, st.st_mode & 07777);
+        }
+
+        if (!write_all(fd, data.data(), data.size(), 0) || ::fdatasync(fd) != 0 ||
+            ::fstat(fd, &st) != 0) {
+            err = system_error("cannot write file", tmp);
+            ::close(fd);
+            ::unlink(tmp.c_str());
+            return false;
+        }
+
+        if (::close(fd) != 0) {
+            err = system_error("cannot write file", tmp);
+            ::unlink(tmp.c_str());
+            return false;
+        }
+
+        written(file_state(st));
+        if (::rename(tmp.c_str(), target.c_str()) != 0) {
+            err = system_error("cannot write file", target);
+            ::unlink(tmp.c_str());
+            return false;
+        }
+
+        return true;
+    }
+
+    bool replace(const std::string& file_name, const std::string& data, std::string& err);
+
+    // In-place updates first go to this file, so that an interrupted write can be
+    // finished when the subtitle is opened again.
+    std::string pending_name(const std::string& file_name);
+
+    const char pending_magic[8] = {'s','u','b','e','d','i','t','1'};
+
+    struct pending_header {
+        char magic[8];
+        std::uint64_t position;
+        std::uint64_t size;
+        std::uint64_t hash;
+    };
+
+    // Overwrite the file from 'pos' onward, and truncate what is left. The new state
+    // of the file is given to 'written(file_state)' before the update is marked done.
+    template<typename F>
+    bool update(const std::string& file_name, const std::string& data, std::uint64_t pos,
+        std::string& err, F&& written) {
+
+        std::string pending = pending_name(file_name);
+        int pfd = ::open(pending.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0600);
+        if (pfd < 0) {
+            err = system_error("cannot create file", pending);
+            return false;
+        }
+
+        pending_header h;
+        memcpy(h.magic, pending_magic, sizeof(h.magic));
+        h.position = pos;
+        h.size = data.size();
+        h.hash = hash::bytes(data.data(), data.size());
+
+        bool ok = write_all(pfd, reinterpret_cast<const char*>(&h), sizeof(h), 0) &&
+            write_all(pfd, data.data(), data.size(), sizeof(h)) && ::fdatasync(pfd) == 0;
+        ::close(pfd);
+        if (!ok) {
+            err = system_error("cannot write file", pending);
+            ::unlink(pending.c_str());
+            return false;
+        }
+
+        int fd = ::open(file_name.c_str(), O_WRONLY);
+        if (fd < 0) {
+            err = system_error("cannot open file", file_name);
+            return false;
+        }
+
+        struct stat st;
+        if (!write_all(fd, data.data(), data.size(), pos) ||
+            ::ftruncate(fd, pos + data.size()) != 0 || ::fdatasync(fd) != 0 ||
+            ::fstat(fd, &st) != 0) {
+            err = system_error("cannot write file", file_name);
+            ::close(fd);
+            return false;
+        }
+
+        if (::close(fd) != 0) {
+            err = system_error("cannot write file", file_name);
+            return false;
+        }
+
+        written(file_state(st));
+        ::unlink(pending.c_str());
+        return true;
+    }
+
+    // Complete an in-place update that was interrupted. Returns false only if the
+    // update was found complete but could not be applied.
+    bool recover(const std::string& file_name, bool& recovered, std::string& err);
+}
+
+// An edit of entry 'from' and all those after it, as kept for undo and redo
+struct edit {
+    enum kind_t {shift, retime, reorder};
+
+    kind_t kind = shift;
+    std::size_t from = 0;
+    std::int64_t msec = 0;
+    linear::transform tr;
+    // The times a retime replaced: rounding makes it impossible to compute them back
+    subtitle_track::saved_times before;
+    // The order a reorder put the entries in (worked out when first applied), and
+    // the IDs they had
+    std::vector<std::size_t> order;
+    column<std::size_t> ids;
+    // Part of the same command as the edit before it: undone and redone with it
+    bool joined = false;
+};
+
+// The edits of an interactive session are appended to 'file.subedit-journal' as
+// they are made, one line each, along with the state of the file after each save.
+// If the program stops before all of them are saved, they are replayed the next
+// time the file is opened. They are replayed on 'file.subedit-base', a hard link
+// to the file that was loaded: saves never write in place to that one (see
+// track_writer), so it keeps the original text.
+class edit_journal {
+public :
+    edit_journal(const std::string& file_name, const std::string& loaded_name) :
+        file_name_(file_name), loaded_name_(loaded_name),
+        journal_name_(file_name + ".subedit-journal"), base_name_(file_name + ".subedit-base") {}
+
+    edit_journal(const edit_journal&) = delete;
+    edit_journal& operator = (const edit_journal&) = delete;
+
+    ~edit_journal();
+
+    const std::string& base_name() const {
+        return base_name_;
+    }
+
+    bool started() const {
+        return fd_ >= 0;
+    }
+
+    // Read the journal left by an interrupted session: the edit lines in order, and
+    // the states the file was saved in. Returns false if there is none.
+    bool read(std::vector<std::string>& lines, std::vector<file_state>& saved) const;
+
+    // Start a new journal for edits of the file loaded in 'text'
+    bool start(const text_buffer& text, std::string& err);
+
+    // Go on with the journal of an interrupted session, once it was replayed
+    bool resume(std::string& err);
+
+    void record(const edit& e);
+
+    void undone();
+
+    void redone();
+
+    // The file is about to be in 'state', i.e., saved. Called from the saving thread.
+    void saved(const file_state& state);
+
+    // Stop recording; the journal is removed if all the edits were saved
+    void close(bool saved);
+
+private :
+    static constexpr const char* magic_ = "subedit-journal 1";
+
+    std::string file_name_;
+    std::string loaded_name_;
+    std::string journal_name_;
+    std::string base_name_;
+    int fd_ = -1;
+
+    // One write per line, in append mode: lines from both threads never mix.
+    // The journal is not synced: it is there for when the program stops, not the
+    // system.
+    void write_(const std::string& line);
+};
+
+// Saves snapshots of a track to disk, and remembers where each entry was written.
+// Only the entries that were modified since the last save are written, in place,
+// unless the file was changed by someone else or most of it has to be rewritten
+// anyway; then a new file atomically replaces it.
+class track_writer {
+public :
+    track_writer(const std::string& file_name, const subtitle_track& track,
+        edit_journal* journal = nullptr) :
+        file_name_(file_name), positions_(track.columns().positions),
+        disk_(track.text().state()), loaded_(track.text().state()), journal_(journal) {}
+
+    bool save(const track_snapshot& track, std::string& err);
+
+private :
+    std::string file_name_;
+    // Byte position of each entry in the file on disk
+    column<std::uint64_t> positions_;
+    // State of the file on disk when it was last read or written
+    file_state disk_;
+    // State of the file the track was loaded from
+    file_state loaded_;
+    // First entry of a failed save, to write again next time
+    std::size_t unsaved_from_ = std::size_t(-1);
+    edit_journal* journal_ = nullptr;
+};
+
+bool find_next(const subtitle_track& track, std::size_t& i, const std::string& str);
+
+bool find_previous(const subtitle_track& track, std::size_t& i, const std::string& str);
+
+// Results of a search, in the order they are browsed: by position for exact
+// searches, best match first for fuzzy ones
+struct search_results {
+    std::vector<std::size_t> entries;
+    std::vector<std::size_t> distances;
+    bool ranked = false;
+
+    // Number of results before entry 'i', and whether 'i' is itself a result
+    std::size_t rank(std::size_t i, bool& found) const;
+};
+
+// Options at the end of a search text, after a '/': 'i' to ignore case, '~' for
+// an approximate search, optionally followed by the maximum number of edits
+bool parse_search_flags(std::string& text, bool& fold, bool& fuzzy, std::size_t& max);
+
+// Arguments of the 'retime' command: either a factor and an optional offset in
+// seconds, or two anchors 'old=new', where both are time stamps
+bool parse_retime(const std::string& args, linear::transform& tr, std::string& err);
+
+// Arguments of the 'fps' command: the current and the new frame rates
+bool parse_frame_rates(const std::string& args, linear::transform& tr, std::string& err);
+
+// Edits applied to the entries as they go by, without loading the whole file:
+// for streams of any size. Entries are selected in file order.
+namespace stream {
+    // An edit of an entry and all those after it in the file
+    struct rule {
+        enum kind_t {
+            shift, shift_to, transform
+        };
+
+        kind_t kind = shift;
+        // Starting entry: number 'from', or the first one to start at or after
+        // 'time' (if 'by_time')
+        std::size_t from = 0;
+        bool by_time = false;
+        std::int64_t time = 0;
+
+        std::int64_t msec = 0;
+        std::int64_t target = 0;
+        linear::transform tr;
+        bool active = false;
+    };
+
+    // Same grammar as interactive commands, for those that only need to look
+    // forward: '#n', time stamps, shifts, 'retime' and 'fps'
+    bool parse_script(const std::string& script, std::vector<rule>& rules, std::string& err);
+
+    // Apply the rules to entry number 'index'. Entries must come in file order.
+    void apply(std::vector<rule>& rules, std::size_t index, std::int64_t& start,
+        std::int64_t& end);
+
+    // A run of consecutive entries, with their text
+    struct batch {
+        text_buffer text;
+        entry_columns entries;
+        std::size_t first = 0;
+        // Of the input, to write the output in
+        encoding::text_format format;
+    };
+
+    using queue = parallel::bounded_queue<std::unique_ptr<batch>>;
+
+    // Split the input after empty lines, i.e., between entries, in pieces of about
+    // 'block_size' bytes, and parse them. The input is converted to UTF-8 with '\n'
+    // line ends as it is read, from the format of its start.
+    bool read(int fd, queue& out);
+
+    void transform(std::vector<rule>& rules, queue& in, queue& out);
+
+    bool write(int fd, queue& in);
+
+    // Parse, edit and write the entries on three threads. Only a few batches are
+    // in flight at any time, so memory does not depend on the size of the input.
+    bool run(int in_fd, int out_fd, std::vector<rule>& rules);
+}
+
+void print_help();
+
+// Describe a transform for the user
+void note_transform(const linear::transform& tr);
+
+namespace timing {
+    // Wall clock time in seconds
+    double now();
+
+    // Milliseconds elapsed between 't0' and 't1', to a tenth
+    double msec(double t0, double t1);
+}
+
+// Saves snapshots of a track on a thread of its own, so that editing never waits
+// for the disk. A snapshot still waiting to be written when the next one comes is
+// replaced by it: only the latest state needs to reach the disk.
+class async_writer {
+public :
+    struct statistics {
+        // Saves written, and requests merged into a later one instead
+        std::size_t saved = 0;
+        std::size_t coalesced = 0;
+        std::size_t failed = 0;
+        // From the oldest request of a save to the save being on disk, in ms
+        double total_latency = 0.0;
+        double max_latency = 0.0;
+    };
+
+    explicit async_writer(track_writer& writer) : writer_(writer),
+        thread_([this]() { run_(); }) {}
+
+    async_writer(const async_writer&) = delete;
+    async_writer& operator = (const async_writer&) = delete;
+
+    // Pending saves are written before leaving
+    ~async_writer();
+
+    void save(track_snapshot s);
+
+    // The last save failed, and no other is pending
+    bool failed() const;
+
+    // A save is pending or being written
+    bool busy() const;
+
+    // Wait until all the saves requested so far are written
+    void sync();
+
+    // The errors of the failed saves since the last call
+    std::vector<std::string> errors();
+
+    statistics stats() const;
+
+private :
+    track_writer& writer_;
+    mutable std::mutex mutex_;
+    std::condition_variable changed_;
+    std::unique_ptr<track_snapshot> pending_;
+    double requested_ = 0.0;
+    bool writing_ = false;
+    bool failed_ = false;
+    bool stop_ = false;
+    std::vector<std::string> errors_;
+    statistics stats_;
+    std::thread thread_;
+
+    void run_();
+};
+
+// Open a subtitle file for 'track', finishing any interrupted save first
+bool open_track(const std::string& file_name, subtitle_track& track);
+
+bool parse_track(const std::string& file_name, subtitle_track& track);
+
+// Read a subtitle file into 'track'. Errors are reported.
+bool load_track(const std::string& file_name, subtitle_track& track);
+
+// An editing session: the current entry, the current search, and the commands
+// that act on them. Interactive sessions save each edit right away; scripts are
+// saved once at the end, only if all their commands succeeded.
+class session {
+public :
+    // Edits are recorded in 'journal', if given
+    session(subtitle_track& track, const std::string& file_name, bool interactive,
+        edit_journal* journal = nullptr);
+
+    // The user asked to quit
+    bool done() const {
+        return quit_;
+    }
+
+    // Display the current entry, unless the last command already said enough,
+    // then the prompt
+    void prompt();
+
+    // Save all the edits now
+    bool save();
+
+    // End of the session: wait for the edits saved in the background to be written.
+    // Returns false if they could not be.
+    bool finish();
+
+    // Apply the edits recorded in the journal of an interrupted session, and save
+    // the result
+    bool replay(const std::vector<std::string>& lines);
+
+    // Run one command. More input is read from 'in' if the command needs it
+    // (the corrected time after an empty line). Returns false if the command
+    // could not be carried out.
+    bool run(std::string s, std::istream& in);
+
+private :
+    subtitle_track& track_;
+    std::string file_name_;
+    bool interactive_ = true;
+    edit_journal* journal_ = nullptr;
+    // Edits in order, of which the first 'done_' are applied: the others were undone
+    std::vector<edit> history_;
+    std::size_t done_ = 0;
+    track_writer writer_;
+    std::unique_ptr<async_writer> saver_;
+    bool quit_ = false;
+    bool no_display_ = true;
+    bool search_mode_ = false;
+    std::string search_string_;
+    search_results matches_;
+    std::size_t cur_ = 0;
+
+    bool fail_();
+
+    // A time shift, given either as a number of seconds ('+1.5', '-2') or as
+    // the new time of the current entry
+    bool correction_(std::string s, std::int64_t& msec, std::string& err);
+
+    void shift_(std::int64_t msec);
+
+    // Match the times to those of a reference subtitle, with edits that are undone
+    // all at once
+    bool align_(std::string ref_name);
+
+    // Report what is wrong with the timeline and numbering. With 'fix', the entries
+    // are first sorted and numbered again, in an edit that can be undone; what this
+    // cannot fix is then only a warning.
+    bool check_(bool fix);
+
+    static align::activity activity_(const subtitle_track& t);
+
+    void apply_(edit& e);
+
+    // Apply a new edit; those that were undone cannot be redone anymore
+    void add_edit_(edit e);
+
+    // Apply a new edit, and write it to the journal
+    void record_(edit e);
+
+    // Revert the last edit applied, if any, along with those it is joined to.
+    // Returns the first of them; 'count' is how many there were.
+    const edit* undo_edit_(std::size_t* count = nullptr);
+
+    // Apply the last edit undone again, if any, along with those joined to it
+    const edit* redo_edit_(std::size_t* count = nullptr);
+
+    // Entries moved: the matches of the current search are not theirs anymore
+    void reordered_();
+
+    // The current entry and all those after it were modified
+    void edited_();
+
+    // Wait for the edits saved in the background to be written. A save that failed
+    // is tried again. Returns false if the edits could not be saved.
+    bool sync_(bool last);
+
+    // Tell about the background saves that failed. Returns false if any did.
+    bool report_saves_(bool last = false);
+
+    bool search_(const std::string& s);
+};
+
+// Binary sidecar of a subtitle file ('file.subidx') with its parsed entries.
+// Arrays are stored as they are in memory, so that they can be used straight
+// from a mapping of the file. It is only trusted if the subtitle file has the
+// same size, modification time and content hash as when it was written.
+namespace cache {
+    // Use and update cache files when loading subtitles
+    extern bool enabled;
+
+    std::string name(const std::string& file_name);
+
+    const char magic[8] = {'s','u','b','i','d','x','0','2'};
+
+    struct header {
+        char magic[8];
+        std::uint64_t file_size;
+        std::int64_t mtime;
+        std::int64_t mtime_ns;
+        std::uint64_t hash;
+        std::uint64_t count;
+        std::uint64_t spill_size;
+        std::uint64_t has_ids;
+        // Hash of everything after the header
+        std::uint64_t data_hash;
+    };
+
+    // Position of each array in the file, all aligned on 8 bytes
+    struct layout {
+        std::size_t starts, ends, text_offsets, positions, ids, text_sizes, spill, size;
+
+        layout(std::size_t n, bool has_ids, std::size_t spill_size) {
+            starts = sizeof(header);
+            ends = starts + 8*n;
+            text_offsets = ends + 8*n;
+            positions = text_offsets + 8*n;
+            ids = positions + 8*n;
+            text_sizes = ids + (has_ids ? 8*n : 0);
+            spill = text_sizes + (4*n + 7)/8*8;
+            size = spill + spill_size;
+        }
+    };
+
+    template<typename T>
+    void put_column(std::string& out, std::size_t pos, const column<T>& c) {
+        if (!c.empty()) memcpy(&out[pos], c.data(), c.size()*sizeof(T));
+    }
+
+    template<typename T>
+    void borrow_column(const mapped_file& m, std::size_t pos, std::size_t n, column<T>& c) {
+        c.borrow(reinterpret_cast<const T*>(m.data() + pos), n);
+    }
+
+    bool write(const std::string& file_name, const text_buffer& text,
+        const entry_columns& entries, std::string& err);
+
+    // Load the entries of the subtitle file in 'text' from its cache file, if
+    // there is a valid one
+    bool read(const std::string& file_name, text_buffer& text, entry_columns& entries);
+}
+
+// Run the commands of 'script' on a subtitle file, as a single edit: it is saved
+// (to 'output_name' if not empty) only if all of them succeed. The size of the
+// file is stored in 'bytes'.
+bool run_script(const std::string& file_name, const std::string& output_name,
+    const std::string& script, bool show_timings, std::uint64_t& bytes);
+
+// Subtitle files in a directory and its sub-directories, in name order
+bool list_files(const std::string& dir, std::vector<std::string>& files);
+
+// Run a script on many files at once. Each file is loaded, edited and saved on
+// its own: a failure only affects the file it happened in.
+int run_script_on_files(const std::vector<std::string>& files, const std::string& script,
+    std::size_t threads);
+
+// Keeps tracks loaded and edits them on request, for clients of a local socket.
+// Requests and replies are single lines; see print_help().
+namespace server {
+    // Many readers or a single writer. Writers go first, so that edits are not
+    // held back by a stream of reads.
+    class rw_lock {
+    public :
+        rw_lock();
+        ~rw_lock();
+
+        rw_lock(const rw_lock&) = delete;
+        rw_lock& operator=(const rw_lock&) = delete;
+
+        void lock();
+        void lock_shared();
+        void unlock();
+
+    private :
+        pthread_rwlock_t lock_;
+    };
+
+    // Holds 'l' for reading in its scope
+    class shared_lock {
+    public :
+        explicit shared_lock(rw_lock& l);
+        ~shared_lock();
+
+        shared_lock(const shared_lock&) = delete;
+        shared_lock& operator=(const shared_lock&) = delete;
+
+    private :
+        rw_lock& lock_;
+    };
+
+    struct loaded_track {
+        // Guards all but 'save_mutex' and 'writer'
+        rw_lock lock;
+        subtitle_track track;
+        bool loaded = false;
+        // Why it could not be loaded
+        std::string error;
+        // Edits since the last save
+        bool modified = false;
+
+        // Saves are written in the order of their snapshots
+        std::mutex save_mutex;
+        std::unique_ptr<track_writer> writer;
+    };
+
+    class store {
+    public :
+        // The track of 'file_name', loaded if it is not yet
+        std::shared_ptr<loaded_track> get(const std::string& file_name, std::string& err);
+
+        // Save a track and forget it
+        bool close(const std::string& file_name, std::string& err);
+
+        // Save all the tracks that were modified. Returns false if one failed.
+        bool save_all();
+
+        std::size_t size() const;
+
+    private :
+        mutable std::mutex mutex_;
+        std::unordered_map<std::string, std::shared_ptr<loaded_track>> tracks_;
+        // Tracks being saved by close(): they are loaded again once saved
+        std::unordered_map<std::string, std::shared_ptr<loaded_track>> closing_;
+        std::condition_variable closed_;
+    };
+
+    // Write the edits of a track to its file
+    bool save(loaded_track& t, std::string& err);
+
+    // Answer a request, with a single line (without its end). 'quit' is set if the
+    // client asked to be disconnected, and 'shutdown' if the server must stop.
+    void handle(store& tracks, const std::string& request, std::string& reply,
+        bool& quit, bool& shutdown);
+
+    // Serve the clients of the socket 'socket_name' until a 'shutdown' request
+    bool run(const std::string& socket_name);
+
+    // Connection to a server, for tools
+    class client {
+    public :
+        client() = default;
+        client(const client&) = delete;
+        client& operator=(const client&) = delete;
+
+        ~client();
+
+        bool connect(const std::string& socket_name, std::string& err);
+
+        // Send a request and wait for its reply
+        bool request(const std::string& line, std::string& reply, std::string& err);
+
+    private :
+        int fd_ = -1;
+        std::string pending_;
+    };
+
+    // Send all of 'data' to a socket
+    bool send_all(int fd, const char* data, std::size_t n);
+
+    // Read the next line from a socket into 'line', keeping what comes after it in
+    // 'pending'. Returns false at the end of the connection or on error.
+    bool read_line(int fd, std::string& pending, std::string& line);
+}
+
+#endif
@@ -0,0 +1,224 @@
+#include "subedit_lib.hpp"
+#include <random>
+
+// Load generator for 'subedit --serve': clients send a mix of requests on their
+// own connection for a while, and the throughput and latencies are reported.
+
+namespace load {
+    struct options {
+        std::string socket_name;
+        std::vector<std::string> files;
+        std::size_t clients = 4;
+        double duration = 2.0;
+        // Fractions of requests that are shifts and searches; the others are jumps
+        double shifts = 0.05;
+        double searches = 0.0;
+        std::string search_text = "the";
+    };
+
+    enum kind {
+        jump, shift, search, kinds
+    };
+
+    const char* kind_names[] = {"jump", "shift", "search"};
+
+    // Latencies in microseconds, of each kind of request
+    struct results {
+        std::vector<double> latencies[kinds];
+        std::size_t errors = 0;
+        std::string first_error;
+    };
+
+    void run_client(const options& o, std::size_t c, const std::vector<std::size_t>& sizes,
+        results& res) {
+
+        server::client cl;
+        std::string err, reply;
+        if (!cl.connect(o.socket_name, err)) {
+            ++res.errors;
+            res.first_error = err;
+            return;
+        }
+
+        std::mt19937_64 r(c + 1);
+        std::uniform_real_distribution<double> uniform(0.0, 1.0);
+        double t0 = timing::now();
+        // Shifts go back and forth, so that times stay where they were
+        std::int64_t sign = 1;
+        while (timing::now() - t0 < o.duration) {
+            std::size_t f = r() % o.files.size();
+            std::size_t entry = r() % sizes[f];
+            double u = uniform(r);
+            kind k = u < o.shifts ? shift : u < o.shifts + o.searches ? search : jump;
+
+            std::string line;
+            if (k == shift) {
+                line = "shift "+o.files[f]+" #"+std::to_string(entry)+(sign > 0 ? " +" : " -")+
+                    "0.001";
+                sign = -sign;
+            } else if (k == search) {
+                line = "search "+o.files[f]+" "+o.search_text;
+            } else {
+                line = "jump "+o.files[f]+" #"+std::to_string(entry);
+            }
+
+            double t1 = timing::now();
+            if (!cl.request(line, reply, err)) {
+                ++res.errors;
+                res.first_error = err;
+                return;
+            }
+
+            res.latencies[k].push_back((timing::now() - t1)*1e6);
+            if (reply.compare(0, 2, "ok") != 0) {
+                if (res.errors++ == 0) res.first_error = reply;
+            }
+        }
+
+        cl.request("quit", reply, err);
+    }
+
+    double percentile(std::vector<double>& v, double p) {
+        if (v.empty()) return 0.0;
+        std::size_t i = std::min(v.size() - 1, std::size_t(p*v.size()));
+        std::nth_element(v.begin(), v.begin() + i, v.end());
+        return v[i];
+    }
+}
+
+void print_usage() {
+    print("usage: subedit_load --socket sock [options] files...");
+    print("  --socket sock   : socket of a server started with 'subedit --serve sock'");
+    print("  --clients n     : number of clients sending requests at once (4)");
+    print("  --time s        : send requests for 's' seconds (2)");
+    print("  --shifts r      : fraction of requests that are shifts (0.05)");
+    print("  --searches r    : fraction of requests that are searches (0)");
+    print("  --search text   : what to search (the)");
+    print("  The other requests are jumps to random entries. Shifts go back and forth");
+    print("  by 1 ms, so the files are unchanged if they are saved afterwards.");
+}
+
+int main(int argc, char* argv[]) {
+    load::options opts;
+
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        if (arg == "-h" || arg == "--help") {
+            print_usage();
+            return 0;
+        } else if (arg.compare(0, 2, "--") != 0) {
+            opts.files.push_back(arg);
+            continue;
+        }
+
+        if (i + 1 == argc) {
+            error("unknown option or missing value: '", arg, "'");
+            return 1;
+        }
+
+        std::string value = argv[++i];
+        bool ok = true;
+        if (arg == "--socket") {
+            opts.socket_name = value;
+        } else if (arg == "--clients") {
+            ok = string::from_string(value, opts.clients) && opts.clients != 0;
+        } else if (arg == "--time") {
+            ok = string::from_string(value, opts.duration);
+        } else if (arg == "--shifts") {
+            ok = string::from_string(value, opts.shifts);
+        } else if (arg == "--searches") {
+            ok = string::from_string(value, opts.searches);
+        } else if (arg == "--search") {
+            opts.search_text = value;
+        } else {
+            error("unknown option '", arg, "'");
+            return 1;
+        }
+
+        if (!ok) {
+            error("invalid value for ", arg, ": '", value, "'");
+            return 1;
+        }
+    }
+
+    if (opts.socket_name.empty() || opts.files.empty()) {
+        print_usage();
+        return 1;
+    }
+
+    // Load the files first, to only measure requests on loaded tracks
+    std::vector<std::size_t> sizes;
+    {
+        server::client cl;
+        std::string err, reply;
+        if (!cl.connect(opts.socket_name, err)) {
+            error(err);
+            return 1;
+        }
+
+        for (auto& f : opts.files) {
+            double t0 = timing::now();
+            if (!cl.request("load "+f, reply, err)) {
+                error(err);
+                return 1;
+            }
+
+            std::size_t n = 0;
+            if (reply.compare(0, 3, "ok ") != 0 || !string::from_string(reply.substr(3), n) ||
+                n == 0) {
+                error("cannot load ", f, ": ", reply);
+                return 1;
+            }
+
+            note("loaded ", f, " (", n, " entries) in ", timing::msec(t0, timing::now()),
+                " ms");
+            sizes.push_back(n);
+        }
+    }
+
+    std::vector<load::results> results(opts.clients);
+    std::vector<std::thread> threads;
+    double t0 = timing::now();
+    for (std::size_t c = 0; c < opts.clients; ++c) {
+        threads.emplace_back([&, c]() {
+            load::run_client(opts, c, sizes, results[c]);
+        });
+    }
+
+    for (auto& t : threads) {
+        t.join();
+    }
+
+    double sec = std::max(timing::now() - t0, 1e-9);
+
+    std::size_t total = 0, errors = 0;
+    for (auto& r : results) {
+        if (r.errors != 0 && errors == 0) {
+            error(r.first_error);
+        }
+
+        errors += r.errors;
+    }
+
+    for (std::size_t k = 0; k < load::kinds; ++k) {
+        std::vector<double> all;
+        for (auto& r : results) {
+            all.insert(all.end(), r.latencies[k].begin(), r.latencies[k].end());
+        }
+
+        if (all.empty()) continue;
+
+        total += all.size();
+        double p50 = load::percentile(all, 0.5);
+        double p99 = load::percentile(all, 0.99);
+        double max = *std::max_element(all.begin(), all.end());
+        print(load::kind_names[k], ": ", all.size(), " requests, latency ",
+            std::round(p50*10)/10, " us median, ", std::round(p99*10)/10, " us 99th percentile, ",
+            std::round(max*10)/10, " us at most");
+    }
+
+    print("total: ", total, " requests in ", std::round(sec*100)/100, " s with ",
+        opts.clients, " clients: ", std::round(total/sec), " requests/s, ", errors, " errors");
+
+    return errors == 0 ? 0 : 1;
+}